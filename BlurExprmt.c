@@ -4,6 +4,7 @@
 #include <sys/time.h>
 #include "Utils.h"
 #include "Picture.h"
+#include "BufferPool.h"
 
 #define BLUR_REGION_SIZE 9
 #define MAX_THREAD 8
@@ -166,6 +167,13 @@ int main(int argc, char **argv)
     printf("%-33s%6lld milliseconds %14d\n", method_times[i].method,
            method_times[i].average_time, i + 1);
   }
+
+  /* Temporary pictures are recycled between blurs through the buffer pool. */
+  struct buffer_pool_stats stats = get_buffer_pool_stats();
+  printf("---------------------------------------------------------------------\n");
+  printf("Buffer pool: %lu hits, %lu misses (%.1f%% hit rate)\n",
+         stats.hits, stats.misses, 100.0 * buffer_pool_hit_rate(&stats));
+  drain_buffer_pool();
   return 0;
 }
 
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include "BufferPool.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* A released buffer waiting to be reused. */
+struct cached_buffer
+{
+  float *data;
+  size_t no_floats;
+  unsigned long released_at;
+};
+
+/* Pictures are usually transformed into a temporary of the same size, which
+   then replaces the original; recycling those planes between operations (and
+   between the threads running them) saves a large malloc/free pair per
+   operation and the page faults of touching freshly mapped memory. Buffers
+   are matched by exact size, so every distinct plane size is its own class. */
+static struct cached_buffer cache[POOL_MAX_BUFFERS];
+static int no_cached = 0;
+static struct buffer_pool_stats stats;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+   Allocates a new buffer. Large planes are aligned to a huge page and advised
+   to use transparent huge pages, cutting TLB misses on strided walks (such as
+   rotate's column reads); when huge pages are unavailable the advice is simply
+   ignored and ordinary pages are used. Explicit MAP_HUGETLB mappings are not
+   used, as they need a reserved hugetlbfs pool and would not be free()able.
+   Parameters:
+     - bytes: The size of the buffer.
+*/
+static float *allocate_buffer(size_t bytes)
+{
+  void *data;
+  bool huge = bytes >= HUGE_PAGE_SIZE;
+  if (posix_memalign(&data, huge ? HUGE_PAGE_SIZE : BUFFER_ALIGNMENT, bytes) != 0)
+  {
+    return NULL;
+  }
+#ifdef MADV_HUGEPAGE
+  if (huge)
+  {
+    madvise(data, bytes & ~(HUGE_PAGE_SIZE - 1), MADV_HUGEPAGE);
+  }
+#endif
+  return data;
+}
+
+/*
+   Removes a cached buffer from the pool, returning its data.
+   Parameters:
+     - i: The cache slot to remove (the pool lock must be held).
+*/
+static float *take_cached(int i)
+{
+  float *data = cache[i].data;
+  stats.cached_bytes -= cache[i].no_floats * sizeof(float);
+  cache[i] = cache[--no_cached];
+  return data;
+}
+
+float *acquire_buffer(size_t no_floats)
+{
+  float *data = NULL;
+
+  pthread_mutex_lock(&pool_lock);
+  /* Prefer the most recently released match, as it is likeliest to be warm. */
+  int best = -1;
+  for (int i = 0; i < no_cached; i++)
+  {
+    if (cache[i].no_floats == no_floats && (best < 0 || cache[i].released_at > cache[best].released_at))
+    {
+      best = i;
+    }
+  }
+  if (best >= 0)
+  {
+    data = take_cached(best);
+    stats.hits++;
+  }
+  else
+  {
+    stats.misses++;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  if (data == NULL)
+  {
+    data = allocate_buffer(no_floats * sizeof(float));
+  }
+  return data;
+}
+
+void release_buffer(float *data, size_t no_floats)
+{
+  float *evicted[POOL_MAX_BUFFERS];
+  int no_evicted = 0;
+  size_t bytes = no_floats * sizeof(float);
+
+  if (data == NULL)
+  {
+    return;
+  }
+  if (bytes > POOL_MAX_CACHED_BYTES)
+  {
+    pthread_mutex_lock(&pool_lock);
+    stats.dropped++;
+    pthread_mutex_unlock(&pool_lock);
+    free(data);
+    return;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  /* Make room by evicting the longest-idle buffers. */
+  while (no_cached == POOL_MAX_BUFFERS || stats.cached_bytes + bytes > POOL_MAX_CACHED_BYTES)
+  {
+    int oldest = 0;
+    for (int i = 1; i < no_cached; i++)
+    {
+      if (cache[i].released_at < cache[oldest].released_at)
+      {
+        oldest = i;
+      }
+    }
+    evicted[no_evicted++] = take_cached(oldest);
+    stats.dropped++;
+  }
+  cache[no_cached].data = data;
+  cache[no_cached].no_floats = no_floats;
+  cache[no_cached].released_at = ++stats.released;
+  no_cached++;
+  stats.cached_bytes += bytes;
+  pthread_mutex_unlock(&pool_lock);
+
+  /* Return evicted memory to the system outside the lock. */
+  for (int i = 0; i < no_evicted; i++)
+  {
+    free(evicted[i]);
+  }
+}
+
+void drain_buffer_pool(void)
+{
+  pthread_mutex_lock(&pool_lock);
+  while (no_cached > 0)
+  {
+    free(take_cached(no_cached - 1));
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+struct buffer_pool_stats get_buffer_pool_stats(void)
+{
+  pthread_mutex_lock(&pool_lock);
+  struct buffer_pool_stats snapshot = stats;
+  pthread_mutex_unlock(&pool_lock);
+  return snapshot;
+}
+
+double buffer_pool_hit_rate(struct buffer_pool_stats *pool_stats)
+{
+  unsigned long acquires = pool_stats->hits + pool_stats->misses;
+  return acquires == 0 ? 0.0 : (double)pool_stats->hits / acquires;
+}
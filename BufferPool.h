@@ -0,0 +1,42 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Most buffers cached at once, and the bytes they may hold between them. */
+#define POOL_MAX_BUFFERS 16
+#define POOL_MAX_CACHED_BYTES ((size_t)512 * 1024 * 1024)
+
+/* Every buffer starts on a cache line; buffers of at least a huge page are
+   huge-page aligned and advised to be backed by transparent huge pages. */
+#define BUFFER_ALIGNMENT 64
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+/* Counters describing how well the pool has been recycling buffers. */
+struct buffer_pool_stats
+{
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long released;
+  unsigned long dropped;
+  size_t cached_bytes;
+};
+
+// take a buffer of exactly no_floats floats, reusing a released one of the
+// same size when available (its contents are then left as they were); new
+// buffers are aligned as above and can be released with free()
+float *acquire_buffer(size_t no_floats);
+
+// hand a malloc'd buffer back to the pool for reuse (or free it when the pool
+// is full)
+void release_buffer(float *data, size_t no_floats);
+
+// free every cached buffer
+void drain_buffer_pool(void);
+
+// snapshot of the pool's counters, and the fraction of acquires it served
+struct buffer_pool_stats get_buffer_pool_stats(void);
+double buffer_pool_hit_rate(struct buffer_pool_stats *stats);
+
+#endif
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "Utils.h"
+#include "Picture.h"
+#include "SharedPic.h"
+
+  #define TRANSFER_BUFFER_SIZE 4096
+  #define SHARED_NAME "shared"
+
+  // Stores the two ends of a script transfer
+  struct transfer {
+    FILE *script;
+    int fd;
+    // picture handed to the server in shared memory (--shm mode only)
+    struct picture *shared;
+  };
+
+  // connect to a running picture server, returning the socket (or -1)
+  static int connect_to_server(const char *socket_path){
+    struct sockaddr_un addr;
+    if(strlen(socket_path) >= sizeof(addr.sun_path)){
+      return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd == -1){
+      return -1;
+    }
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  static bool send_text(int fd, const char *text){
+    size_t len = strlen(text);
+    return write(fd, text, len) == (ssize_t)len;
+  }
+
+  // stream the whole script to the server, then signal end of input; in --shm
+  // mode the shared picture is attached first and detached before "exit"
+  static void *send_script(void *transfer_arg){
+    struct transfer *transfer = (struct transfer *)transfer_arg;
+    char line[TRANSFER_BUFFER_SIZE];
+    bool ok = true;
+
+    if(transfer->shared != NULL){
+      ok = send_with_fd(transfer->fd, "attach " SHARED_NAME "\n", transfer->shared->shm_fd);
+    }
+    while(ok && fgets(line, sizeof(line), transfer->script) != NULL){
+      char cmd[sizeof(line)];
+      if(transfer->shared != NULL && sscanf(line, "%s", cmd) == 1 && !strcmp(cmd, "exit")){
+        break;
+      }
+      // the server stops reading once the script has run "exit"
+      ok = send_text(transfer->fd, line);
+    }
+    if(ok && transfer->shared != NULL){
+      send_text(transfer->fd, "detach " SHARED_NAME "\nexit\n");
+    }
+    shutdown(transfer->fd, SHUT_WR);
+    return NULL;
+  }
+
+  // decode the input picture straight into a fresh shared segment
+  static bool fill_shared_picture(struct picture *shared, const char *input){
+    struct picture pic;
+    if(!init_picture_from_file(&pic, input)){
+      printf("[!] error reading from file %s (check it exists)\n", input);
+      return false;
+    }
+    bool created = create_shared_picture(shared, pic.width, pic.height);
+    if(created){
+      copy_picture_pixels(shared, &pic);
+    }
+    clear_picture(&pic);
+    return created;
+  }
+
+  // save the segment returned by "detach" to the requested output file
+  static void save_returned_picture(int segment_fd, const char *output){
+    struct picture result;
+    if(segment_fd == -1 || !map_shared_picture(&result, segment_fd)){
+      printf("[!] server returned no usable shared segment\n");
+      return;
+    }
+    save_picture_to_file(&result, output);
+    clear_picture(&result);
+  }
+
+// ---------- MAIN PROGRAM ---------- \\
+
+  int main(int argc, char **argv){
+
+    bool shm_mode = argc >= 5 && !strcmp(argv[2], "--shm");
+    int script_arg = shm_mode ? 5 : 2;
+    if(argc != script_arg && argc != script_arg + 1){
+      printf("usage: ./picture_client <socket_path> [script_file]\n");
+      printf("       ./picture_client <socket_path> --shm <input> <output> [script_file]\n");
+      return 1;
+    }
+
+    struct transfer transfer;
+    struct picture shared;
+    transfer.shared = NULL;
+    transfer.script = argc > script_arg ? fopen(argv[script_arg], "r") : stdin;
+    if(transfer.script == NULL){
+      printf("[!] error reading from file %s (check it exists)\n", argv[script_arg]);
+      return 1;
+    }
+    // with --shm the input is handed over, without copying, as picture "shared"
+    if(shm_mode){
+      if(!fill_shared_picture(&shared, argv[3])){
+        return 1;
+      }
+      transfer.shared = &shared;
+    }
+
+    transfer.fd = connect_to_server(argv[1]);
+    if(transfer.fd == -1){
+      printf("[!] unable to connect to picture server at %s\n", argv[1]);
+      return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // send and receive concurrently, so large outputs can never stall the script
+    pthread_t sender;
+    pthread_create(&sender, NULL, send_script, &transfer);
+
+    char buf[TRANSFER_BUFFER_SIZE];
+    size_t len = 0;
+    int segment_fd = -1;
+    for(;;){
+      int fds[MAX_PASSED_FDS];
+      int nfds;
+      ssize_t got = receive_with_fds(transfer.fd, buf + len, sizeof(buf) - len, fds, &nfds);
+      for(int i = 0; i < nfds; i++){
+        if(segment_fd == -1){
+          segment_fd = fds[i];
+        } else {
+          close(fds[i]);
+        }
+      }
+      if(got <= 0){
+        break;
+      }
+      len += got;
+
+      // relay complete lines, picking out the reply to "detach"
+      char *start = buf;
+      char *newline;
+      while((newline = memchr(start, '\n', len - (start - buf))) != NULL){
+        *newline = '\0';
+        if(shm_mode && !strncmp(start, "detached " SHARED_NAME " ", strlen("detached " SHARED_NAME " "))){
+          save_returned_picture(segment_fd, argv[4]);
+          segment_fd = -1;
+        } else {
+          printf("%s\n", start);
+        }
+        start = newline + 1;
+      }
+      len -= start - buf;
+      memmove(buf, start, len);
+      if(len == sizeof(buf)){
+        fwrite(buf, 1, len, stdout);
+        len = 0;
+      }
+      fflush(stdout);
+    }
+    fwrite(buf, 1, len, stdout);
+
+    // the server may finish (on "exit") before the whole script has been sent
+    pthread_detach(sender);
+    return 0;
+  }
@@ -5,12 +5,47 @@
 #include "Picture.h"
 #include "PicProcess.h"
 #include "PicStore.h"
+#include "PicInterp.h"
+#include "PicServer.h"
 
 // ---------- MAIN PROGRAM ---------- \\
 
   int main(int argc, char **argv){
 
     printf("Running the Interactive C Picture Processing Library... \n");
-    //TODO: implement the interactive command-line interpreter for the Optional Extension
 
+    // one warm store (and worker pool) serves the whole process
+    struct pic_store store;
+    if(!init_picstore(&store, default_pool_size())){
+      printf("[!] unable to start the picture store\n");
+      exit(IO_ERROR);
+    }
+
+    // server mode: accept interpreter sessions on a Unix domain socket
+    if(argc > 1 && !strcmp(argv[1], "--serve")){
+      if(argc != 3){
+        printf("usage: ./concurrent_picture_lib --serve <socket_path>\n");
+        destroy_picstore(&store);
+        exit(IO_ERROR);
+      }
+      bool served = run_server(&store, argv[2]);
+      destroy_picstore(&store);
+      return served ? 0 : IO_ERROR;
+    }
+
+    struct pic_session session;
+    open_session(&store, &session, stdout, IO_ERROR);
+
+    // pre-load any pictures given on the command line
+    for(int i = 1; i < argc; i++){
+      char name[MAX_COMMAND_LENGTH];
+      picture_name_from_path(argv[i], name, sizeof(name));
+      load_picture(&session, argv[i], name, 1, NULL, LOAD_DEMAND_UNKNOWN, NULL);
+    }
+
+    run_interpreter(&session, stdin);
+
+    close_session(&session);
+    destroy_picstore(&store);
+    return 0;
   }
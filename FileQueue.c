@@ -0,0 +1,457 @@
+#include "FileQueue.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/* io_uring has no glibc wrappers, so its system calls are made directly. */
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING 1
+#endif
+
+#define FALLBACK_IO_THREADS 4
+
+/* A single read or write of a whole file, in flight. */
+struct file_request
+{
+  struct file_queue *queue;
+  int fd;
+  bool write;
+  unsigned char *data;
+  size_t size;
+  size_t transferred;
+  struct iovec iov;
+  file_done done;
+  void *arg;
+};
+
+/*
+   Completes a request: closes its file, hands the result to its callback and
+   frees a slot for another request.
+   Parameters:
+     - req: The finished request.
+     - ok: Whether the whole file was read or written.
+*/
+static void finish_request(struct file_request *req, bool ok)
+{
+  struct file_queue *queue = req->queue;
+  close(req->fd);
+  if (req->write || !ok)
+  {
+    free(req->data);
+    req->data = NULL;
+  }
+  req->done(req->arg, req->data, req->size, ok);
+  free(req);
+
+  pthread_mutex_lock(&queue->lock);
+  queue->in_flight--;
+  pthread_cond_broadcast(&queue->has_room);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/* Takes a slot for a new request, waiting while the queue is full. */
+static void claim_slot(struct file_queue *queue)
+{
+  pthread_mutex_lock(&queue->lock);
+  while (queue->in_flight == queue->depth)
+  {
+    pthread_cond_wait(&queue->has_room, &queue->lock);
+  }
+  queue->in_flight++;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/* Points the request's buffer at the part of the file still to transfer. */
+static void advance_request(struct file_request *req)
+{
+  req->iov.iov_base = req->data + req->transferred;
+  req->iov.iov_len = req->size - req->transferred;
+}
+
+#ifdef HAVE_IO_URING
+
+/*
+   Adds one entry to the submission ring and tells the kernel about it.
+   Parameters:
+     - queue: The file queue whose ring to submit to.
+     - req: The request to read or write the rest of, or NULL for the no-op
+            that stops the reaper thread.
+   Returns whether the kernel accepted the entry.
+*/
+static bool submit_entry(struct file_queue *queue, struct file_request *req)
+{
+  struct file_ring *ring = &queue->ring;
+  pthread_mutex_lock(&queue->lock);
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  if (req == NULL)
+  {
+    sqe->opcode = IORING_OP_NOP;
+  }
+  else
+  {
+    sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = req->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&req->iov;
+    sqe->len = 1;
+    sqe->off = req->transferred;
+  }
+  sqe->user_data = (uint64_t)(uintptr_t)req;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  int submitted;
+  do
+  {
+    submitted = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+  } while (submitted < 0 && errno == EINTR);
+  pthread_mutex_unlock(&queue->lock);
+  return submitted == 1;
+}
+
+/*
+   Reaper loop: waits for completions and finishes their requests, submitting
+   the rest of any short transfer again, until the stopping no-op completes.
+   Parameters:
+     - queue_arg: The file_queue the ring belongs to.
+*/
+static void *reap_completions(void *queue_arg)
+{
+  struct file_queue *queue = (struct file_queue *)queue_arg;
+  struct file_ring *ring = &queue->ring;
+
+  for (;;)
+  {
+    if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+    {
+      return NULL;
+    }
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      struct file_request *req = (struct file_request *)(uintptr_t)cqe->user_data;
+      int res = cqe->res;
+      __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+      if (req == NULL)
+      {
+        return NULL;
+      }
+      if (res > 0)
+      {
+        req->transferred += res;
+      }
+      if (res > 0 && req->transferred < req->size)
+      {
+        advance_request(req);
+        if (submit_entry(queue, req))
+        {
+          continue;
+        }
+      }
+      finish_request(req, res >= 0 && req->transferred == req->size);
+    }
+  }
+}
+
+/*
+   Sets up a ring with room for the queue's depth of requests, mapping it
+   into the process and starting its reaper thread.
+   Parameters:
+     - queue: The file queue to set the ring up for.
+   Returns false if the kernel does not offer io_uring (or forbids it).
+*/
+static bool init_ring(struct file_queue *queue)
+{
+  struct file_ring *ring = &queue->ring;
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, queue->depth, &params);
+  if (ring->fd < 0)
+  {
+    return false;
+  }
+
+  ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  /* Newer kernels share a single mapping between both rings. */
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    ring->sq_size = ring->cq_size = ring->sq_size > ring->cq_size ? ring->sq_size : ring->cq_size;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_base = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+  ring->cq_base = ring->sq_base;
+  if (ring->sq_base != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+  {
+    ring->cq_base = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+  }
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                    IORING_OFF_SQES);
+  if (ring->sq_base == MAP_FAILED || ring->cq_base == MAP_FAILED || ring->sqes == MAP_FAILED)
+  {
+    goto fail;
+  }
+
+  unsigned char *sq = ring->sq_base;
+  unsigned char *cq = ring->cq_base;
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  /* The queue never has more requests in flight than the ring has entries. */
+  if (queue->depth > (int)params.sq_entries)
+  {
+    queue->depth = params.sq_entries;
+  }
+  if (pthread_create(&ring->reaper, NULL, reap_completions, queue) == 0)
+  {
+    return true;
+  }
+
+fail:
+  if (ring->sqes != MAP_FAILED)
+  {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_base != MAP_FAILED && ring->cq_base != ring->sq_base)
+  {
+    munmap(ring->cq_base, ring->cq_size);
+  }
+  if (ring->sq_base != MAP_FAILED)
+  {
+    munmap(ring->sq_base, ring->sq_size);
+  }
+  close(ring->fd);
+  return false;
+}
+
+/* Stops the reaper (once every request has finished) and unmaps the ring. */
+static void destroy_ring(struct file_queue *queue)
+{
+  struct file_ring *ring = &queue->ring;
+  /* A reaper that cannot be stopped is left the ring rather than joined. */
+  if (!submit_entry(queue, NULL))
+  {
+    pthread_detach(ring->reaper);
+    return;
+  }
+  pthread_join(ring->reaper, NULL);
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_base != ring->sq_base)
+  {
+    munmap(ring->cq_base, ring->cq_size);
+  }
+  munmap(ring->sq_base, ring->sq_size);
+  close(ring->fd);
+}
+
+#else
+
+static bool submit_entry(struct file_queue *queue, struct file_request *req)
+{
+  return false;
+}
+
+static bool init_ring(struct file_queue *queue)
+{
+  return false;
+}
+
+static void destroy_ring(struct file_queue *queue)
+{
+}
+
+#endif
+
+/*
+   Runs a request with blocking reads or writes on one of the I/O threads.
+   Parameters:
+     - req_arg: The file_request to run.
+*/
+static void run_blocking_request(void *req_arg)
+{
+  struct file_request *req = (struct file_request *)req_arg;
+  while (req->transferred < req->size)
+  {
+    ssize_t res = req->write ? pwrite(req->fd, req->iov.iov_base, req->iov.iov_len, req->transferred)
+                             : pread(req->fd, req->iov.iov_base, req->iov.iov_len, req->transferred);
+    if (res < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (res <= 0)
+    {
+      break;
+    }
+    req->transferred += res;
+    advance_request(req);
+  }
+  finish_request(req, req->transferred == req->size);
+}
+
+bool init_file_queue(struct file_queue *queue, int depth)
+{
+  queue->depth = depth;
+  queue->in_flight = 0;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->has_room, NULL);
+  queue->uring = init_ring(queue);
+  if (queue->uring)
+  {
+    return true;
+  }
+  if (!init_thread_pool(&queue->io_threads, FALLBACK_IO_THREADS))
+  {
+    pthread_cond_destroy(&queue->has_room);
+    pthread_mutex_destroy(&queue->lock);
+    return false;
+  }
+  return true;
+}
+
+void destroy_file_queue(struct file_queue *queue)
+{
+  pthread_mutex_lock(&queue->lock);
+  while (queue->in_flight > 0)
+  {
+    pthread_cond_wait(&queue->has_room, &queue->lock);
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  if (queue->uring)
+  {
+    destroy_ring(queue);
+  }
+  else
+  {
+    destroy_thread_pool(&queue->io_threads);
+  }
+  pthread_cond_destroy(&queue->has_room);
+  pthread_mutex_destroy(&queue->lock);
+}
+
+/*
+   Starts a request on an open file, through the ring or an I/O thread.
+   Parameters:
+     - queue: The file queue to run the request on.
+     - req: The request, with its file and buffer set up.
+*/
+static void start_request(struct file_queue *queue, struct file_request *req)
+{
+  claim_slot(queue);
+  advance_request(req);
+  /* Empty files have nothing to transfer. */
+  if (req->size == 0)
+  {
+    finish_request(req, true);
+    return;
+  }
+  bool started = queue->uring ? submit_entry(queue, req)
+                              : submit_task(&queue->io_threads, run_blocking_request, req);
+  if (!started)
+  {
+    finish_request(req, false);
+  }
+}
+
+/*
+   Creates a request for a file that has just been opened.
+   Parameters:
+     - queue: The file queue the request is for.
+     - fd: Descriptor of the open file.
+     - write: Whether the request writes the file (rather than reads it).
+     - done, arg: The callback to report the result to, and its argument.
+   Returns the request, or NULL (having closed fd) if memory ran out.
+*/
+static struct file_request *make_request(struct file_queue *queue, int fd, bool write, file_done done, void *arg)
+{
+  struct file_request *req = malloc(sizeof(struct file_request));
+  if (req == NULL)
+  {
+    close(fd);
+    return NULL;
+  }
+  req->queue = queue;
+  req->fd = fd;
+  req->write = write;
+  req->data = NULL;
+  req->size = 0;
+  req->transferred = 0;
+  req->done = done;
+  req->arg = arg;
+  return req;
+}
+
+bool queue_file_read(struct file_queue *queue, const char *path, file_done done, void *arg)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+  {
+    if (fd != -1)
+    {
+      close(fd);
+    }
+    return false;
+  }
+  struct file_request *req = make_request(queue, fd, false, done, arg);
+  if (req == NULL)
+  {
+    return false;
+  }
+  req->size = st.st_size;
+  req->data = malloc(req->size > 0 ? req->size : 1);
+  if (req->data == NULL)
+  {
+    close(fd);
+    free(req);
+    return false;
+  }
+  start_request(queue, req);
+  return true;
+}
+
+void prefetch_file(const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd != -1)
+  {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+  }
+}
+
+bool queue_file_write(struct file_queue *queue, const char *path, unsigned char *data, size_t size,
+                      file_done done, void *arg)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  struct file_request *req = fd == -1 ? NULL : make_request(queue, fd, true, done, arg);
+  if (req == NULL)
+  {
+    free(data);
+    return false;
+  }
+  req->data = data;
+  req->size = size;
+  start_request(queue, req);
+  return true;
+}
@@ -0,0 +1,73 @@
+#ifndef FILEQUEUE_H
+#define FILEQUEUE_H
+
+#include "ThreadPool.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// kernel's submission and completion entries (see <linux/io_uring.h>)
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/* Called once a queued read or write has finished, on the queue's own threads
+   (so it should only hand the result on). A successful read passes the whole
+   file, which the callback then owns; a failed one passes NULL. */
+typedef void (*file_done)(void *arg, unsigned char *data, size_t size, bool ok);
+
+/* The submission and completion rings shared with the kernel by io_uring,
+   together with the thread reaping their completions. */
+struct file_ring
+{
+  int fd;
+  void *sq_base;
+  size_t sq_size;
+  void *cq_base;
+  size_t cq_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  pthread_t reaper;
+};
+
+/* Reads and writes of whole files with many requests in flight at once:
+   through io_uring where the kernel offers it, and otherwise on a few threads
+   doing blocking I/O. */
+struct file_queue
+{
+  bool uring;
+  struct file_ring ring;
+  struct thread_pool io_threads;
+
+  int depth;
+  int in_flight;
+  pthread_mutex_t lock;
+  pthread_cond_t has_room;
+};
+
+// file queue lifecycle (destroying a queue waits for its requests to finish)
+bool init_file_queue(struct file_queue *queue, int depth);
+void destroy_file_queue(struct file_queue *queue);
+
+// queue a read of the whole file at path (false if it cannot be opened)
+bool queue_file_read(struct file_queue *queue, const char *path, file_done done, void *arg);
+
+// ask the kernel to start reading the file at path into its page cache, for
+// a read expected soon (nothing is read into the process, so a later read
+// still sees the file as it is then)
+void prefetch_file(const char *path);
+
+// queue data to be written out as the file at path, which takes ownership of
+// data (freed once written, or straight away if the file cannot be created)
+bool queue_file_write(struct file_queue *queue, const char *path, unsigned char *data, size_t size,
+                      file_done done, void *arg);
+
+#endif
@@ -0,0 +1,1181 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "JpegDecode.h"
+#include "ThreadPool.h"
+
+/* Reuse stb's JPEG internals (Huffman decoding, IDCT, upsampling and colour
+   conversion kernels) privately; sod.c carries its own public copy. */
+#define STB_IMAGE_STATIC
+#define STBI_ONLY_JPEG
+#define STB_IMAGE_IMPLEMENTATION
+#include "sod_img_reader.h"
+
+#define RGB_BYTES 3
+#define BLOCK_SIZE 8
+/* MCU rows of component data kept resident while streaming: the row being
+   upsampled and the row after it (upsampling reads one row ahead). */
+#define RING_MCU_ROWS 2
+/* Row bands per worker when upsampling a parallel-decoded picture. */
+#define BANDS_PER_WORKER 2
+
+/* Progress of one component through the upsampler, in component rows. */
+struct component_stream
+{
+  /* Edge of the decoded blocks: BLOCK_SIZE, or fewer when the IDCT reduces
+     them (see scaled_idct_block). */
+  int block_w, block_h;
+  /* First component column upsampled (beyond 0 only for a region). */
+  int col0;
+  resample_row_func resample;
+  int hs, vs;
+  int w_lores;
+  int ystep;
+  int ypos;
+  int row0, row1;
+  int ring_rows;
+  void *raw_ring;
+};
+
+struct jpeg_decoder
+{
+  FILE *file;
+  /* The whole file, when it is decoded from memory (file then reads it). */
+  const unsigned char *memory;
+  size_t memory_size;
+  stbi__context s;
+  stbi__jpeg j;
+  int width;
+  int height;
+  int next_row;
+
+  /* Picture pixels per decoded pixel (1, 2, 4 or 8), and the basis of the
+     reduced IDCTs: basis[n][x][u] weighs frequency u at pixel x of a block
+     reduced to 1 << n pixels across. */
+  int scale;
+  float basis[4][BLOCK_SIZE][BLOCK_SIZE];
+
+  /* Streaming state (baseline, single interleaved scan). */
+  bool streaming;
+  bool is_rgb;
+  bool truncated;
+  int mcu_rows_decoded;
+  /* MCU columns that are inverse transformed (the others are only
+     entropy-decoded), and the columns of each row handed out: out_w pixels
+     from out_offset in the upsampled rows. */
+  int mcu_col_begin, mcu_col_end;
+  int out_offset, out_w;
+  /* The rest of the scan, once read into memory to seek between restart
+     intervals. */
+  stbi_uc *scan;
+  struct component_stream comps[RGB_BYTES];
+  stbi_uc *row;
+
+  /* Whole-picture fallback. */
+  stbi_uc *pixels;
+};
+
+/*
+   Address of a component row inside its ring of decoded MCU rows.
+   Parameters:
+     - dec: The decoder.
+     - k: The component.
+     - row: The component row (in full component coordinates).
+*/
+static stbi_uc *component_row(struct jpeg_decoder *dec, int k, int row)
+{
+  return dec->j.img_comp[k].data + (size_t)(row % dec->comps[k].ring_rows) * dec->j.img_comp[k].w2;
+}
+
+static void free_rings(struct jpeg_decoder *dec)
+{
+  for (int k = 0; k < RGB_BYTES; k++)
+  {
+    free(dec->comps[k].raw_ring);
+    dec->comps[k].raw_ring = NULL;
+    free(dec->j.img_comp[k].linebuf);
+    dec->j.img_comp[k].linebuf = NULL;
+  }
+  free(dec->row);
+  dec->row = NULL;
+}
+
+/*
+   Inverse transforms the lowest width x height frequencies of a block into a
+   width x height block of pixels, each about the average of the pixels the
+   full IDCT would produce in its place (as libjpeg's reduced IDCTs do).
+   Parameters:
+     - dec: The decoder, holding the bases.
+     - c: The component, giving the reduced block size.
+     - out: The top left pixel of the output block.
+     - out_stride: Bytes from one output row to the next.
+     - data: The dequantised coefficients, in natural order.
+*/
+static void scaled_idct_block(struct jpeg_decoder *dec, const struct component_stream *c, stbi_uc *out, int out_stride,
+                              const short data[64])
+{
+  float (*basis_x)[BLOCK_SIZE] = dec->basis[__builtin_ctz(c->block_w)];
+  float (*basis_y)[BLOCK_SIZE] = dec->basis[__builtin_ctz(c->block_h)];
+  float columns[BLOCK_SIZE][BLOCK_SIZE];
+
+  for (int u = 0; u < c->block_w; u++)
+  {
+    for (int y = 0; y < c->block_h; y++)
+    {
+      float sum = 0.0f;
+      for (int v = 0; v < c->block_h; v++)
+      {
+        sum += basis_y[y][v] * data[v * BLOCK_SIZE + u];
+      }
+      columns[y][u] = sum;
+    }
+  }
+  for (int y = 0; y < c->block_h; y++)
+  {
+    for (int x = 0; x < c->block_w; x++)
+    {
+      float sum = 128.5f;
+      for (int u = 0; u < c->block_w; u++)
+      {
+        sum += basis_x[x][u] * columns[y][u];
+      }
+      out[y * out_stride + x] = sum <= 0.0f ? 0 : sum >= 255.0f ? 255 : (stbi_uc)sum;
+    }
+  }
+}
+
+/*
+   Entropy-decodes one interleaved MCU into the component planes.
+   Parameters:
+     - dec: The decoder owning the planes.
+     - z: The entropy decoder state to read with (dec->j, or a copy of it).
+     - i: The MCU column.
+     - j: The MCU row.
+*/
+static bool decode_mcu(struct jpeg_decoder *dec, stbi__jpeg *z, int i, int j)
+{
+  STBI_SIMD_ALIGN(short, data[64]);
+  for (int k = 0; k < z->scan_n; ++k)
+  {
+    int n = z->order[k];
+    for (int y = 0; y < z->img_comp[n].v; ++y)
+    {
+      for (int x = 0; x < z->img_comp[n].h; ++x)
+      {
+        struct component_stream *c = &dec->comps[n];
+        int x2 = (i * z->img_comp[n].h + x) * c->block_w;
+        int y2 = (j * z->img_comp[n].v + y) * c->block_h;
+        int ha = z->img_comp[n].ha;
+        if (!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq]))
+        {
+          return false;
+        }
+        /* Blocks outside a region are only read past. */
+        if (i < dec->mcu_col_begin || i >= dec->mcu_col_end)
+        {
+          continue;
+        }
+        if (c->block_w == BLOCK_SIZE && c->block_h == BLOCK_SIZE)
+        {
+          z->idct_block_kernel(component_row(dec, n, y2) + x2, z->img_comp[n].w2, data);
+        }
+        else
+        {
+          scaled_idct_block(dec, c, component_row(dec, n, y2) + x2, z->img_comp[n].w2, data);
+        }
+      }
+    }
+  }
+  return true;
+}
+
+/*
+   Entropy-decodes a run of interleaved MCUs (numbered in raster order) into
+   the component rings, following stbi__parse_entropy_coded_data (including
+   its restart handling).
+   Parameters:
+     - dec: The streaming decoder.
+     - first: The first MCU of the run.
+     - end: The MCU after the run.
+*/
+static bool decode_mcus(struct jpeg_decoder *dec, int first, int end)
+{
+  stbi__jpeg *z = &dec->j;
+
+  /* Like stb, a corrupt stream leaves the remaining MCUs undecoded. */
+  for (int m = first; m < end && !dec->truncated; ++m)
+  {
+    if (!decode_mcu(dec, z, m % z->img_mcu_x, m / z->img_mcu_x))
+    {
+      return false;
+    }
+    if (--z->todo <= 0)
+    {
+      if (z->code_bits < 24)
+      {
+        stbi__grow_buffer_unsafe(z);
+      }
+      if (!STBI__RESTART(z->marker))
+      {
+        dec->truncated = true;
+        return true;
+      }
+      stbi__jpeg_reset(z);
+    }
+  }
+  return true;
+}
+
+/*
+   Entropy-decodes the next row of interleaved MCUs into the component rings.
+   Parameters:
+     - dec: The streaming decoder.
+*/
+static bool decode_mcu_row(struct jpeg_decoder *dec)
+{
+  int j = dec->mcu_rows_decoded++;
+  return decode_mcus(dec, j * dec->j.img_mcu_x, (j + 1) * dec->j.img_mcu_x);
+}
+
+/*
+   Upsamples the next row of one component and advances its progress.
+   Parameters:
+     - dec: The decoder owning the component planes.
+     - k: The component.
+     - c: The component's progress (dec->comps[k], or a copy of it).
+     - linebuf: Scratch space of at least width + 3 bytes.
+*/
+static stbi_uc *resample_component(struct jpeg_decoder *dec, int k, struct component_stream *c, stbi_uc *linebuf)
+{
+  int y_bot = c->ystep >= (c->vs >> 1);
+  stbi_uc *line0 = component_row(dec, k, c->row0);
+  stbi_uc *line1 = component_row(dec, k, c->row1);
+  stbi_uc *out = c->resample(linebuf, (y_bot ? line1 : line0) + c->col0, (y_bot ? line0 : line1) + c->col0, c->w_lores, c->hs);
+  if (++c->ystep >= c->vs)
+  {
+    c->ystep = 0;
+    c->row0 = c->row1;
+    if (++c->ypos < dec->j.img_comp[k].y)
+    {
+      c->row1++;
+    }
+  }
+  return out;
+}
+
+/*
+   Converts the handed out columns of one row of upsampled components into
+   interleaved RGB.
+   Parameters:
+     - dec: The decoder.
+     - coutput: The upsampled row of each component.
+     - row: Scratch space of 4 bytes per pixel (the YCbCr kernels write alpha).
+     - rgb: The scanline to fill.
+*/
+static void convert_row(struct jpeg_decoder *dec, stbi_uc *coutput[RGB_BYTES], stbi_uc *row, unsigned char *rgb)
+{
+  stbi_uc *c0 = coutput[0] + dec->out_offset;
+  stbi_uc *c1 = coutput[1] + dec->out_offset;
+  stbi_uc *c2 = coutput[2] + dec->out_offset;
+  if (dec->is_rgb)
+  {
+    for (int i = 0; i < dec->out_w; i++)
+    {
+      rgb[i * RGB_BYTES] = c0[i];
+      rgb[i * RGB_BYTES + 1] = c1[i];
+      rgb[i * RGB_BYTES + 2] = c2[i];
+    }
+  }
+  else
+  {
+    dec->j.YCbCr_to_RGB_kernel(row, c0, c1, c2, dec->out_w, RGB_BYTES);
+    memcpy(rgb, row, (size_t)dec->out_w * RGB_BYTES);
+  }
+}
+
+/*
+   Lays out the MCU grid of a baseline colour frame, as stb does on reaching
+   the first scan, and sizes the component planes for the decoded picture.
+   When it is reduced, each component's blocks are reduced only as far as
+   they need to be: subsampled chroma keeps the frequencies that luma drops,
+   and is upsampled less (or not at all).
+   Parameters:
+     - dec: The decoder, positioned just after the frame header.
+*/
+static void set_mcu_geometry(struct jpeg_decoder *dec)
+{
+  stbi__jpeg *z = &dec->j;
+  int h_max = 1, v_max = 1;
+
+  for (int k = 0; k < RGB_BYTES; k++)
+  {
+    if (z->img_comp[k].h > h_max) h_max = z->img_comp[k].h;
+    if (z->img_comp[k].v > v_max) v_max = z->img_comp[k].v;
+  }
+  z->img_h_max = h_max;
+  z->img_v_max = v_max;
+  z->img_mcu_w = h_max * BLOCK_SIZE;
+  z->img_mcu_h = v_max * BLOCK_SIZE;
+  z->img_mcu_x = (dec->s.img_x + z->img_mcu_w - 1) / z->img_mcu_w;
+  z->img_mcu_y = (dec->s.img_y + z->img_mcu_h - 1) / z->img_mcu_h;
+  for (int k = 0; k < RGB_BYTES; k++)
+  {
+    struct component_stream *c = &dec->comps[k];
+    /* Decoded pixels each block covers, if it were not upsampled. */
+    int span_w = BLOCK_SIZE * h_max / z->img_comp[k].h / dec->scale;
+    int span_h = BLOCK_SIZE * v_max / z->img_comp[k].v / dec->scale;
+    c->block_w = span_w < BLOCK_SIZE ? span_w : BLOCK_SIZE;
+    c->block_h = span_h < BLOCK_SIZE ? span_h : BLOCK_SIZE;
+    c->hs = span_w / c->block_w;
+    c->vs = span_h / c->block_h;
+    z->img_comp[k].x = (dec->width + c->hs - 1) / c->hs;
+    z->img_comp[k].y = (dec->height + c->vs - 1) / c->vs;
+    z->img_comp[k].w2 = z->img_mcu_x * z->img_comp[k].h * c->block_w;
+  }
+  dec->mcu_col_begin = 0;
+  dec->mcu_col_end = z->img_mcu_x;
+}
+
+/*
+   Reads the remaining tables up to the scan header, which must be the single
+   scan of all three components, and notes the colour model.
+   Parameters:
+     - dec: The decoder, positioned after the frame header.
+*/
+static bool read_scan_header(struct jpeg_decoder *dec)
+{
+  stbi__jpeg *z = &dec->j;
+  int m = stbi__get_marker(z);
+  while (!stbi__SOS(m))
+  {
+    if (m == STBI__MARKER_none)
+    {
+      if (stbi__at_eof(&dec->s))
+      {
+        return false;
+      }
+    }
+    else if (stbi__EOI(m) || stbi__DNL(m) || !stbi__process_marker(z, m))
+    {
+      return false;
+    }
+    m = stbi__get_marker(z);
+  }
+  /* Only single-scan files can be decoded in MCU row order. */
+  if (!stbi__process_scan_header(z) || z->scan_n != RGB_BYTES)
+  {
+    return false;
+  }
+  dec->is_rgb = z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif);
+  stbi__jpeg_reset(z);
+  return true;
+}
+
+/*
+   Prepares MCU-row streaming once the frame header has been read: sizes the
+   component rings in place of stb's whole-picture planes, then reads the
+   remaining tables up to the (single) scan header.
+   Parameters:
+     - dec: The decoder, positioned just after the frame header.
+*/
+static bool start_streaming(struct jpeg_decoder *dec)
+{
+  stbi__jpeg *z = &dec->j;
+
+  if (z->progressive || dec->s.img_n != RGB_BYTES)
+  {
+    return false;
+  }
+  set_mcu_geometry(dec);
+
+  for (int k = 0; k < RGB_BYTES; k++)
+  {
+    struct component_stream *c = &dec->comps[k];
+    c->ring_rows = RING_MCU_ROWS * z->img_comp[k].v * c->block_h;
+    c->raw_ring = malloc((size_t)z->img_comp[k].w2 * c->ring_rows + 15);
+    z->img_comp[k].linebuf = malloc(dec->width + 3);
+    if (c->raw_ring == NULL || z->img_comp[k].linebuf == NULL)
+    {
+      return false;
+    }
+    /* Align blocks for the SIMD IDCT, as stb does. */
+    z->img_comp[k].data = (stbi_uc *)(((size_t)c->raw_ring + 15) & ~15);
+
+    c->ystep = c->vs >> 1;
+    c->w_lores = (dec->width + c->hs - 1) / c->hs;
+    c->ypos = 0;
+    c->row0 = c->row1 = 0;
+    if (c->hs == 1 && c->vs == 1) c->resample = resample_row_1;
+    else if (c->hs == 1 && c->vs == 2) c->resample = stbi__resample_row_v_2;
+    else if (c->hs == 2 && c->vs == 1) c->resample = stbi__resample_row_h_2;
+    else if (c->hs == 2 && c->vs == 2) c->resample = z->resample_row_hv_2_kernel;
+    else c->resample = stbi__resample_row_generic;
+  }
+  /* The YCbCr kernels write a fourth (alpha) byte per pixel. */
+  dec->row = malloc((size_t)dec->width * 4);
+  if (dec->row == NULL)
+  {
+    return false;
+  }
+  return read_scan_header(dec);
+}
+
+/*
+   Averages each scale x scale box of a whole decoded picture into one pixel
+   (boxes at the right and bottom edges may be partial), in place.
+   Parameters:
+     - dec: The decoder, holding the full-size pixels.
+*/
+static void shrink_pixels(struct jpeg_decoder *dec)
+{
+  int full_w = dec->s.img_x, full_h = dec->s.img_y;
+  for (int y = 0; y < dec->height; y++)
+  {
+    int y0 = y * dec->scale, y1 = y0 + dec->scale < full_h ? y0 + dec->scale : full_h;
+    for (int x = 0; x < dec->width; x++)
+    {
+      int x0 = x * dec->scale, x1 = x0 + dec->scale < full_w ? x0 + dec->scale : full_w;
+      int count = (y1 - y0) * (x1 - x0);
+      for (int c = 0; c < RGB_BYTES; c++)
+      {
+        int sum = 0;
+        for (int yy = y0; yy < y1; yy++)
+        {
+          for (int xx = x0; xx < x1; xx++)
+          {
+            sum += dec->pixels[((size_t)yy * full_w + xx) * RGB_BYTES + c];
+          }
+        }
+        /* Rows of the output never overtake the rows still to be read. */
+        dec->pixels[((size_t)y * dec->width + x) * RGB_BYTES + c] = (stbi_uc)((sum + count / 2) / count);
+      }
+    }
+  }
+}
+
+/*
+   Decodes the whole picture with stb, for JPEGs that cannot be streamed; a
+   reduced picture is then shrunk, as no reduced IDCT is available.
+   Parameters:
+     - dec: The decoder, whose file is rewound and read again.
+*/
+static bool decode_whole_picture(struct jpeg_decoder *dec)
+{
+  int w, h, c;
+  free_rings(dec);
+  fseek(dec->file, 0, SEEK_SET);
+  dec->pixels = stbi_load_from_file(dec->file, &w, &h, &c, RGB_BYTES);
+  if (dec->pixels == NULL || c != RGB_BYTES)
+  {
+    return false;
+  }
+  if (dec->scale > 1)
+  {
+    shrink_pixels(dec);
+  }
+  return true;
+}
+
+/*
+   Reads the frame header of a JPEG.
+   Parameters:
+     - file: The open file, which the decoder takes over (it is closed on
+             failure).
+*/
+static struct jpeg_decoder *read_frame_header(FILE *file)
+{
+  struct jpeg_decoder *dec = calloc(1, sizeof(struct jpeg_decoder));
+  if (dec == NULL)
+  {
+    fclose(file);
+    return NULL;
+  }
+  dec->file = file;
+  stbi__start_file(&dec->s, dec->file);
+  dec->j.s = &dec->s;
+  stbi__setup_jpeg(&dec->j);
+  dec->j.restart_interval = 0;
+  if (!stbi__decode_jpeg_header(&dec->j, STBI__SCAN_header))
+  {
+    close_jpeg_decoder(dec);
+    return NULL;
+  }
+  dec->width = dec->s.img_x;
+  dec->height = dec->s.img_y;
+  dec->scale = 1;
+  dec->out_w = dec->width;
+  return dec;
+}
+
+/*
+   Reduces the picture a decoder produces, and prepares the bases of its
+   reduced IDCTs.
+   Parameters:
+     - dec: The decoder, just after its frame header has been read.
+     - scale: Picture pixels per decoded pixel (1, 2, 4 or 8).
+*/
+static void set_decoder_scale(struct jpeg_decoder *dec, int scale)
+{
+  dec->scale = scale;
+  dec->width = (dec->s.img_x + scale - 1) / scale;
+  dec->height = (dec->s.img_y + scale - 1) / scale;
+  dec->out_w = dec->width;
+  for (int n = 0; n < 4; n++)
+  {
+    int size = 1 << n;
+    for (int x = 0; x < size; x++)
+    {
+      for (int u = 0; u < size; u++)
+      {
+        float weight = u == 0 ? (float)M_SQRT1_2 : 1.0f;
+        dec->basis[n][x][u] = 0.5f * weight * cosf((float)((2 * x + 1) * u * M_PI / (2 * size)));
+      }
+    }
+  }
+}
+
+struct jpeg_decoder *open_jpeg_decoder(const char *path)
+{
+  return open_scaled_jpeg_decoder(path, 1);
+}
+
+/*
+   Opens a JPEG for decoding at a scale.
+   Parameters:
+     - file: The open file, which the decoder takes over (it is closed on
+             failure).
+     - memory, size: The whole file, if it is being read from memory (file
+                     then being a stream over it), or NULL.
+     - scale: Picture pixels per decoded pixel (1, 2, 4 or 8).
+*/
+static struct jpeg_decoder *open_decoder(FILE *file, const unsigned char *memory, size_t size, int scale)
+{
+  if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+  {
+    fclose(file);
+    return NULL;
+  }
+  struct jpeg_decoder *dec = read_frame_header(file);
+  if (dec == NULL)
+  {
+    return NULL;
+  }
+  dec->memory = memory;
+  dec->memory_size = size;
+  set_decoder_scale(dec, scale);
+  dec->streaming = start_streaming(dec);
+  if (!dec->streaming && !decode_whole_picture(dec))
+  {
+    close_jpeg_decoder(dec);
+    return NULL;
+  }
+  return dec;
+}
+
+struct jpeg_decoder *open_scaled_jpeg_decoder(const char *path, int scale)
+{
+  FILE *file = fopen(path, "rb");
+  return file == NULL ? NULL : open_decoder(file, NULL, 0, scale);
+}
+
+struct jpeg_decoder *open_jpeg_decoder_from_memory(const unsigned char *data, size_t size, int scale)
+{
+  FILE *file = size > 0 ? fmemopen((void *)data, size, "rb") : NULL;
+  return file == NULL ? NULL : open_decoder(file, data, size, scale);
+}
+
+bool read_jpeg_dimensions(const char *path, int *width, int *height)
+{
+  int comp;
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+  {
+    return false;
+  }
+  bool found = stbi_info_from_file(f, width, height, &comp) && comp == RGB_BYTES;
+  fclose(f);
+  return found;
+}
+
+int jpeg_decoder_width(struct jpeg_decoder *dec)
+{
+  return dec->width;
+}
+
+int jpeg_decoder_height(struct jpeg_decoder *dec)
+{
+  return dec->height;
+}
+
+bool read_jpeg_row(struct jpeg_decoder *dec, unsigned char *rgb)
+{
+  if (dec->next_row >= dec->height)
+  {
+    return false;
+  }
+  if (!dec->streaming)
+  {
+    memcpy(rgb, dec->pixels + (size_t)dec->next_row++ * dec->width * RGB_BYTES, (size_t)dec->width * RGB_BYTES);
+    return true;
+  }
+
+  /* Upsample each component, decoding further MCU rows as they are needed. */
+  stbi_uc *coutput[RGB_BYTES];
+  for (int k = 0; k < RGB_BYTES; k++)
+  {
+    struct component_stream *c = &dec->comps[k];
+    int rows_per_mcu = dec->j.img_comp[k].v * c->block_h;
+    while (c->row1 >= dec->mcu_rows_decoded * rows_per_mcu && dec->mcu_rows_decoded < dec->j.img_mcu_y)
+    {
+      if (!decode_mcu_row(dec))
+      {
+        return false;
+      }
+    }
+    coutput[k] = resample_component(dec, k, c, dec->j.img_comp[k].linebuf);
+  }
+  convert_row(dec, coutput, dec->row, rgb);
+  dec->next_row++;
+  return true;
+}
+
+/* The entropy-coded bytes between two restart markers. */
+struct restart_segment
+{
+  const stbi_uc *data;
+  int size;
+};
+
+/* A run of restart segments entropy-decoded by one worker. */
+struct segment_task
+{
+  struct jpeg_decoder *dec;
+  stbi__jpeg j;
+  stbi__context s;
+  const struct restart_segment *segments;
+  int first;
+  int end;
+  bool ok;
+};
+
+/* A band of output rows upsampled and colour converted by one worker. */
+struct band_task
+{
+  struct jpeg_decoder *dec;
+  int first_row;
+  int end_row;
+  jpeg_row_sink store_row;
+  void *arg;
+  bool ok;
+};
+
+/*
+   Reads the rest of the scan into memory and splits it at its restart
+   markers, without disturbing the decoder's own file position.
+   Parameters:
+     - dec: The decoder, positioned at the start of the entropy-coded data.
+     - scan: Set to the buffer holding the scan (to be freed by the caller).
+     - no_segments: The number of segments the restart interval implies; the
+                    split fails unless exactly this many are found.
+*/
+static struct restart_segment *split_scan(struct jpeg_decoder *dec, stbi_uc **scan, int no_segments)
+{
+  struct stat st;
+  long pos = ftell(dec->file);
+  if (pos < 0 || (dec->memory == NULL && fstat(fileno(dec->file), &st) != 0))
+  {
+    return NULL;
+  }
+  /* stb may already have buffered the first bytes of the scan. */
+  off_t offset = pos - (dec->s.img_buffer_end - dec->s.img_buffer);
+  size_t size = (dec->memory != NULL ? (off_t)dec->memory_size : st.st_size) - offset;
+  *scan = malloc(size);
+  struct restart_segment *segments = calloc(no_segments, sizeof(struct restart_segment));
+  if (*scan == NULL || segments == NULL
+      || (dec->memory == NULL && pread(fileno(dec->file), *scan, size, offset) != (ssize_t)size))
+  {
+    free(segments);
+    return NULL;
+  }
+  if (dec->memory != NULL)
+  {
+    memcpy(*scan, dec->memory + offset, size);
+  }
+
+  int found = 0;
+  size_t start = 0;
+  for (size_t i = 0; i + 1 < size && found < no_segments; i++)
+  {
+    if ((*scan)[i] != 0xFF || (*scan)[i + 1] == 0x00 || (*scan)[i + 1] == 0xFF)
+    {
+      /* Data, a stuffed 0xFF, or fill bytes before a marker. */
+      i += (*scan)[i] == 0xFF && (*scan)[i + 1] == 0x00;
+      continue;
+    }
+    segments[found].data = *scan + start;
+    segments[found++].size = (int)(i - start);
+    start = i + 2;
+    if (!STBI__RESTART((*scan)[i + 1]))
+    {
+      break;
+    }
+    i++;
+  }
+  if (found != no_segments)
+  {
+    free(segments);
+    return NULL;
+  }
+  return segments;
+}
+
+/*
+   Entropy-decodes a run of restart segments with a private copy of the
+   decoder state, writing MCUs straight into the shared component planes.
+   Parameters:
+     - task_arg: The segment_task.
+*/
+static void decode_segments(void *task_arg)
+{
+  struct segment_task *task = (struct segment_task *)task_arg;
+  stbi__jpeg *z = &task->j;
+  int no_mcus = z->img_mcu_x * z->img_mcu_y;
+
+  task->ok = true;
+  z->s = &task->s;
+  for (int seg = task->first; seg < task->end && task->ok; seg++)
+  {
+    stbi__start_mem(&task->s, task->segments[seg].data, task->segments[seg].size);
+    stbi__jpeg_reset(z);
+    int end = (seg + 1) * z->restart_interval;
+    for (int m = seg * z->restart_interval; m < end && m < no_mcus; m++)
+    {
+      if (!decode_mcu(task->dec, z, m % z->img_mcu_x, m / z->img_mcu_x))
+      {
+        task->ok = false;
+        break;
+      }
+    }
+  }
+}
+
+/*
+   Steps each component's progress forward over rows of the picture without
+   upsampling them, as resample_component would.
+   Parameters:
+     - dec: The decoder.
+     - comps: The progress of each component (dec->comps, or a copy of it).
+     - rows: The number of rows to skip.
+*/
+static void skip_component_rows(struct jpeg_decoder *dec, struct component_stream comps[RGB_BYTES], int rows)
+{
+  for (int y = 0; y < rows; y++)
+  {
+    for (int k = 0; k < RGB_BYTES; k++)
+    {
+      if (++comps[k].ystep >= comps[k].vs)
+      {
+        comps[k].ystep = 0;
+        comps[k].row0 = comps[k].row1;
+        if (++comps[k].ypos < dec->j.img_comp[k].y)
+        {
+          comps[k].row1++;
+        }
+      }
+    }
+  }
+}
+
+/*
+   Upsamples and colour converts a band of rows of the fully decoded planes.
+   Parameters:
+     - task_arg: The band_task.
+*/
+static void convert_band(void *task_arg)
+{
+  struct band_task *task = (struct band_task *)task_arg;
+  struct jpeg_decoder *dec = task->dec;
+  struct component_stream comps[RGB_BYTES];
+  stbi_uc *linebufs[RGB_BYTES];
+  stbi_uc *row = malloc((size_t)dec->width * 4);
+  unsigned char *rgb = malloc((size_t)dec->width * RGB_BYTES);
+
+  task->ok = row != NULL && rgb != NULL;
+  for (int k = 0; k < RGB_BYTES; k++)
+  {
+    comps[k] = dec->comps[k];
+    linebufs[k] = malloc(dec->width + 3);
+    task->ok = task->ok && linebufs[k] != NULL;
+  }
+  skip_component_rows(dec, comps, task->first_row);
+  for (int y = task->first_row; y < task->end_row && task->ok; y++)
+  {
+    stbi_uc *coutput[RGB_BYTES];
+    for (int k = 0; k < RGB_BYTES; k++)
+    {
+      coutput[k] = resample_component(dec, k, &comps[k], linebufs[k]);
+    }
+    convert_row(dec, coutput, row, rgb);
+    task->store_row(task->arg, y, rgb);
+  }
+  for (int k = 0; k < RGB_BYTES; k++)
+  {
+    free(linebufs[k]);
+  }
+  free(row);
+  free(rgb);
+}
+
+/*
+   Decodes a whole streaming picture on a pool of workers: first the restart
+   segments are entropy-decoded side by side into full-size component planes,
+   then bands of rows are upsampled and handed to the sink.
+   Parameters:
+     - dec: A streaming decoder with a restart interval, on its first row.
+     - no_workers: The number of threads to decode with.
+     - store_row: The sink for decoded scanlines.
+     - arg: Passed through to store_row.
+*/
+static bool decode_in_parallel(struct jpeg_decoder *dec, int no_workers, jpeg_row_sink store_row, void *arg)
+{
+  stbi__jpeg *z = &dec->j;
+  int no_segments = (z->img_mcu_x * z->img_mcu_y + z->restart_interval - 1) / z->restart_interval;
+  stbi_uc *scan = NULL;
+  struct restart_segment *segments = split_scan(dec, &scan, no_segments);
+  if (segments == NULL)
+  {
+    free(scan);
+    return false;
+  }
+
+  /* Replace the component rings with planes tall enough for every row. */
+  void *planes[RGB_BYTES] = { NULL, NULL, NULL };
+  bool ok = true;
+  for (int k = 0; k < RGB_BYTES; k++)
+  {
+    planes[k] = malloc((size_t)z->img_comp[k].w2 * z->img_mcu_y * z->img_comp[k].v * dec->comps[k].block_h + 15);
+    ok = ok && planes[k] != NULL;
+  }
+  struct segment_task *segment_tasks = calloc(no_workers, sizeof(struct segment_task));
+  struct band_task *band_tasks = calloc(no_workers * BANDS_PER_WORKER, sizeof(struct band_task));
+  struct thread_pool pool;
+  if (!ok || segment_tasks == NULL || band_tasks == NULL || !init_thread_pool(&pool, no_workers))
+  {
+    for (int k = 0; k < RGB_BYTES; k++)
+    {
+      free(planes[k]);
+    }
+    free(segment_tasks);
+    free(band_tasks);
+    free(segments);
+    free(scan);
+    return false;
+  }
+  for (int k = 0; k < RGB_BYTES; k++)
+  {
+    free(dec->comps[k].raw_ring);
+    dec->comps[k].raw_ring = planes[k];
+    dec->comps[k].ring_rows = z->img_mcu_y * z->img_comp[k].v * dec->comps[k].block_h;
+    z->img_comp[k].data = (stbi_uc *)(((size_t)planes[k] + 15) & ~15);
+  }
+
+  /* Entropy decoding: contiguous runs of segments, one per worker. */
+  int per_worker = (no_segments + no_workers - 1) / no_workers;
+  for (int i = 0; i < no_workers; i++)
+  {
+    segment_tasks[i].dec = dec;
+    segment_tasks[i].j = *z;
+    segment_tasks[i].segments = segments;
+    segment_tasks[i].first = i * per_worker < no_segments ? i * per_worker : no_segments;
+    segment_tasks[i].end = (i + 1) * per_worker < no_segments ? (i + 1) * per_worker : no_segments;
+    submit_task(&pool, decode_segments, &segment_tasks[i]);
+  }
+  destroy_thread_pool(&pool);
+  for (int i = 0; i < no_workers; i++)
+  {
+    ok = ok && segment_tasks[i].ok;
+  }
+
+  /* Upsampling and colour conversion, in bands of rows. */
+  int no_bands = no_workers * BANDS_PER_WORKER;
+  int band_rows = (dec->height + no_bands - 1) / no_bands;
+  if (ok && init_thread_pool(&pool, no_workers))
+  {
+    for (int i = 0; i < no_bands; i++)
+    {
+      band_tasks[i].dec = dec;
+      band_tasks[i].first_row = i * band_rows < dec->height ? i * band_rows : dec->height;
+      band_tasks[i].end_row = (i + 1) * band_rows < dec->height ? (i + 1) * band_rows : dec->height;
+      band_tasks[i].store_row = store_row;
+      band_tasks[i].arg = arg;
+      submit_task(&pool, convert_band, &band_tasks[i]);
+    }
+    destroy_thread_pool(&pool);
+    for (int i = 0; i < no_bands; i++)
+    {
+      ok = ok && band_tasks[i].ok;
+    }
+  }
+  else
+  {
+    ok = false;
+  }
+
+  dec->mcu_rows_decoded = z->img_mcu_y;
+  dec->next_row = dec->height;
+  free(segment_tasks);
+  free(band_tasks);
+  free(segments);
+  free(scan);
+  return ok;
+}
+
+bool read_jpeg_rows(struct jpeg_decoder *dec, int no_workers, jpeg_row_sink store_row, void *arg)
+{
+  if (no_workers > 1 && dec->streaming && dec->next_row == 0 && dec->j.restart_interval > 0
+      && decode_in_parallel(dec, no_workers, store_row, arg))
+  {
+    return true;
+  }
+  /* Without restart markers the entropy stream can only be read serially. */
+  unsigned char *rgb = malloc((size_t)dec->width * RGB_BYTES);
+  if (rgb == NULL || dec->next_row != 0)
+  {
+    free(rgb);
+    return false;
+  }
+  for (int y = 0; y < dec->height; y++)
+  {
+    if (!read_jpeg_row(dec, rgb))
+    {
+      free(rgb);
+      return false;
+    }
+    store_row(arg, y, rgb);
+  }
+  free(rgb);
+  return true;
+}
+
+/*
+   Positions the entropy decoder at the start of an MCU row, reading past the
+   MCUs before it without transforming them. With restart markers it seeks
+   straight to the restart interval holding the row, so that only the MCUs
+   of that interval before the row are read past.
+   Parameters:
+     - dec: A streaming decoder on its first row.
+     - mcu_row: The MCU row to position at.
+*/
+static bool skip_to_mcu_row(struct jpeg_decoder *dec, int mcu_row)
+{
+  stbi__jpeg *z = &dec->j;
+  int target = mcu_row * z->img_mcu_x;
+  int first = 0;
+
+  if (z->restart_interval > 0 && target >= z->restart_interval)
+  {
+    int no_segments = (z->img_mcu_x * z->img_mcu_y + z->restart_interval - 1) / z->restart_interval;
+    struct restart_segment *segments = split_scan(dec, &dec->scan, no_segments);
+    if (segments != NULL)
+    {
+      /* The later intervals, their markers and the closing marker follow on
+         in memory. */
+      const struct restart_segment *last = &segments[no_segments - 1];
+      int seg = target / z->restart_interval;
+      stbi__start_mem(&dec->s, segments[seg].data, (int)(last->data + last->size + 2 - segments[seg].data));
+      stbi__jpeg_reset(z);
+      first = seg * z->restart_interval;
+      free(segments);
+    }
+    else
+    {
+      free(dec->scan);
+      dec->scan = NULL;
+    }
+  }
+
+  int col_begin = dec->mcu_col_begin, col_end = dec->mcu_col_end;
+  dec->mcu_col_begin = dec->mcu_col_end = 0;
+  bool ok = decode_mcus(dec, first, target);
+  dec->mcu_col_begin = col_begin;
+  dec->mcu_col_end = col_end;
+  dec->mcu_rows_decoded = mcu_row;
+  return ok;
+}
+
+bool read_jpeg_region(struct jpeg_decoder *dec, int x, int y, int width, int height, jpeg_row_sink store_row, void *arg)
+{
+  if (x < 0 || y < 0 || width <= 0 || height <= 0 || x > dec->width - width || y > dec->height - height
+      || dec->next_row != 0)
+  {
+    return false;
+  }
+  if (!dec->streaming)
+  {
+    for (int r = 0; r < height; r++)
+    {
+      store_row(arg, r, dec->pixels + ((size_t)(y + r) * dec->width + x) * RGB_BYTES);
+    }
+    dec->next_row = dec->height;
+    return true;
+  }
+
+  /* A margin of one MCU on every side gives the upsampler the same samples
+     around the region as when the whole picture is decoded. */
+  stbi__jpeg *z = &dec->j;
+  int mcu_w = z->img_mcu_w / dec->scale, mcu_h = z->img_mcu_h / dec->scale;
+  int first_mcu_row = y / mcu_h > 0 ? y / mcu_h - 1 : 0;
+  int first_mcu_col = x / mcu_w > 0 ? x / mcu_w - 1 : 0;
+  int end_mcu_col = (x + width - 1) / mcu_w + 2;
+  dec->mcu_col_begin = first_mcu_col;
+  dec->mcu_col_end = end_mcu_col < z->img_mcu_x ? end_mcu_col : z->img_mcu_x;
+  for (int k = 0; k < RGB_BYTES; k++)
+  {
+    struct component_stream *c = &dec->comps[k];
+    int col_end = dec->mcu_col_end * z->img_comp[k].h * c->block_w;
+    c->col0 = first_mcu_col * z->img_comp[k].h * c->block_w;
+    c->w_lores = (col_end < z->img_comp[k].x ? col_end : z->img_comp[k].x) - c->col0;
+  }
+  dec->out_offset = x - first_mcu_col * mcu_w;
+  dec->out_w = width;
+
+  unsigned char *rgb = malloc((size_t)width * RGB_BYTES);
+  bool ok = rgb != NULL && skip_to_mcu_row(dec, first_mcu_row);
+  if (ok)
+  {
+    skip_component_rows(dec, dec->comps, y);
+    dec->next_row = y;
+  }
+  for (int r = 0; ok && r < height; r++)
+  {
+    ok = read_jpeg_row(dec, rgb);
+    if (ok)
+    {
+      store_row(arg, r, rgb);
+    }
+  }
+  free(rgb);
+  return ok;
+}
+
+/*
+   Entropy-decodes one interleaved MCU into the coefficient blocks, leaving
+   the coefficients quantised (every table entry read as 1).
+   Parameters:
+     - z: The entropy decoder state.
+     - coef: The coefficients being filled in.
+     - i: The MCU column.
+     - j: The MCU row.
+     - unit_table: A dequantisation table of all ones.
+*/
+static bool decode_coefficient_mcu(stbi__jpeg *z, struct jpeg_coefficients *coef, int i, int j, stbi__uint16 *unit_table)
+{
+  for (int k = 0; k < z->scan_n; ++k)
+  {
+    int n = z->order[k];
+    struct jpeg_component_coefficients *comp = &coef->comps[n];
+    for (int y = 0; y < comp->v; ++y)
+    {
+      for (int x = 0; x < comp->h; ++x)
+      {
+        short *block = jpeg_coefficient_block(comp, i * comp->h + x, j * comp->v + y);
+        int ha = z->img_comp[n].ha;
+        if (!stbi__jpeg_decode_block(z, block, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, unit_table))
+        {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool read_jpeg_coefficients(const char *path, struct jpeg_coefficients *coef)
+{
+  memset(coef, 0, sizeof(*coef));
+  FILE *file = fopen(path, "rb");
+  struct jpeg_decoder *dec = file == NULL ? NULL : read_frame_header(file);
+  if (dec == NULL)
+  {
+    return false;
+  }
+  stbi__jpeg *z = &dec->j;
+  bool ok = !z->progressive && dec->s.img_n == RGB_BYTES;
+  if (ok)
+  {
+    set_mcu_geometry(dec);
+    /* The writer labels its output YCbCr, so other colour models are left to
+       the pixel path. */
+    ok = read_scan_header(dec) && !dec->is_rgb;
+  }
+  coef->width = dec->width;
+  coef->height = dec->height;
+  for (int k = 0; ok && k < RGB_BYTES; k++)
+  {
+    struct jpeg_component_coefficients *comp = &coef->comps[k];
+    comp->h = z->img_comp[k].h;
+    comp->v = z->img_comp[k].v;
+    comp->blocks_w = z->img_mcu_x * comp->h;
+    comp->blocks_h = z->img_mcu_y * comp->v;
+    for (int i = 0; i < 64; i++)
+    {
+      comp->quant[i] = z->dequant[z->img_comp[k].tq][i];
+    }
+    comp->blocks = calloc((size_t)comp->blocks_w * comp->blocks_h * 64, sizeof(short));
+    ok = comp->blocks != NULL;
+  }
+
+  /* As when streaming, a corrupt stream leaves the remaining blocks zero. */
+  stbi__uint16 unit_table[64];
+  for (int i = 0; i < 64; i++)
+  {
+    unit_table[i] = 1;
+  }
+  bool truncated = false;
+  for (int j = 0; ok && !truncated && j < z->img_mcu_y; j++)
+  {
+    for (int i = 0; ok && !truncated && i < z->img_mcu_x; i++)
+    {
+      ok = decode_coefficient_mcu(z, coef, i, j, unit_table);
+      if (ok && --z->todo <= 0)
+      {
+        if (z->code_bits < 24)
+        {
+          stbi__grow_buffer_unsafe(z);
+        }
+        truncated = !STBI__RESTART(z->marker);
+        if (!truncated)
+        {
+          stbi__jpeg_reset(z);
+        }
+      }
+    }
+  }
+  close_jpeg_decoder(dec);
+  if (!ok)
+  {
+    free_jpeg_coefficients(coef);
+  }
+  return ok;
+}
+
+void free_jpeg_coefficients(struct jpeg_coefficients *coef)
+{
+  for (int k = 0; k < RGB_BYTES; k++)
+  {
+    free(coef->comps[k].blocks);
+    coef->comps[k].blocks = NULL;
+  }
+}
+
+void close_jpeg_decoder(struct jpeg_decoder *dec)
+{
+  free_rings(dec);
+  stbi_image_free(dec->pixels);
+  free(dec->scan);
+  fclose(dec->file);
+  free(dec);
+}
@@ -0,0 +1,90 @@
+#ifndef JPEGDECODE_H
+#define JPEGDECODE_H
+
+#include <stdbool.h>
+
+/* An incremental JPEG decoder handing out one RGB scanline at a time. Baseline
+   single-scan files are entropy-decoded one MCU row ahead of the caller, so
+   only two MCU rows of each component are ever resident; other JPEGs (e.g.
+   progressive) are decoded whole up front and then handed out row by row.
+   Rows are byte-for-byte what sod_img_load_from_file produces. */
+struct jpeg_decoder;
+
+// open the colour (three component) JPEG at path; returns NULL if it is
+// missing, not a JPEG or stored in another colour model
+struct jpeg_decoder *open_jpeg_decoder(const char *path);
+
+// open the colour JPEG at path reduced by scale (1, 2, 4 or 8), rounding
+// its dimensions up: baseline files are decoded straight to the reduced size
+// through an IDCT of only their lowest frequencies, other JPEGs are decoded
+// whole and then shrunk; returns NULL as open_jpeg_decoder does, or for any
+// other scale
+struct jpeg_decoder *open_scaled_jpeg_decoder(const char *path, int scale);
+
+// open a colour JPEG held in memory (size bytes at data, which must outlive
+// the decoder) as open_scaled_jpeg_decoder opens files
+struct jpeg_decoder *open_jpeg_decoder_from_memory(const unsigned char *data, size_t size, int scale);
+
+// read just the dimensions of the colour JPEG at path, without decoding it
+bool read_jpeg_dimensions(const char *path, int *width, int *height);
+
+// dimensions of the picture being decoded (after any reduction)
+int jpeg_decoder_width(struct jpeg_decoder *dec);
+int jpeg_decoder_height(struct jpeg_decoder *dec);
+
+// decode the next scanline into rgb (width interleaved RGB byte triples)
+bool read_jpeg_row(struct jpeg_decoder *dec, unsigned char *rgb);
+
+// receives decoded scanline y (width interleaved RGB byte triples); may be
+// called from several threads at once, for different rows
+typedef void (*jpeg_row_sink)(void *arg, int y, const unsigned char *rgb);
+
+// decode every scanline of a freshly opened decoder into store_row; the
+// restart segments of baseline files with restart markers are decoded on
+// no_workers threads, other files serially
+bool read_jpeg_rows(struct jpeg_decoder *dec, int no_workers, jpeg_row_sink store_row, void *arg);
+
+// decode just the width x height rectangle at (x, y) of a freshly opened
+// decoder into store_row, as rows 0 to height - 1 of width pixels each; the
+// MCU rows above it are read past without any IDCT (from the nearest
+// restart marker, if the file has them) and the MCUs to either side of it
+// are not transformed. Rows are exactly those of a whole-picture decode.
+// Fails if the rectangle is not wholly inside the picture.
+bool read_jpeg_region(struct jpeg_decoder *dec, int x, int y, int width, int height, jpeg_row_sink store_row, void *arg);
+
+// close the file and release the decoder
+void close_jpeg_decoder(struct jpeg_decoder *dec);
+
+/* The quantised DCT coefficients of one component of a JPEG, block by block.
+   Each block holds 64 coefficients in natural (row-major) order; the grid
+   covers whole MCUs, so edge blocks may lie partly or wholly past the picture. */
+struct jpeg_component_coefficients
+{
+  int h, v;
+  int blocks_w, blocks_h;
+  short *blocks;
+  unsigned short quant[64];
+};
+
+/* A colour (YCbCr) JPEG as quantised DCT coefficients. */
+struct jpeg_coefficients
+{
+  int width;
+  int height;
+  struct jpeg_component_coefficients comps[3];
+};
+
+// the block at column bx and row by of a component's grid
+static inline short *jpeg_coefficient_block(const struct jpeg_component_coefficients *comp, int bx, int by)
+{
+  return comp->blocks + ((size_t)by * comp->blocks_w + bx) * 64;
+}
+
+// read the coefficients of the baseline YCbCr JPEG at path without any
+// IDCT; fails for other JPEGs (e.g. progressive), which must be decoded
+bool read_jpeg_coefficients(const char *path, struct jpeg_coefficients *coef);
+
+// release the blocks of a successfully read set of coefficients
+void free_jpeg_coefficients(struct jpeg_coefficients *coef);
+
+#endif
@@ -0,0 +1,789 @@
+#include <stdlib.h>
+#include <string.h>
+#include "JpegEncode.h"
+#include "ThreadPool.h"
+
+/* Reuse stb's block coder (DCT, quantisation and Huffman bit writer) privately;
+   sod.c carries its own public copy for whole-image saves. */
+#define STB_IMAGE_WRITE_STATIC
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+/* The few helpers stb defines without STBIWDEF would clash with sod's copy. */
+#define stbiw__linear_to_rgbe jpeg_encode_linear_to_rgbe
+#define stbiw__write_run_data jpeg_encode_write_run_data
+#define stbiw__write_dump_data jpeg_encode_write_dump_data
+#define stbiw__write_hdr_scanline jpeg_encode_write_hdr_scanline
+#define stbi_zlib_compress jpeg_encode_zlib_compress
+#define stbi_write_png_to_mem jpeg_encode_write_png_to_mem
+#include "sod_img_writer.h"
+
+#define BLOCK_SIZE 8
+#define RGB_BYTES 3
+/* Strips queued per worker when encoding in parallel, to even out the load. */
+#define STRIPS_PER_WORKER 2
+/* The restart interval is a 16 bit count of MCUs. */
+#define MAX_RESTART_INTERVAL 0xFFFF
+
+/* Standard JPEG (Annex K) tables, as used by stbi_write_jpg. */
+static const unsigned char std_dc_luminance_nrcodes[] = { 0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0 };
+static const unsigned char std_dc_luminance_values[] = { 0,1,2,3,4,5,6,7,8,9,10,11 };
+static const unsigned char std_ac_luminance_nrcodes[] = { 0,0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d };
+static const unsigned char std_ac_luminance_values[] = {
+  0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,
+  0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
+  0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,
+  0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+  0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,
+  0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
+  0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
+};
+static const unsigned char std_dc_chrominance_nrcodes[] = { 0,0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0 };
+static const unsigned char std_dc_chrominance_values[] = { 0,1,2,3,4,5,6,7,8,9,10,11 };
+static const unsigned char std_ac_chrominance_nrcodes[] = { 0,0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77 };
+static const unsigned char std_ac_chrominance_values[] = {
+  0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,
+  0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
+  0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,
+  0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+  0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,
+  0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
+  0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
+};
+// Huffman tables
+static const unsigned short YDC_HT[256][2] = { { 0,2 },{ 2,3 },{ 3,3 },{ 4,3 },{ 5,3 },{ 6,3 },{ 14,4 },{ 30,5 },{ 62,6 },{ 126,7 },{ 254,8 },{ 510,9 } };
+static const unsigned short UVDC_HT[256][2] = { { 0,2 },{ 1,2 },{ 2,2 },{ 6,3 },{ 14,4 },{ 30,5 },{ 62,6 },{ 126,7 },{ 254,8 },{ 510,9 },{ 1022,10 },{ 2046,11 } };
+static const unsigned short YAC_HT[256][2] = {
+  { 10,4 },{ 0,2 },{ 1,2 },{ 4,3 },{ 11,4 },{ 26,5 },{ 120,7 },{ 248,8 },{ 1014,10 },{ 65410,16 },{ 65411,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 12,4 },{ 27,5 },{ 121,7 },{ 502,9 },{ 2038,11 },{ 65412,16 },{ 65413,16 },{ 65414,16 },{ 65415,16 },{ 65416,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 28,5 },{ 249,8 },{ 1015,10 },{ 4084,12 },{ 65417,16 },{ 65418,16 },{ 65419,16 },{ 65420,16 },{ 65421,16 },{ 65422,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 58,6 },{ 503,9 },{ 4085,12 },{ 65423,16 },{ 65424,16 },{ 65425,16 },{ 65426,16 },{ 65427,16 },{ 65428,16 },{ 65429,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 59,6 },{ 1016,10 },{ 65430,16 },{ 65431,16 },{ 65432,16 },{ 65433,16 },{ 65434,16 },{ 65435,16 },{ 65436,16 },{ 65437,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 122,7 },{ 2039,11 },{ 65438,16 },{ 65439,16 },{ 65440,16 },{ 65441,16 },{ 65442,16 },{ 65443,16 },{ 65444,16 },{ 65445,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 123,7 },{ 4086,12 },{ 65446,16 },{ 65447,16 },{ 65448,16 },{ 65449,16 },{ 65450,16 },{ 65451,16 },{ 65452,16 },{ 65453,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 250,8 },{ 4087,12 },{ 65454,16 },{ 65455,16 },{ 65456,16 },{ 65457,16 },{ 65458,16 },{ 65459,16 },{ 65460,16 },{ 65461,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 504,9 },{ 32704,15 },{ 65462,16 },{ 65463,16 },{ 65464,16 },{ 65465,16 },{ 65466,16 },{ 65467,16 },{ 65468,16 },{ 65469,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 505,9 },{ 65470,16 },{ 65471,16 },{ 65472,16 },{ 65473,16 },{ 65474,16 },{ 65475,16 },{ 65476,16 },{ 65477,16 },{ 65478,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 506,9 },{ 65479,16 },{ 65480,16 },{ 65481,16 },{ 65482,16 },{ 65483,16 },{ 65484,16 },{ 65485,16 },{ 65486,16 },{ 65487,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 1017,10 },{ 65488,16 },{ 65489,16 },{ 65490,16 },{ 65491,16 },{ 65492,16 },{ 65493,16 },{ 65494,16 },{ 65495,16 },{ 65496,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 1018,10 },{ 65497,16 },{ 65498,16 },{ 65499,16 },{ 65500,16 },{ 65501,16 },{ 65502,16 },{ 65503,16 },{ 65504,16 },{ 65505,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 2040,11 },{ 65506,16 },{ 65507,16 },{ 65508,16 },{ 65509,16 },{ 65510,16 },{ 65511,16 },{ 65512,16 },{ 65513,16 },{ 65514,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 65515,16 },{ 65516,16 },{ 65517,16 },{ 65518,16 },{ 65519,16 },{ 65520,16 },{ 65521,16 },{ 65522,16 },{ 65523,16 },{ 65524,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 2041,11 },{ 65525,16 },{ 65526,16 },{ 65527,16 },{ 65528,16 },{ 65529,16 },{ 65530,16 },{ 65531,16 },{ 65532,16 },{ 65533,16 },{ 65534,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 }
+};
+static const unsigned short UVAC_HT[256][2] = {
+  { 0,2 },{ 1,2 },{ 4,3 },{ 10,4 },{ 24,5 },{ 25,5 },{ 56,6 },{ 120,7 },{ 500,9 },{ 1014,10 },{ 4084,12 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 11,4 },{ 57,6 },{ 246,8 },{ 501,9 },{ 2038,11 },{ 4085,12 },{ 65416,16 },{ 65417,16 },{ 65418,16 },{ 65419,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 26,5 },{ 247,8 },{ 1015,10 },{ 4086,12 },{ 32706,15 },{ 65420,16 },{ 65421,16 },{ 65422,16 },{ 65423,16 },{ 65424,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 27,5 },{ 248,8 },{ 1016,10 },{ 4087,12 },{ 65425,16 },{ 65426,16 },{ 65427,16 },{ 65428,16 },{ 65429,16 },{ 65430,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 58,6 },{ 502,9 },{ 65431,16 },{ 65432,16 },{ 65433,16 },{ 65434,16 },{ 65435,16 },{ 65436,16 },{ 65437,16 },{ 65438,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 59,6 },{ 1017,10 },{ 65439,16 },{ 65440,16 },{ 65441,16 },{ 65442,16 },{ 65443,16 },{ 65444,16 },{ 65445,16 },{ 65446,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 121,7 },{ 2039,11 },{ 65447,16 },{ 65448,16 },{ 65449,16 },{ 65450,16 },{ 65451,16 },{ 65452,16 },{ 65453,16 },{ 65454,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 122,7 },{ 2040,11 },{ 65455,16 },{ 65456,16 },{ 65457,16 },{ 65458,16 },{ 65459,16 },{ 65460,16 },{ 65461,16 },{ 65462,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 249,8 },{ 65463,16 },{ 65464,16 },{ 65465,16 },{ 65466,16 },{ 65467,16 },{ 65468,16 },{ 65469,16 },{ 65470,16 },{ 65471,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 503,9 },{ 65472,16 },{ 65473,16 },{ 65474,16 },{ 65475,16 },{ 65476,16 },{ 65477,16 },{ 65478,16 },{ 65479,16 },{ 65480,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 504,9 },{ 65481,16 },{ 65482,16 },{ 65483,16 },{ 65484,16 },{ 65485,16 },{ 65486,16 },{ 65487,16 },{ 65488,16 },{ 65489,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 505,9 },{ 65490,16 },{ 65491,16 },{ 65492,16 },{ 65493,16 },{ 65494,16 },{ 65495,16 },{ 65496,16 },{ 65497,16 },{ 65498,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 506,9 },{ 65499,16 },{ 65500,16 },{ 65501,16 },{ 65502,16 },{ 65503,16 },{ 65504,16 },{ 65505,16 },{ 65506,16 },{ 65507,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 2041,11 },{ 65508,16 },{ 65509,16 },{ 65510,16 },{ 65511,16 },{ 65512,16 },{ 65513,16 },{ 65514,16 },{ 65515,16 },{ 65516,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 16352,14 },{ 65517,16 },{ 65518,16 },{ 65519,16 },{ 65520,16 },{ 65521,16 },{ 65522,16 },{ 65523,16 },{ 65524,16 },{ 65525,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },
+{ 1018,10 },{ 32707,15 },{ 65526,16 },{ 65527,16 },{ 65528,16 },{ 65529,16 },{ 65530,16 },{ 65531,16 },{ 65532,16 },{ 65533,16 },{ 65534,16 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 },{ 0,0 }
+};
+static const int YQT[] = { 16,11,10,16,24,40,51,61,12,12,14,19,26,58,60,55,14,13,16,24,40,57,69,56,14,17,22,29,51,87,80,62,18,22,
+  37,56,68,109,103,77,24,35,55,64,81,104,113,92,49,64,78,87,103,121,120,101,72,92,95,98,112,100,103,99 };
+static const int UVQT[] = { 17,18,24,47,99,99,99,99,18,21,26,66,99,99,99,99,24,26,56,99,99,99,99,99,47,66,99,99,99,99,99,99,
+  99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99 };
+static const float aasf[] = { 1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
+  1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f };
+
+struct jpeg_encoder
+{
+  stbi__write_context s;
+  int width;
+  int height;
+
+  /* The current strip of MCUs: up to mcu_size rows of interleaved RGB. */
+  bool subsample;
+  int mcu_size;
+  unsigned char *strip;
+  int strip_rows;
+  int rows_written;
+
+  float fdtbl_Y[64];
+  float fdtbl_UV[64];
+  int DCY, DCU, DCV;
+  int bitBuf, bitCnt;
+
+  /* Whether the output stream was opened by (and is closed with) the encoder. */
+  bool owns_stream;
+};
+
+/*
+   Checks that a picture fits in a baseline JPEG, which stores its dimensions
+   in 16 bits.
+*/
+static bool valid_dimensions(int width, int height)
+{
+  return width > 0 && height > 0 && width <= 0xFFFF && height <= 0xFFFF;
+}
+
+/*
+   Writes the DHT segment holding the standard luma and chroma Huffman tables
+   that every encoder here codes with.
+   Parameters:
+     - s: The output.
+*/
+static void write_huffman_tables(stbi__write_context *s)
+{
+  static const unsigned char dht[] = { 0xFF,0xC4,0x01,0xA2,0 };
+  s->func(s->context, (void *)dht, sizeof(dht));
+  s->func(s->context, (void *)(std_dc_luminance_nrcodes + 1), sizeof(std_dc_luminance_nrcodes) - 1);
+  s->func(s->context, (void *)std_dc_luminance_values, sizeof(std_dc_luminance_values));
+  stbiw__putc(s, 0x10);
+  s->func(s->context, (void *)(std_ac_luminance_nrcodes + 1), sizeof(std_ac_luminance_nrcodes) - 1);
+  s->func(s->context, (void *)std_ac_luminance_values, sizeof(std_ac_luminance_values));
+  stbiw__putc(s, 1);
+  s->func(s->context, (void *)(std_dc_chrominance_nrcodes + 1), sizeof(std_dc_chrominance_nrcodes) - 1);
+  s->func(s->context, (void *)std_dc_chrominance_values, sizeof(std_dc_chrominance_values));
+  stbiw__putc(s, 0x11);
+  s->func(s->context, (void *)(std_ac_chrominance_nrcodes + 1), sizeof(std_ac_chrominance_nrcodes) - 1);
+  s->func(s->context, (void *)std_ac_chrominance_values, sizeof(std_ac_chrominance_values));
+}
+
+void make_exif_segment(unsigned char segment[EXIF_SEGMENT_SIZE], int orientation)
+{
+  /* A big-endian TIFF header and a single IFD holding one SHORT entry. */
+  static const unsigned char exif[EXIF_SEGMENT_SIZE] = {
+    0xFF,0xE1,0,EXIF_SEGMENT_SIZE - 2,'E','x','i','f',0,0,
+    'M','M',0,0x2A,0,0,0,8,
+    0,1,
+    0x01,0x12,0,3,0,0,0,1,0,0,0,0,
+    0,0,0,0
+  };
+  memcpy(segment, exif, EXIF_SEGMENT_SIZE);
+  segment[29] = (unsigned char)orientation;
+}
+
+/*
+   Builds the scaled quantisation tables for quality and writes every header
+   segment up to the start of scan, exactly as stbi_write_jpg does.
+   Parameters:
+     - enc: The encoder to initialise.
+     - quality: Quality in 1..100 (0 selects stb's default of 90).
+     - restart_interval: MCUs between restart markers (0 for none, as in stb).
+     - exif_orientation: EXIF Orientation tag to record after the JFIF
+                         segment (0 for none, as in stb).
+   With 4:2:0 subsampling, luma is declared with 2x2 sampling factors.
+*/
+static void write_jpeg_headers(struct jpeg_encoder *enc, int quality, int restart_interval, int exif_orientation)
+{
+  stbi__write_context *s = &enc->s;
+  unsigned char YTable[64], UVTable[64];
+  int row, col, i, k;
+
+  quality = quality ? quality : 90;
+  quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+  quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+  for (i = 0; i < 64; ++i)
+  {
+    int uvti, yti = (YQT[i] * quality + 50) / 100;
+    YTable[stbiw__jpg_ZigZag[i]] = (unsigned char)(yti < 1 ? 1 : yti > 255 ? 255 : yti);
+    uvti = (UVQT[i] * quality + 50) / 100;
+    UVTable[stbiw__jpg_ZigZag[i]] = (unsigned char)(uvti < 1 ? 1 : uvti > 255 ? 255 : uvti);
+  }
+
+  for (row = 0, k = 0; row < 8; ++row)
+  {
+    for (col = 0; col < 8; ++col, ++k)
+    {
+      enc->fdtbl_Y[k] = 1 / (YTable[stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
+      enc->fdtbl_UV[k] = 1 / (UVTable[stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
+    }
+  }
+
+  static const unsigned char jfif[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0 };
+  static const unsigned char head0[] = { 0xFF,0xDB,0,0x84,0 };
+  static const unsigned char head2[] = { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
+  const unsigned char head1[] = { 0xFF,0xC0,0,0x11,8,(unsigned char)(enc->height >> 8),STBIW_UCHAR(enc->height),
+                                  (unsigned char)(enc->width >> 8),STBIW_UCHAR(enc->width),
+                                  3,1,enc->subsample ? 0x22 : 0x11,0,2,0x11,1,3,0x11,1 };
+  s->func(s->context, (void *)jfif, sizeof(jfif));
+  if (exif_orientation > 0)
+  {
+    unsigned char exif[EXIF_SEGMENT_SIZE];
+    make_exif_segment(exif, exif_orientation);
+    s->func(s->context, exif, sizeof(exif));
+  }
+  s->func(s->context, (void *)head0, sizeof(head0));
+  s->func(s->context, (void *)YTable, sizeof(YTable));
+  stbiw__putc(s, 1);
+  s->func(s->context, UVTable, sizeof(UVTable));
+  s->func(s->context, (void *)head1, sizeof(head1));
+  write_huffman_tables(s);
+  if (restart_interval > 0)
+  {
+    const unsigned char dri[] = { 0xFF,0xDD,0,4,(unsigned char)(restart_interval >> 8),STBIW_UCHAR(restart_interval) };
+    s->func(s->context, (void *)dri, sizeof(dri));
+  }
+  s->func(s->context, (void *)head2, sizeof(head2));
+}
+
+/*
+   Converts one pixel of the strip to Y, Cb and Cr (Y centred on zero). Rows and
+   columns past the edge of the picture repeat the last real row and column,
+   as in stb.
+   Parameters:
+     - enc: The encoder whose strip holds enc->strip_rows rows.
+     - row: The row within the strip.
+     - col: The picture column.
+     - pos: The index to fill in each of the output blocks.
+*/
+static void load_ycc(struct jpeg_encoder *enc, int row, int col, float *YDU, float *UDU, float *VDU, int pos)
+{
+  const unsigned char *line = enc->strip + (size_t)(row < enc->strip_rows ? row : enc->strip_rows - 1) * enc->width * RGB_BYTES;
+  const unsigned char *p = line + (col < enc->width ? col : enc->width - 1) * RGB_BYTES;
+  float r = p[0], g = p[1], b = p[2];
+  YDU[pos] = +0.29900f * r + 0.58700f * g + 0.11400f * b - 128;
+  UDU[pos] = -0.16874f * r - 0.33126f * g + 0.50000f * b;
+  VDU[pos] = +0.50000f * r - 0.41869f * g - 0.08131f * b;
+}
+
+/*
+   Encodes the buffered strip as one row of MCUs: single 8x8 blocks of each
+   component, or with 4:2:0 subsampling four luma blocks per 16x16 MCU
+   followed by one block of each chroma component averaged over 2x2 pixels.
+   Parameters:
+     - enc: The encoder whose strip holds enc->strip_rows rows.
+*/
+static void encode_strip(struct jpeg_encoder *enc)
+{
+  for (int x = 0; x < enc->width; x += enc->mcu_size)
+  {
+    float YDU[256], UDU[256], VDU[256];
+    if (!enc->subsample)
+    {
+      for (int row = 0, pos = 0; row < BLOCK_SIZE; ++row)
+      {
+        for (int col = x; col < x + BLOCK_SIZE; ++col, ++pos)
+        {
+          load_ycc(enc, row, col, YDU, UDU, VDU, pos);
+        }
+      }
+      enc->DCY = stbiw__jpg_processDU(&enc->s, &enc->bitBuf, &enc->bitCnt, YDU, enc->fdtbl_Y, enc->DCY, YDC_HT, YAC_HT);
+    }
+    else
+    {
+      /* Gather the 16x16 MCU as four 8x8 luma blocks in scan order. */
+      for (int row = 0; row < 2 * BLOCK_SIZE; ++row)
+      {
+        for (int col = 0; col < 2 * BLOCK_SIZE; ++col)
+        {
+          int block = (row / BLOCK_SIZE) * 2 + col / BLOCK_SIZE;
+          int pos = block * 64 + (row % BLOCK_SIZE) * BLOCK_SIZE + col % BLOCK_SIZE;
+          load_ycc(enc, row, x + col, YDU, UDU, VDU, pos);
+        }
+      }
+      for (int block = 0; block < 4; ++block)
+      {
+        enc->DCY = stbiw__jpg_processDU(&enc->s, &enc->bitBuf, &enc->bitCnt, YDU + block * 64, enc->fdtbl_Y, enc->DCY, YDC_HT, YAC_HT);
+      }
+      /* Average each 2x2 group of chroma samples into the first block. */
+      float subU[64], subV[64];
+      for (int row = 0; row < BLOCK_SIZE; ++row)
+      {
+        for (int col = 0; col < BLOCK_SIZE; ++col)
+        {
+          int block = (row / 4) * 2 + col / 4;
+          int top = block * 64 + (row % 4) * 2 * BLOCK_SIZE + (col % 4) * 2;
+          subU[row * BLOCK_SIZE + col] = (UDU[top] + UDU[top + 1] + UDU[top + BLOCK_SIZE] + UDU[top + BLOCK_SIZE + 1]) * 0.25f;
+          subV[row * BLOCK_SIZE + col] = (VDU[top] + VDU[top + 1] + VDU[top + BLOCK_SIZE] + VDU[top + BLOCK_SIZE + 1]) * 0.25f;
+        }
+      }
+      memcpy(UDU, subU, sizeof(subU));
+      memcpy(VDU, subV, sizeof(subV));
+    }
+    enc->DCU = stbiw__jpg_processDU(&enc->s, &enc->bitBuf, &enc->bitCnt, UDU, enc->fdtbl_UV, enc->DCU, UVDC_HT, UVAC_HT);
+    enc->DCV = stbiw__jpg_processDU(&enc->s, &enc->bitBuf, &enc->bitCnt, VDU, enc->fdtbl_UV, enc->DCV, UVDC_HT, UVAC_HT);
+  }
+  enc->strip_rows = 0;
+}
+
+/*
+   Sets up the strip buffer of an encoder for a profile.
+   Parameters:
+     - enc: The encoder, with its width set.
+     - profile: The profile to encode with.
+*/
+static bool init_strip(struct jpeg_encoder *enc, const struct jpeg_profile *profile)
+{
+  enc->subsample = profile->subsampling == JPEG_SUBSAMPLING_420;
+  enc->mcu_size = enc->subsample ? 2 * BLOCK_SIZE : BLOCK_SIZE;
+  enc->strip = malloc((size_t)enc->width * RGB_BYTES * enc->mcu_size);
+  return enc->strip != NULL;
+}
+
+bool parse_jpeg_profile(struct jpeg_profile *profile, const char *quality, const char *subsampling)
+{
+  struct jpeg_profile parsed = *profile;
+  if (quality != NULL)
+  {
+    char *end;
+    long value = strtol(quality, &end, 10);
+    if (end == quality || *end != '\0' || value < 1 || value > 100)
+    {
+      return false;
+    }
+    parsed.quality = (int)value;
+  }
+  if (subsampling != NULL)
+  {
+    if (!strcmp(subsampling, "444"))
+    {
+      parsed.subsampling = JPEG_SUBSAMPLING_444;
+    }
+    else if (!strcmp(subsampling, "420"))
+    {
+      parsed.subsampling = JPEG_SUBSAMPLING_420;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  *profile = parsed;
+  return true;
+}
+
+bool is_default_jpeg_profile(const struct jpeg_profile *profile)
+{
+  struct jpeg_profile default_profile = DEFAULT_JPEG_PROFILE;
+  return profile->quality == default_profile.quality && profile->subsampling == default_profile.subsampling;
+}
+
+struct jpeg_encoder *open_jpeg_encoder_to_stream(FILE *stream, int width, int height, const struct jpeg_profile *profile)
+{
+  if (!valid_dimensions(width, height))
+  {
+    return NULL;
+  }
+  struct jpeg_encoder *enc = calloc(1, sizeof(struct jpeg_encoder));
+  if (enc == NULL)
+  {
+    return NULL;
+  }
+  enc->width = width;
+  enc->height = height;
+  if (!init_strip(enc, profile))
+  {
+    free(enc->strip);
+    free(enc);
+    return NULL;
+  }
+  stbi__start_write_callbacks(&enc->s, stbi__stdio_write, stream);
+  write_jpeg_headers(enc, profile->quality < 0 ? 100 : profile->quality, 0, profile->exif_orientation);
+  return enc;
+}
+
+struct jpeg_encoder *open_jpeg_encoder(const char *path, int width, int height, const struct jpeg_profile *profile)
+{
+  /* Checked first, so that no file is created for a picture that cannot be
+     encoded. */
+  if (!valid_dimensions(width, height))
+  {
+    return NULL;
+  }
+  FILE *file = fopen(path, "wb");
+  if (file == NULL)
+  {
+    return NULL;
+  }
+  struct jpeg_encoder *enc = open_jpeg_encoder_to_stream(file, width, height, profile);
+  if (enc == NULL)
+  {
+    fclose(file);
+    return NULL;
+  }
+  enc->owns_stream = true;
+  return enc;
+}
+
+bool write_jpeg_row(struct jpeg_encoder *enc, const unsigned char *rgb)
+{
+  if (enc->rows_written == enc->height)
+  {
+    return false;
+  }
+  memcpy(enc->strip + (size_t)enc->strip_rows * enc->width * RGB_BYTES, rgb, (size_t)enc->width * RGB_BYTES);
+  enc->strip_rows++;
+  enc->rows_written++;
+  if (enc->strip_rows == enc->mcu_size || enc->rows_written == enc->height)
+  {
+    encode_strip(enc);
+  }
+  return true;
+}
+
+/*
+   Pads the entropy-coded data to a byte boundary with one bits, as required
+   before a restart or end of image marker.
+   Parameters:
+     - enc: The encoder to flush.
+*/
+static void flush_bits(struct jpeg_encoder *enc)
+{
+  static const unsigned short fillBits[] = { 0x7F, 7 };
+  stbiw__jpg_writeBits(&enc->s, &enc->bitBuf, &enc->bitCnt, fillBits);
+}
+
+bool close_jpeg_encoder(struct jpeg_encoder *enc)
+{
+  bool complete = enc->rows_written == enc->height;
+
+  /* Bit-align and terminate the entropy-coded data. */
+  flush_bits(enc);
+  stbiw__putc(&enc->s, 0xFF);
+  stbiw__putc(&enc->s, 0xD9);
+
+  FILE *f = (FILE *)enc->s.context;
+  bool written = fflush(f) == 0 && !ferror(f);
+  if (enc->owns_stream)
+  {
+    stbi__end_write_file(&enc->s);
+  }
+  free(enc->strip);
+  free(enc);
+  return complete && written;
+}
+
+/* Entropy-coded bytes of one strip, collected in memory. */
+struct strip_output
+{
+  unsigned char *data;
+  size_t size;
+  size_t capacity;
+  bool failed;
+};
+
+/* One strip of MCU rows to be encoded independently of the others. */
+struct strip_task
+{
+  struct jpeg_encoder enc;
+  int first_row;
+  int end_row;
+  jpeg_row_source fill_row;
+  void *arg;
+  struct strip_output out;
+};
+
+/*
+   stb write callback appending to a strip's in-memory output.
+   Parameters:
+     - context: The strip_output.
+     - data: The bytes to append.
+     - size: The number of bytes.
+*/
+static void append_output(void *context, void *data, int size)
+{
+  struct strip_output *out = (struct strip_output *)context;
+  if (out->failed)
+  {
+    return;
+  }
+  if (out->size + size > out->capacity)
+  {
+    size_t capacity = out->capacity * 2 + size;
+    unsigned char *grown = realloc(out->data, capacity);
+    if (grown == NULL)
+    {
+      out->failed = true;
+      return;
+    }
+    out->data = grown;
+    out->capacity = capacity;
+  }
+  memcpy(out->data + out->size, data, size);
+  out->size += size;
+}
+
+/*
+   Encodes the pixel rows of one strip (with fresh DC predictors, as after a
+   restart marker) into the strip's output, ending byte-aligned.
+   Parameters:
+     - task_arg: The strip_task.
+*/
+static void encode_strip_task(void *task_arg)
+{
+  struct strip_task *task = (struct strip_task *)task_arg;
+  struct jpeg_encoder *enc = &task->enc;
+
+  enc->strip = malloc((size_t)enc->width * RGB_BYTES * enc->mcu_size);
+  if (enc->strip == NULL)
+  {
+    task->out.failed = true;
+    return;
+  }
+  for (int y = task->first_row; y < task->end_row; y++)
+  {
+    task->fill_row(task->arg, y, enc->strip + (size_t)enc->strip_rows++ * enc->width * RGB_BYTES);
+    if (enc->strip_rows == enc->mcu_size || y == task->end_row - 1)
+    {
+      encode_strip(enc);
+    }
+  }
+  flush_bits(enc);
+  free(enc->strip);
+}
+
+bool write_jpeg_parallel_to_stream(FILE *stream, int width, int height, const struct jpeg_profile *profile,
+                                   int no_workers, jpeg_row_source fill_row, void *arg)
+{
+  if (!valid_dimensions(width, height))
+  {
+    return false;
+  }
+  int mcu_size = profile->subsampling == JPEG_SUBSAMPLING_420 ? 2 * BLOCK_SIZE : BLOCK_SIZE;
+
+  /* Split the MCU rows into strips, keeping each restart interval in range. */
+  int mcus_per_row = (width + mcu_size - 1) / mcu_size;
+  int mcu_rows = (height + mcu_size - 1) / mcu_size;
+  int no_strips = no_workers > 1 ? no_workers * STRIPS_PER_WORKER : 1;
+  no_strips = no_strips > mcu_rows ? mcu_rows : no_strips;
+  int rows_per_strip = (mcu_rows + no_strips - 1) / no_strips;
+  if (no_strips > 1 && rows_per_strip * mcus_per_row > MAX_RESTART_INTERVAL)
+  {
+    rows_per_strip = MAX_RESTART_INTERVAL / mcus_per_row;
+  }
+  no_strips = (mcu_rows + rows_per_strip - 1) / rows_per_strip;
+
+  /* The headers are written through a template encoder, whose quantisation
+     tables every strip then copies. */
+  struct jpeg_encoder header;
+  memset(&header, 0, sizeof(header));
+  header.width = width;
+  header.height = height;
+  header.subsample = profile->subsampling == JPEG_SUBSAMPLING_420;
+  header.mcu_size = mcu_size;
+  stbi__start_write_callbacks(&header.s, stbi__stdio_write, stream);
+  write_jpeg_headers(&header, profile->quality < 0 ? 100 : profile->quality, no_strips > 1 ? rows_per_strip * mcus_per_row : 0,
+                     profile->exif_orientation);
+
+  struct strip_task *tasks = calloc(no_strips, sizeof(struct strip_task));
+  struct thread_pool pool;
+  bool encoded = tasks != NULL && init_thread_pool(&pool, no_workers > 1 ? no_workers : 1);
+  if (encoded)
+  {
+    for (int i = 0; i < no_strips; i++)
+    {
+      tasks[i].enc = header;
+      tasks[i].enc.s.func = append_output;
+      tasks[i].enc.s.context = &tasks[i].out;
+      tasks[i].first_row = i * rows_per_strip * mcu_size;
+      tasks[i].end_row = (i + 1) * rows_per_strip * mcu_size;
+      tasks[i].end_row = tasks[i].end_row > height ? height : tasks[i].end_row;
+      tasks[i].fill_row = fill_row;
+      tasks[i].arg = arg;
+      if (!submit_task(&pool, encode_strip_task, &tasks[i]))
+      {
+        encode_strip_task(&tasks[i]);
+      }
+    }
+    /* Destroying the pool waits for every queued strip. */
+    destroy_thread_pool(&pool);
+  }
+
+  /* Concatenate the strips in order, separated by restart markers. */
+  for (int i = 0; encoded && i < no_strips; i++)
+  {
+    if (tasks[i].out.failed)
+    {
+      encoded = false;
+      break;
+    }
+    header.s.func(header.s.context, tasks[i].out.data, (int)tasks[i].out.size);
+    if (i < no_strips - 1)
+    {
+      stbiw__putc(&header.s, 0xFF);
+      stbiw__putc(&header.s, 0xD0 + i % 8);
+    }
+  }
+  stbiw__putc(&header.s, 0xFF);
+  stbiw__putc(&header.s, 0xD9);
+
+  for (int i = 0; tasks != NULL && i < no_strips; i++)
+  {
+    free(tasks[i].out.data);
+  }
+  free(tasks);
+  bool written = fflush(stream) == 0 && !ferror(stream);
+  return encoded && written;
+}
+
+bool write_jpeg_parallel(const char *path, int width, int height, const struct jpeg_profile *profile,
+                         int no_workers, jpeg_row_source fill_row, void *arg)
+{
+  if (!valid_dimensions(width, height))
+  {
+    return false;
+  }
+  FILE *file = fopen(path, "wb");
+  if (file == NULL)
+  {
+    return false;
+  }
+  bool written = write_jpeg_parallel_to_stream(file, width, height, profile, no_workers, fill_row, arg);
+  return fclose(file) == 0 && written;
+}
+
+/*
+   Huffman-codes one block of quantised coefficients, as the second half of
+   stbiw__jpg_processDU does for the blocks it has just transformed.
+   Parameters:
+     - s: The output.
+     - bitBuf, bitCnt: The pending output bits.
+     - block: The 64 coefficients, in natural order.
+     - DC: The previous DC coefficient of the component.
+     - HTDC, HTAC: The component's Huffman tables.
+   Returns the block's DC coefficient, to predict the next one from.
+*/
+static int write_coefficient_block(stbi__write_context *s, int *bitBuf, int *bitCnt, const short *block, int DC,
+                                   const unsigned short HTDC[256][2], const unsigned short HTAC[256][2])
+{
+  const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
+  const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
+  unsigned short bits[2];
+  int DU[64];
+
+  for (int i = 0; i < 64; ++i)
+  {
+    DU[stbiw__jpg_ZigZag[i]] = block[i];
+  }
+  int diff = DU[0] - DC;
+  if (diff == 0)
+  {
+    stbiw__jpg_writeBits(s, bitBuf, bitCnt, HTDC[0]);
+  }
+  else
+  {
+    stbiw__jpg_calcBits(diff, bits);
+    stbiw__jpg_writeBits(s, bitBuf, bitCnt, HTDC[bits[1]]);
+    stbiw__jpg_writeBits(s, bitBuf, bitCnt, bits);
+  }
+
+  int end0pos = 63;
+  while (end0pos > 0 && DU[end0pos] == 0)
+  {
+    --end0pos;
+  }
+  for (int i = 1; i <= end0pos; ++i)
+  {
+    int nrzeroes = 0;
+    for (; DU[i] == 0; ++i)
+    {
+      ++nrzeroes;
+    }
+    for (; nrzeroes >= 16; nrzeroes -= 16)
+    {
+      stbiw__jpg_writeBits(s, bitBuf, bitCnt, M16zeroes);
+    }
+    stbiw__jpg_calcBits(DU[i], bits);
+    stbiw__jpg_writeBits(s, bitBuf, bitCnt, HTAC[(nrzeroes << 4) + bits[1]]);
+    stbiw__jpg_writeBits(s, bitBuf, bitCnt, bits);
+  }
+  if (end0pos != 63)
+  {
+    stbiw__jpg_writeBits(s, bitBuf, bitCnt, EOB);
+  }
+  return DU[0];
+}
+
+bool write_jpeg_coefficients(const char *path, const struct jpeg_coefficients *coef)
+{
+  if (!valid_dimensions(coef->width, coef->height))
+  {
+    return false;
+  }
+  struct jpeg_encoder enc;
+  memset(&enc, 0, sizeof(enc));
+  if (!stbi__start_write_file(&enc.s, path))
+  {
+    return false;
+  }
+  stbi__write_context *s = &enc.s;
+
+  /* Baseline files hold 8 bit tables; anything coarser needs the extended
+     sequential frame type, which is otherwise coded identically. */
+  bool wide = false;
+  int h_max = 1, v_max = 1;
+  for (int k = 0; k < RGB_BYTES; k++)
+  {
+    for (int i = 0; i < 64; i++)
+    {
+      wide = wide || coef->comps[k].quant[i] > 0xFF;
+    }
+    h_max = coef->comps[k].h > h_max ? coef->comps[k].h : h_max;
+    v_max = coef->comps[k].v > v_max ? coef->comps[k].v : v_max;
+  }
+
+  static const unsigned char jfif[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0 };
+  s->func(s->context, (void *)jfif, sizeof(jfif));
+  int dqt_length = 2 + RGB_BYTES * (1 + (wide ? 128 : 64));
+  const unsigned char dqt[] = { 0xFF,0xDB,(unsigned char)(dqt_length >> 8),STBIW_UCHAR(dqt_length) };
+  s->func(s->context, (void *)dqt, sizeof(dqt));
+  for (int k = 0; k < RGB_BYTES; k++)
+  {
+    unsigned short zigzag[64];
+    for (int i = 0; i < 64; i++)
+    {
+      zigzag[stbiw__jpg_ZigZag[i]] = coef->comps[k].quant[i];
+    }
+    stbiw__putc(s, (wide ? 0x10 : 0) | k);
+    for (int i = 0; i < 64; i++)
+    {
+      if (wide)
+      {
+        stbiw__putc(s, zigzag[i] >> 8);
+      }
+      stbiw__putc(s, STBIW_UCHAR(zigzag[i]));
+    }
+  }
+  const unsigned char sof[] = { 0xFF,wide ? 0xC1 : 0xC0,0,0x11,8,(unsigned char)(coef->height >> 8),STBIW_UCHAR(coef->height),
+                                (unsigned char)(coef->width >> 8),STBIW_UCHAR(coef->width),3,
+                                1,(unsigned char)(coef->comps[0].h << 4 | coef->comps[0].v),0,
+                                2,(unsigned char)(coef->comps[1].h << 4 | coef->comps[1].v),1,
+                                3,(unsigned char)(coef->comps[2].h << 4 | coef->comps[2].v),2 };
+  s->func(s->context, (void *)sof, sizeof(sof));
+  write_huffman_tables(s);
+  static const unsigned char sos[] = { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
+  s->func(s->context, (void *)sos, sizeof(sos));
+
+  /* One interleaved scan: each MCU holds h x v blocks of every component. */
+  int mcus_x = (coef->width + h_max * BLOCK_SIZE - 1) / (h_max * BLOCK_SIZE);
+  int mcus_y = (coef->height + v_max * BLOCK_SIZE - 1) / (v_max * BLOCK_SIZE);
+  int DC[RGB_BYTES] = { 0, 0, 0 };
+  for (int my = 0; my < mcus_y; my++)
+  {
+    for (int mx = 0; mx < mcus_x; mx++)
+    {
+      for (int k = 0; k < RGB_BYTES; k++)
+      {
+        const struct jpeg_component_coefficients *comp = &coef->comps[k];
+        for (int y = 0; y < comp->v; y++)
+        {
+          for (int x = 0; x < comp->h; x++)
+          {
+            const short *block = jpeg_coefficient_block(comp, mx * comp->h + x, my * comp->v + y);
+            DC[k] = write_coefficient_block(s, &enc.bitBuf, &enc.bitCnt, block, DC[k], k == 0 ? YDC_HT : UVDC_HT,
+                                            k == 0 ? YAC_HT : UVAC_HT);
+          }
+        }
+      }
+    }
+  }
+  flush_bits(&enc);
+  stbiw__putc(s, 0xFF);
+  stbiw__putc(s, 0xD9);
+
+  FILE *f = (FILE *)s->context;
+  bool written = fflush(f) == 0 && !ferror(f);
+  stbi__end_write_file(s);
+  return written;
+}
@@ -0,0 +1,82 @@
+#ifndef JPEGENCODE_H
+#define JPEGENCODE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "JpegDecode.h"
+
+/* An incremental baseline JPEG encoder. Scanlines are pushed one at a time and
+   only a single strip of MCUs (8 or 16 rows) is ever buffered, so the encoder
+   needs O(width) memory. With the default profile, output is byte-for-byte
+   what sod_img_save_as_jpeg writes. */
+struct jpeg_encoder;
+
+/* Chroma subsampling of an encoded picture: full resolution colour, or colour
+   averaged over 2x2 pixel blocks (much smaller files, as most cameras write). */
+enum jpeg_subsampling
+{
+  JPEG_SUBSAMPLING_444,
+  JPEG_SUBSAMPLING_420
+};
+
+/* How a picture is encoded. Quality is as for sod (-1 meaning best); the
+   default profile reproduces sod_img_save_as_jpeg's output. A non-zero
+   exif_orientation (1-8) is recorded as the EXIF Orientation tag, telling
+   viewers how to turn the stored pixels for display. */
+struct jpeg_profile
+{
+  int quality;
+  enum jpeg_subsampling subsampling;
+  int exif_orientation;
+};
+#define DEFAULT_JPEG_PROFILE ((struct jpeg_profile){ -1, JPEG_SUBSAMPLING_444, 0 })
+
+/* Size of the APP1 segment make_exif_segment builds: the marker, its length
+   and an EXIF block holding just the Orientation tag. */
+#define EXIF_SEGMENT_SIZE 36
+
+// build the APP1 segment recording the given EXIF Orientation tag (1-8)
+void make_exif_segment(unsigned char segment[EXIF_SEGMENT_SIZE], int orientation);
+
+// update a profile from textual settings (either may be NULL to leave that
+// setting alone): quality in 1..100 and subsampling "444" or "420"; returns
+// false, leaving the profile untouched, if either is invalid
+bool parse_jpeg_profile(struct jpeg_profile *profile, const char *quality, const char *subsampling);
+
+// true if the profile asks for no particular encoding (the quality and
+// subsampling of DEFAULT_JPEG_PROFILE)
+bool is_default_jpeg_profile(const struct jpeg_profile *profile);
+
+// start a width x height JPEG at path, encoded as the profile describes
+struct jpeg_encoder *open_jpeg_encoder(const char *path, int width, int height, const struct jpeg_profile *profile);
+
+// start a width x height JPEG written to an open stream (a pipe, or memory
+// from open_memstream), which the encoder leaves open
+struct jpeg_encoder *open_jpeg_encoder_to_stream(FILE *stream, int width, int height, const struct jpeg_profile *profile);
+
+// append the next scanline, given as width interleaved RGB byte triples
+bool write_jpeg_row(struct jpeg_encoder *enc, const unsigned char *rgb);
+
+// flush the final strip, close the file (unless it is the caller's stream)
+// and release the encoder; fails if fewer than height rows were written or
+// the file could not be written
+bool close_jpeg_encoder(struct jpeg_encoder *enc);
+
+// produces scanline y of a picture as width interleaved RGB byte triples; may
+// be called from several threads at once, for different rows
+typedef void (*jpeg_row_source)(void *arg, int y, unsigned char *rgb);
+
+// encode a whole picture, whose rows are produced on demand, with strips of
+// block rows entropy-coded on no_workers threads and separated by restart
+// markers; with a single worker the output matches the scanline encoder
+bool write_jpeg_parallel(const char *path, int width, int height, const struct jpeg_profile *profile,
+                         int no_workers, jpeg_row_source fill_row, void *arg);
+bool write_jpeg_parallel_to_stream(FILE *stream, int width, int height, const struct jpeg_profile *profile,
+                                   int no_workers, jpeg_row_source fill_row, void *arg);
+
+// write a JPEG straight from quantised DCT coefficients (see JpegDecode.h),
+// with no DCT at all; the coefficients are Huffman-coded with the standard
+// tables, and the picture must cover the components' block grids
+bool write_jpeg_coefficients(const char *path, const struct jpeg_coefficients *coef);
+
+#endif
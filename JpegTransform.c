@@ -0,0 +1,459 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "JpegTransform.h"
+#include "JpegDecode.h"
+#include "JpegEncode.h"
+
+#define BLOCK_SIZE 8
+#define NO_COMPONENTS 3
+/* An EXIF segment's marker, length and "Exif\0\0" come before its TIFF
+   block, whose IFDs hold entries of a tag, type, count and value (or offset
+   of the values). */
+#define EXIF_HEADER_SIZE 10
+#define IFD_ENTRY_SIZE 12
+#define EXIF_ORIENTATION 0x0112
+#define TIFF_SHORT 3
+
+void rotate_orientation(struct jpeg_orientation *orientation, int angle)
+{
+  /* 180 degrees is both flips; 90 and 270 transpose, which swaps the axes of
+     any flips already applied, then flip one way. */
+  if (angle == 180)
+  {
+    orientation->flip_h = !orientation->flip_h;
+    orientation->flip_v = !orientation->flip_v;
+    return;
+  }
+  bool flip_h = orientation->flip_v;
+  bool flip_v = orientation->flip_h;
+  orientation->transpose = !orientation->transpose;
+  orientation->flip_h = angle == 90 ? !flip_h : flip_h;
+  orientation->flip_v = angle == 270 ? !flip_v : flip_v;
+}
+
+void flip_orientation(struct jpeg_orientation *orientation, char plane)
+{
+  if (plane == 'H')
+  {
+    orientation->flip_h = !orientation->flip_h;
+  }
+  else if (plane == 'V')
+  {
+    orientation->flip_v = !orientation->flip_v;
+  }
+}
+
+void compose_orientation(struct jpeg_orientation *orientation, struct jpeg_orientation next)
+{
+  /* A quarter turn is a transpose then a horizontal flip, which the second
+     flip undoes. */
+  if (next.transpose)
+  {
+    rotate_orientation(orientation, 90);
+    flip_orientation(orientation, 'H');
+  }
+  if (next.flip_h)
+  {
+    flip_orientation(orientation, 'H');
+  }
+  if (next.flip_v)
+  {
+    flip_orientation(orientation, 'V');
+  }
+}
+
+bool is_identity_orientation(struct jpeg_orientation orientation)
+{
+  return !orientation.transpose && !orientation.flip_h && !orientation.flip_v;
+}
+
+int exif_orientation_tag(struct jpeg_orientation orientation)
+{
+  /* Indexed by transpose, flip_h, flip_v: 1 is as stored, 2 and 4 mirrored,
+     3 half turned, 6 and 8 turned a quarter clockwise and anticlockwise, and
+     5 and 7 mirrored about either diagonal. */
+  static const int tags[8] = { 1, 4, 2, 3, 5, 8, 6, 7 };
+  return tags[orientation.transpose << 2 | orientation.flip_h << 1 | orientation.flip_v];
+}
+
+/*
+   Reorients one block of coefficients. Transposing the pixels transposes the
+   coefficients; mirroring them negates the odd horizontal (or vertical)
+   frequencies.
+   Parameters:
+     - src: The source block, in natural order.
+     - dst: The reoriented block.
+     - orientation: The reorientation.
+*/
+static void transform_block(const short *src, short *dst, struct jpeg_orientation orientation)
+{
+  for (int v = 0; v < BLOCK_SIZE; v++)
+  {
+    for (int u = 0; u < BLOCK_SIZE; u++)
+    {
+      short value = orientation.transpose ? src[u * BLOCK_SIZE + v] : src[v * BLOCK_SIZE + u];
+      bool negate = (orientation.flip_h && (u & 1)) != (orientation.flip_v && (v & 1));
+      dst[v * BLOCK_SIZE + u] = negate ? -value : value;
+    }
+  }
+}
+
+/*
+   Reorients every component of a picture, moving each block to its new place
+   in the grid and reorienting its coefficients.
+   Parameters:
+     - in: The source coefficients.
+     - out: Filled in with the reoriented coefficients (to be freed by the
+            caller, even on failure).
+     - orientation: The reorientation.
+*/
+static bool transform_coefficients(const struct jpeg_coefficients *in, struct jpeg_coefficients *out,
+                                   struct jpeg_orientation orientation)
+{
+  memset(out, 0, sizeof(*out));
+  out->width = orientation.transpose ? in->height : in->width;
+  out->height = orientation.transpose ? in->width : in->height;
+
+  /* Mirroring moves the partial MCUs at the right (or bottom) edge to the
+     other side, where they cannot be represented; only whole MCUs can move. */
+  int h_max = 1, v_max = 1;
+  for (int k = 0; k < NO_COMPONENTS; k++)
+  {
+    int h = orientation.transpose ? in->comps[k].v : in->comps[k].h;
+    int v = orientation.transpose ? in->comps[k].h : in->comps[k].v;
+    h_max = h > h_max ? h : h_max;
+    v_max = v > v_max ? v : v_max;
+  }
+  if ((orientation.flip_h && out->width % (h_max * BLOCK_SIZE) != 0) ||
+      (orientation.flip_v && out->height % (v_max * BLOCK_SIZE) != 0))
+  {
+    return false;
+  }
+
+  for (int k = 0; k < NO_COMPONENTS; k++)
+  {
+    const struct jpeg_component_coefficients *src = &in->comps[k];
+    struct jpeg_component_coefficients *dst = &out->comps[k];
+    dst->h = orientation.transpose ? src->v : src->h;
+    dst->v = orientation.transpose ? src->h : src->v;
+    dst->blocks_w = orientation.transpose ? src->blocks_h : src->blocks_w;
+    dst->blocks_h = orientation.transpose ? src->blocks_w : src->blocks_h;
+    for (int v = 0; v < BLOCK_SIZE; v++)
+    {
+      for (int u = 0; u < BLOCK_SIZE; u++)
+      {
+        dst->quant[v * BLOCK_SIZE + u] = orientation.transpose ? src->quant[u * BLOCK_SIZE + v] : src->quant[v * BLOCK_SIZE + u];
+      }
+    }
+    dst->blocks = malloc((size_t)dst->blocks_w * dst->blocks_h * 64 * sizeof(short));
+    if (dst->blocks == NULL)
+    {
+      return false;
+    }
+
+    for (int by = 0; by < dst->blocks_h; by++)
+    {
+      for (int bx = 0; bx < dst->blocks_w; bx++)
+      {
+        int x = orientation.flip_h ? dst->blocks_w - 1 - bx : bx;
+        int y = orientation.flip_v ? dst->blocks_h - 1 - by : by;
+        const short *block = orientation.transpose ? jpeg_coefficient_block(src, y, x) : jpeg_coefficient_block(src, x, y);
+        transform_block(block, jpeg_coefficient_block(dst, bx, by), orientation);
+      }
+    }
+  }
+  return true;
+}
+
+bool transform_jpeg_file(const char *src, const char *dst, struct jpeg_orientation orientation)
+{
+  struct jpeg_coefficients in, out;
+  if (!read_jpeg_coefficients(src, &in))
+  {
+    return false;
+  }
+  bool ok = transform_coefficients(&in, &out, orientation);
+  free_jpeg_coefficients(&in);
+  ok = ok && write_jpeg_coefficients(dst, &out);
+  free_jpeg_coefficients(&out);
+  return ok;
+}
+
+/*
+   Reads a whole file into memory.
+   Parameters:
+     - path: The file to read.
+     - size: Set to the number of bytes read.
+   Returns the contents (to be freed by the caller), or NULL on failure.
+*/
+static unsigned char *read_whole_file(const char *path, size_t *size)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+  {
+    return NULL;
+  }
+  unsigned char *data = NULL;
+  long length;
+  if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0)
+  {
+    data = malloc(length);
+    if (data != NULL && fread(data, 1, length, file) != (size_t)length)
+    {
+      free(data);
+      data = NULL;
+    }
+    *size = length;
+  }
+  fclose(file);
+  return data;
+}
+
+/*
+   Finds the length of the marker segment at pos, if it is one that comes
+   before the start of scan.
+   Parameters:
+     - data, size: The file.
+     - pos: Where the segment starts.
+   Returns its length, marker included, or 0 if there is no such segment.
+*/
+static size_t header_segment_length(const unsigned char *data, size_t size, size_t pos)
+{
+  if (pos + 4 > size || data[pos] != 0xFF || data[pos + 1] == 0xDA)
+  {
+    return 0;
+  }
+  size_t length = 2 + (data[pos + 2] << 8 | data[pos + 3]);
+  return pos + length <= size ? length : 0;
+}
+
+/*
+   Checks whether a marker segment is an EXIF APP1 segment.
+   Parameters:
+     - segment: The segment, from its marker on.
+     - length: The length of the segment, marker included.
+*/
+static bool is_exif_segment(const unsigned char *segment, size_t length)
+{
+  return segment[1] == 0xE1 && length >= 10 && memcmp(segment + 4, "Exif\0\0", 6) == 0;
+}
+
+/*
+   Reads a value of a TIFF block (the body of an EXIF segment).
+   Parameters:
+     - p: Where the value starts.
+     - bytes: Its size, 2 (a SHORT) or 4 (a LONG).
+     - big_endian: Whether the block is in Motorola ("MM") byte order.
+*/
+static unsigned long tiff_value(const unsigned char *p, int bytes, bool big_endian)
+{
+  unsigned long value = 0;
+  for (int i = 0; i < bytes; i++)
+  {
+    value |= (unsigned long)p[big_endian ? i : bytes - 1 - i] << (8 * (bytes - 1 - i));
+  }
+  return value;
+}
+
+/*
+   Writes a value of a TIFF block, as tiff_value reads it.
+*/
+static void put_tiff_value(unsigned char *p, int bytes, unsigned long value, bool big_endian)
+{
+  for (int i = 0; i < bytes; i++)
+  {
+    p[big_endian ? i : bytes - 1 - i] = (unsigned char)(value >> (8 * (bytes - 1 - i)));
+  }
+}
+
+/*
+   Finds the orientation an EXIF Orientation tag asks for.
+   Parameters:
+     - tag: The tag's value.
+     - orientation: Set to the orientation.
+   Returns false if the tag is not one of 1-8.
+*/
+static bool tag_orientation(unsigned long tag, struct jpeg_orientation *orientation)
+{
+  for (int i = 0; i < 8; i++)
+  {
+    struct jpeg_orientation candidate = { i & 4, i & 2, i & 1 };
+    if ((unsigned long)exif_orientation_tag(candidate) == tag)
+    {
+      *orientation = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+   Rewrites an EXIF segment to record an orientation following the one it
+   already records, keeping all its other entries. An Orientation entry of
+   the first IFD is changed in place; without one, a copy of that IFD with
+   the entry added is appended to the block and made the first IFD instead,
+   so no offset into the block moves.
+   Parameters:
+     - segment, length: The EXIF segment, marker included.
+     - orientation: The orientation to follow the recorded one with.
+     - size: Set to the length of the rewritten segment.
+   Returns the rewritten segment (to be freed by the caller), or NULL if the
+   segment cannot be parsed or would grow too long.
+*/
+static unsigned char *retag_exif_segment(const unsigned char *segment, size_t length,
+                                         struct jpeg_orientation orientation, size_t *size)
+{
+  const unsigned char *tiff = segment + EXIF_HEADER_SIZE;
+  size_t tiff_size = length - EXIF_HEADER_SIZE;
+  if (tiff_size < 8 || (memcmp(tiff, "MM", 2) != 0 && memcmp(tiff, "II", 2) != 0))
+  {
+    return NULL;
+  }
+  bool big_endian = tiff[0] == 'M';
+  size_t ifd = tiff_value(tiff + 4, 4, big_endian);
+  if (tiff_value(tiff + 2, 2, big_endian) != 42 || ifd < 8 || ifd > tiff_size - 2)
+  {
+    return NULL;
+  }
+  size_t entries = tiff_value(tiff + ifd, 2, big_endian);
+  if (ifd + 2 + entries * IFD_ENTRY_SIZE + 4 > tiff_size)
+  {
+    return NULL;
+  }
+
+  /* Find the Orientation entry, or the place it would be inserted at (IFD
+     entries are sorted by tag). */
+  struct jpeg_orientation recorded = IDENTITY_ORIENTATION;
+  size_t entry = 0;
+  bool found = false;
+  for (; entry < entries; entry++)
+  {
+    const unsigned char *p = tiff + ifd + 2 + entry * IFD_ENTRY_SIZE;
+    unsigned long tag = tiff_value(p, 2, big_endian);
+    if (tag == EXIF_ORIENTATION)
+    {
+      if (tiff_value(p + 2, 2, big_endian) != TIFF_SHORT || tiff_value(p + 4, 4, big_endian) != 1
+          || !tag_orientation(tiff_value(p + 8, 2, big_endian), &recorded))
+      {
+        return NULL;
+      }
+      found = true;
+      break;
+    }
+    if (tag > EXIF_ORIENTATION)
+    {
+      break;
+    }
+  }
+  compose_orientation(&recorded, orientation);
+  int value = exif_orientation_tag(recorded);
+
+  if (found)
+  {
+    unsigned char *retagged = malloc(length);
+    if (retagged != NULL)
+    {
+      memcpy(retagged, segment, length);
+      put_tiff_value(retagged + EXIF_HEADER_SIZE + ifd + 2 + entry * IFD_ENTRY_SIZE + 8, 2, value, big_endian);
+      *size = length;
+    }
+    return retagged;
+  }
+
+  /* Offsets into the block must be even. */
+  size_t new_ifd = (tiff_size + 1) & ~(size_t)1;
+  size_t new_length = EXIF_HEADER_SIZE + new_ifd + 2 + (entries + 1) * IFD_ENTRY_SIZE + 4;
+  unsigned char *retagged = new_length - 2 <= 0xFFFF ? calloc(1, new_length) : NULL;
+  if (retagged == NULL)
+  {
+    return NULL;
+  }
+  memcpy(retagged, segment, length);
+  retagged[2] = (unsigned char)((new_length - 2) >> 8);
+  retagged[3] = (unsigned char)(new_length - 2);
+  unsigned char *new_tiff = retagged + EXIF_HEADER_SIZE;
+  put_tiff_value(new_tiff + 4, 4, new_ifd, big_endian);
+  unsigned char *p = new_tiff + new_ifd;
+  const unsigned char *old = tiff + ifd + 2;
+  put_tiff_value(p, 2, entries + 1, big_endian);
+  p += 2;
+  memcpy(p, old, entry * IFD_ENTRY_SIZE);
+  p += entry * IFD_ENTRY_SIZE;
+  put_tiff_value(p, 2, EXIF_ORIENTATION, big_endian);
+  put_tiff_value(p + 2, 2, TIFF_SHORT, big_endian);
+  put_tiff_value(p + 4, 4, 1, big_endian);
+  put_tiff_value(p + 8, 2, value, big_endian);
+  p += IFD_ENTRY_SIZE;
+  /* The rest of the entries, and the offset of the next IFD. */
+  memcpy(p, old + entry * IFD_ENTRY_SIZE, (entries - entry) * IFD_ENTRY_SIZE + 4);
+  *size = new_length;
+  return retagged;
+}
+
+bool tag_jpeg_file(const char *src, const char *dst, struct jpeg_orientation orientation)
+{
+  /* The source is read whole first, so dst may be the same file. */
+  size_t size;
+  unsigned char *data = read_whole_file(src, &size);
+  if (data == NULL)
+  {
+    return false;
+  }
+
+  /* The header segments run from after the start of image marker to the
+     start of scan, from which the rest is copied as it is. */
+  size_t scan = 2, length;
+  while ((length = header_segment_length(data, size, scan)) > 0)
+  {
+    scan += length;
+  }
+  bool ok = size > 4 && data[0] == 0xFF && data[1] == 0xD8 && scan + 2 <= size && data[scan] == 0xFF
+            && data[scan + 1] == 0xDA;
+
+  /* The orientation is composed with that of an EXIF segment already there,
+     which is rewritten where it is; otherwise a new segment goes after a
+     leading JFIF segment (which must stay first). */
+  size_t pos = 2, replaced = 0, exif_size = EXIF_SEGMENT_SIZE;
+  unsigned char *exif = NULL;
+  for (; ok && pos < scan; pos += length)
+  {
+    length = header_segment_length(data, size, pos);
+    if (is_exif_segment(data + pos, length))
+    {
+      exif = retag_exif_segment(data + pos, length, orientation, &exif_size);
+      replaced = length;
+      ok = exif != NULL;
+      break;
+    }
+  }
+  if (ok && exif == NULL)
+  {
+    pos = 2;
+    if (data[pos + 1] == 0xE0)
+    {
+      pos += header_segment_length(data, size, pos);
+    }
+    exif = malloc(EXIF_SEGMENT_SIZE);
+    ok = exif != NULL;
+    if (ok)
+    {
+      make_exif_segment(exif, exif_orientation_tag(orientation));
+    }
+  }
+  FILE *file = ok ? fopen(dst, "wb") : NULL;
+  if (file == NULL)
+  {
+    free(exif);
+    free(data);
+    return false;
+  }
+
+  size_t rest = pos + replaced;
+  ok = fwrite(data, 1, pos, file) == pos && fwrite(exif, 1, exif_size, file) == exif_size
+       && fwrite(data + rest, 1, size - rest, file) == size - rest;
+  ok = fclose(file) == 0 && ok;
+  free(exif);
+  free(data);
+  return ok;
+}
@@ -0,0 +1,45 @@
+#ifndef JPEGTRANSFORM_H
+#define JPEGTRANSFORM_H
+
+#include <stdbool.h>
+
+/* A rotation or flip of a picture, as a transpose (about the main diagonal)
+   followed by horizontal and vertical flips. Every combination of rotate and
+   flip steps reduces to one of these eight orientations. */
+struct jpeg_orientation
+{
+  bool transpose;
+  bool flip_h;
+  bool flip_v;
+};
+#define IDENTITY_ORIENTATION ((struct jpeg_orientation){ false, false, false })
+
+// follow an orientation with a further rotation (clockwise, in degrees: 90,
+// 180 or 270) or flip ('H' mirrors left to right, 'V' top to bottom)
+void rotate_orientation(struct jpeg_orientation *orientation, int angle);
+void flip_orientation(struct jpeg_orientation *orientation, char plane);
+
+// follow an orientation with another
+void compose_orientation(struct jpeg_orientation *orientation, struct jpeg_orientation next);
+
+// true if the orientation leaves pictures unchanged
+bool is_identity_orientation(struct jpeg_orientation orientation);
+
+// the EXIF Orientation tag (1-8) asking viewers to turn stored pixels this way
+int exif_orientation_tag(struct jpeg_orientation orientation);
+
+// write src (a baseline colour JPEG) to dst reoriented, by moving and
+// negating its quantised DCT coefficients as jpegtran does: there is no
+// IDCT, DCT or requantisation, so nothing is lost. Fails, writing nothing,
+// if src is another kind of JPEG, or if a picture edge that is not on an MCU
+// boundary would have to move (its partial MCUs cannot be mirrored exactly)
+bool transform_jpeg_file(const char *src, const char *dst, struct jpeg_orientation orientation);
+
+// copy the JPEG src to dst with an EXIF Orientation tag recording the
+// orientation added (following any orientation src's EXIF segment records,
+// whose other entries are kept); the compressed picture is copied byte for
+// byte, so this costs no more than the copy. Fails, writing nothing, if src
+// has an EXIF segment that cannot be parsed
+bool tag_jpeg_file(const char *src, const char *dst, struct jpeg_orientation orientation);
+
+#endif
@@ -0,0 +1,426 @@
+#include <string.h>
+#include <poll.h>
+#include "PicInterp.h"
+#include "PicProcess.h"
+#include "BufferPool.h"
+
+  #define COMMAND_DELIMITERS " \t\r\n"
+  #define MAX_COMMAND_ARGS 5
+  // commands read ahead of the one being run, when they are already there
+  #define LOOKAHEAD_LINES 64
+
+  // the commands read ahead, as a ring of lines
+  struct lookahead {
+    char lines[LOOKAHEAD_LINES][MAX_COMMAND_LENGTH];
+    int first;
+    int count;
+    // input ended after these lines
+    bool end;
+  };
+
+// -------------- picture transformation function wrappers -------------- \\
+
+  static void invert_transform(struct picture *pic, const char *unused){
+    (void)unused;
+    invert_picture(pic);
+  }
+
+  static void grayscale_transform(struct picture *pic, const char *unused){
+    (void)unused;
+    grayscale_picture(pic);
+  }
+
+  static void rotate_transform(struct picture *pic, const char *extra_arg){
+    rotate_picture(pic, atoi(extra_arg));
+  }
+
+  static void flip_transform(struct picture *pic, const char *extra_arg){
+    flip_picture(pic, extra_arg[0]);
+  }
+
+  static void blur_transform(struct picture *pic, const char *unused){
+    (void)unused;
+    blur_picture(pic);
+  }
+
+// ------------------------------------------------------------------------ \\
+
+  // validation routines for transformation arguments (checked before queueing,
+  // as the transformations themselves abort the process on bad input)
+  static bool valid_angle(const char *arg){
+    int angle = atoi(arg);
+    return angle == 90 || angle == 180 || angle == 270;
+  }
+
+  static bool valid_plane(const char *arg){
+    return (arg[0] == 'H' || arg[0] == 'V') && arg[1] == '\0';
+  }
+
+  // look-up table of picture transformations understood by the interpreter
+  static const struct {
+    const char *name;
+    pic_transform transform;
+    bool (*valid_arg)(const char *arg);
+  } transforms[] = {
+    { "invert",    invert_transform,    NULL },
+    { "grayscale", grayscale_transform, NULL },
+    { "rotate",    rotate_transform,    valid_angle },
+    { "flip",      flip_transform,      valid_plane },
+    { "blur",      blur_transform,      NULL }
+  };
+
+  static int no_of_transforms = sizeof(transforms) / sizeof(transforms[0]);
+
+  void picture_name_from_path(const char *path, char *name, size_t size){
+    const char *base = strrchr(path, '/');
+    base = base == NULL ? path : base + 1;
+    const char *ext = strrchr(base, '.');
+    size_t len = ext == NULL || ext == base ? strlen(base) : (size_t)(ext - base);
+    if(len >= size){
+      len = size - 1;
+    }
+    memcpy(name, base, len);
+    name[len] = '\0';
+  }
+
+  // report how well temporary picture buffers are being recycled, and how
+  // often saves are served from the result cache and loads from the decode
+  // cache (once the session's queued work has finished, so the counters
+  // include it)
+  static void print_stats(struct pic_session *session){
+    wait_for_session(session);
+    struct buffer_pool_stats stats = get_buffer_pool_stats();
+    fprintf(session->out, "buffer pool: %lu hits, %lu misses (%.1f%% hit rate), %zu bytes cached\n",
+            stats.hits, stats.misses, 100.0 * buffer_pool_hit_rate(&stats), stats.cached_bytes);
+    struct result_cache *cache = session->store->cache;
+    if(cache != NULL){
+      unsigned long hits, misses;
+      size_t bytes;
+      result_cache_stats(cache, &hits, &misses, &bytes);
+      fprintf(session->out, "result cache: %lu hits, %lu misses, %zu bytes cached\n", hits, misses, bytes);
+    }
+    cache = session->store->decode_cache;
+    if(cache != NULL){
+      unsigned long hits, misses;
+      size_t bytes;
+      result_cache_stats(cache, &hits, &misses, &bytes);
+      fprintf(session->out, "decode cache: %lu hits, %lu misses, %zu bytes cached\n", hits, misses, bytes);
+    }
+    fflush(session->out);
+  }
+
+  static int split_command(char *line, char *args[]){
+    int argc = 0;
+    char *saveptr;
+    for(char *tok = strtok_r(line, COMMAND_DELIMITERS, &saveptr);
+        tok != NULL && argc < MAX_COMMAND_ARGS;
+        tok = strtok_r(NULL, COMMAND_DELIMITERS, &saveptr)){
+      args[argc++] = tok;
+    }
+    return argc;
+  }
+
+  // index of the argument naming the picture to load in a load command
+  static int load_path_arg(char *args[], int argc){
+    return argc > 2 && (!strcmp(args[1], "--scale") || !strcmp(args[1], "--region")) ? 3 : 1;
+  }
+
+  // parse the options of a load command: "load --scale 1/4 <path> <picture>"
+  // decodes a reduced picture, and "load --region 64x48+10+20 <path>
+  // <picture>" just part of one (false if the command is malformed)
+  static bool parse_load(char *args[], int argc, int *scale, struct image_region *region){
+    *scale = 1;
+    *region = (struct image_region){ 0, 0, 0, 0 };
+    if(argc > 2 && !strcmp(args[1], "--scale") && !parse_image_scale(args[2], scale)){
+      return false;
+    }
+    if(argc > 2 && !strcmp(args[1], "--region") && !parse_image_region(args[2], region)){
+      return false;
+    }
+    return argc == load_path_arg(args, argc) + 2;
+  }
+
+  // the transformation a command asks for, and of which picture (-1 if the
+  // command is not a valid transformation)
+  static int parse_transform(char *args[], int argc, const char **extra_arg, const char **filename){
+    for(int no = 0; no < no_of_transforms; no++){
+      if(strcmp(args[0], transforms[no].name)){
+        continue;
+      }
+      if(transforms[no].valid_arg == NULL){
+        *extra_arg = NULL;
+        *filename = args[1];
+        return argc == 2 ? no : -1;
+      }
+      *extra_arg = args[1];
+      *filename = args[2];
+      return argc == 3 && transforms[no].valid_arg(args[1]) ? no : -1;
+    }
+    return -1;
+  }
+
+  // whether a save command will be served from the result cache, the picture
+  // it saves having the given key
+  static bool save_cached(struct pic_session *session, char *args[], int argc, struct cache_key key){
+    struct jpeg_profile profile = DEFAULT_JPEG_PROFILE;
+    return argc >= 3 && parse_jpeg_profile(&profile, argc > 3 ? args[3] : NULL, argc > 4 ? args[4] : NULL)
+           && output_cache_key(&key, args[2], &profile) && cache_contains(session->store->cache, &key);
+  }
+
+  // whether the commands read ahead ever output the named picture as it is
+  // now: transformations of it are followed past, to the first command that
+  // either saves or detaches it, or drops it by unloading it, replacing it
+  // with a load that will succeed, or ending the script; commands not read
+  // yet (and attaches, which may or may not replace it) might do either. Given
+  // the picture's result cache key, saves the cache already holds are passed
+  // over as well.
+  static enum load_demand picture_demand(struct pic_session *session, const struct lookahead *ahead, const char *name,
+                                         const struct cache_key *key){
+    struct cache_key later;
+    if(key != NULL){
+      later = *key;
+    }
+    for(int i = 0; i < ahead->count; i++){
+      char line[MAX_COMMAND_LENGTH];
+      char *args[MAX_COMMAND_ARGS];
+      strcpy(line, ahead->lines[(ahead->first + i) % LOOKAHEAD_LINES]);
+      int argc = split_command(line, args);
+      if(argc == 0){
+        continue;
+      }
+      if(!strcmp(args[0], "exit")){
+        return LOAD_DEMAND_NEVER;
+      }
+      // listing dimensions shows what transformations have made of them
+      if(!strcmp(args[0], "liststore") && argc == 2){
+        return LOAD_DEMAND_SOON;
+      }
+      if(argc < 2){
+        continue;
+      }
+      const char *extra_arg;
+      const char *target;
+      int no = key == NULL ? -1 : parse_transform(args, argc, &extra_arg, &target);
+      if(no >= 0 && !strcmp(target, name)){
+        step_cache_key(&later, transforms[no].name, extra_arg);
+      } else if(!strcmp(args[0], "save") || !strcmp(args[0], "detach")){
+        if(!strcmp(args[1], name) && !(key != NULL && !strcmp(args[0], "save") && save_cached(session, args, argc, later))){
+          return LOAD_DEMAND_SOON;
+        }
+      } else if(!strcmp(args[0], "unload") && argc == 2 && !strcmp(args[1], name)){
+        return LOAD_DEMAND_NEVER;
+      } else if(!strcmp(args[0], "load") && !strcmp(args[argc - 1], name)){
+        // a reload only drops the picture if it will replace it; one that is
+        // going to fail leaves it to the commands after
+        int scale;
+        struct image_region region;
+        if(parse_load(args, argc, &scale, &region)
+           && load_would_replace(session, args[load_path_arg(args, argc)], &region)){
+          return LOAD_DEMAND_NEVER;
+        }
+      } else if(!strcmp(args[0], "attach") && !strcmp(args[argc - 1], name)){
+        // whether an attach replaces the picture depends on the segments the
+        // client will have passed by then
+        return LOAD_DEMAND_UNKNOWN;
+      }
+    }
+    return ahead->end ? LOAD_DEMAND_NEVER : LOAD_DEMAND_UNKNOWN;
+  }
+
+  // queue a transformation, unless the commands read ahead show its result is
+  // never saved or detached
+  static bool run_transform(struct pic_session *session, int no, char *args[], int argc,
+                            const struct lookahead *ahead){
+    const char *extra_arg = NULL;
+    const char *filename;
+
+    // transformations with an argument take it before the picture name
+    if(transforms[no].valid_arg != NULL){
+      if(argc != 3){
+        fprintf(session->out, "[!] usage: %s <arg> <picture>\n", transforms[no].name);
+        return true;
+      }
+      extra_arg = args[1];
+      filename = args[2];
+      if(!transforms[no].valid_arg(extra_arg)){
+        fprintf(session->out, "[!] %s is undefined for argument %s\n", transforms[no].name, extra_arg);
+        return true;
+      }
+    } else {
+      if(argc != 2){
+        fprintf(session->out, "[!] usage: %s <picture>\n", transforms[no].name);
+        return true;
+      }
+      filename = args[1];
+    }
+
+    // (whether the result cache holds its saves is left out here, as a save
+    // the cache has since lost would need the transformation after all)
+    if(ahead != NULL && picture_demand(session, ahead, filename, NULL) == LOAD_DEMAND_NEVER){
+      discard_transform(session, filename, transforms[no].name, extra_arg);
+    } else {
+      transform_picture(session, filename, transforms[no].name, transforms[no].transform, extra_arg);
+    }
+    return true;
+  }
+
+  // run a command, knowing the commands that follow it where they have been
+  // read ahead
+  static bool execute_command(struct pic_session *session, char *line, const struct lookahead *ahead){
+    char *args[MAX_COMMAND_ARGS];
+    int argc = split_command(line, args);
+
+    // blank lines are ignored
+    if(argc == 0){
+      return true;
+    }
+
+    const char *cmd = args[0];
+    if(!strcmp(cmd, "exit")){
+      return false;
+    }
+    if(!strcmp(cmd, "liststore")){
+      // listing reflects every command issued so far; "liststore -l" adds
+      // each picture's dimensions, which need no picture to be decoded
+      if(argc > 2 || (argc == 2 && strcmp(args[1], "-l"))){
+        fprintf(session->out, "[!] usage: liststore [-l]\n");
+        return true;
+      }
+      print_picstore(session, argc == 2);
+      return true;
+    }
+    if(!strcmp(cmd, "stats")){
+      print_stats(session);
+      return true;
+    }
+    if(!strcmp(cmd, "load")){
+      int scale;
+      struct image_region region;
+      int first = load_path_arg(args, argc);
+      if(!parse_load(args, argc, &scale, &region)){
+        fprintf(session->out, "[!] usage: load [--scale 1/2|1/4|1/8 | --region WxH+X+Y] <path> <picture>\n");
+        return true;
+      }
+      // a picture whose saves the result cache already holds is not needed
+      struct cache_key key;
+      bool keyed = source_cache_key(session, args[first], scale, &region, &key);
+      enum load_demand demand = ahead == NULL ? LOAD_DEMAND_UNKNOWN
+                                              : picture_demand(session, ahead, args[first + 1], keyed ? &key : NULL);
+      load_picture(session, args[first], args[first + 1], scale, &region, demand, keyed ? &key : NULL);
+      return true;
+    }
+    if(!strcmp(cmd, "unload")){
+      if(argc != 2){
+        fprintf(session->out, "[!] usage: unload <picture>\n");
+        return true;
+      }
+      unload_picture(session, args[1]);
+      return true;
+    }
+    if(!strcmp(cmd, "attach")){
+      if(argc != 2){
+        fprintf(session->out, "[!] usage: attach <picture>\n");
+        return true;
+      }
+      attach_picture(session, args[1]);
+      return true;
+    }
+    if(!strcmp(cmd, "detach")){
+      if(argc != 2){
+        fprintf(session->out, "[!] usage: detach <picture>\n");
+        return true;
+      }
+      detach_picture(session, args[1]);
+      return true;
+    }
+    if(!strcmp(cmd, "orientation")){
+      // "orientation exif" has pictures loaded from then on record their
+      // rotations and flips as an EXIF tag when saved to JPEG, instead of
+      // turning their pixels; "orientation pixels" goes back to turning them
+      if(argc != 2 || (strcmp(args[1], "exif") && strcmp(args[1], "pixels"))){
+        fprintf(session->out, "[!] usage: orientation exif|pixels\n");
+        return true;
+      }
+      session->defer_orientation = !strcmp(args[1], "exif");
+      return true;
+    }
+    if(!strcmp(cmd, "save")){
+      // an optional quality and chroma subsampling trade fidelity for size
+      struct jpeg_profile profile = DEFAULT_JPEG_PROFILE;
+      if(argc < 3 || !parse_jpeg_profile(&profile, argc > 3 ? args[3] : NULL, argc > 4 ? args[4] : NULL)){
+        fprintf(session->out, "[!] usage: save <picture> <path> [quality (1-100)] [444|420]\n");
+        return true;
+      }
+      save_picture(session, args[1], args[2], &profile);
+      return true;
+    }
+
+    for(int no = 0; no < no_of_transforms; no++){
+      if(!strcmp(cmd, transforms[no].name)){
+        return run_transform(session, no, args, argc, ahead);
+      }
+    }
+
+    fprintf(session->out, "[!] invalid command requested: %s is not defined\n", cmd);
+    return true;
+  }
+
+  bool run_command(struct pic_session *session, char *line){
+    return execute_command(session, line, NULL);
+  }
+
+  // true if reading the stream would not block (only what has reached its
+  // descriptor counts, so lines already buffered by stdio may be missed)
+  static bool input_ready(FILE *in){
+    struct pollfd pfd = { fileno(in), POLLIN, 0 };
+    return pfd.fd != IO_ERROR && poll(&pfd, 1, 0) > 0;
+  }
+
+  // read ahead as far as input is already there (blocking only for the next
+  // command to run), starting to fetch the files of loads as they are seen
+  static void read_ahead(struct lookahead *ahead, FILE *in){
+    while(!ahead->end && ahead->count < LOOKAHEAD_LINES && (ahead->count == 0 || input_ready(in))){
+      char *line = ahead->lines[(ahead->first + ahead->count) % LOOKAHEAD_LINES];
+      if(fgets(line, MAX_COMMAND_LENGTH, in) == NULL){
+        ahead->end = true;
+        break;
+      }
+      ahead->count++;
+
+      char copy[MAX_COMMAND_LENGTH];
+      char *args[MAX_COMMAND_ARGS];
+      strcpy(copy, line);
+      int argc = split_command(copy, args);
+      int path = load_path_arg(args, argc);
+      if(argc > path && !strcmp(args[0], "load")){
+        prefetch_file(args[path]);
+      }
+    }
+  }
+
+  void run_interpreter(struct pic_session *session, FILE *in){
+    // without room to read ahead, commands simply run as they are read
+    struct lookahead *ahead = calloc(1, sizeof(struct lookahead));
+    char line[MAX_COMMAND_LENGTH];
+    for(;;){
+      if(ahead == NULL){
+        if(fgets(line, sizeof(line), in) == NULL){
+          break;
+        }
+      } else {
+        read_ahead(ahead, in);
+        if(ahead->count == 0){
+          break;
+        }
+        strcpy(line, ahead->lines[ahead->first]);
+        ahead->first = (ahead->first + 1) % LOOKAHEAD_LINES;
+        ahead->count--;
+      }
+      if(!execute_command(session, line, ahead)){
+        break;
+      }
+    }
+    free(ahead);
+    wait_for_session(session);
+    fflush(session->out);
+  }
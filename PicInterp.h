@@ -0,0 +1,20 @@
+#ifndef PICINTERP_H
+#define PICINTERP_H
+
+#include <stdio.h>
+#include "PicStore.h"
+
+  // maximum length of a single interpreter command line
+  #define MAX_COMMAND_LENGTH 1024
+
+  // derive a store name from a picture path (basename without extension)
+  void picture_name_from_path(const char *path, char *name, size_t size);
+
+  // execute a single interpreter command, returning false once "exit" is seen
+  bool run_command(struct pic_session *session, char *line);
+
+  // execute commands read from the stream until "exit" or end of input,
+  // waiting for all of the session's queued work to complete before returning
+  void run_interpreter(struct pic_session *session, FILE *in);
+
+#endif
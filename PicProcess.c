@@ -6,6 +6,8 @@
 
 void invert_picture(struct picture *pic)
 {
+  forget_jpeg_source(pic);
+
   // iterate over each pixel in the picture
   for (int i = 0; i < pic->width; i++)
   {
@@ -26,6 +28,8 @@ void invert_picture(struct picture *pic)
 
 void grayscale_picture(struct picture *pic)
 {
+  forget_jpeg_source(pic);
+
   // iterate over each pixel in the picture
   for (int i = 0; i < pic->width; i++)
   {
@@ -47,6 +51,13 @@ void grayscale_picture(struct picture *pic)
 
 void rotate_picture(struct picture *pic, int angle)
 {
+  // only record the turn, if asked to (see defer_orientation)
+  if (pic->defer_orientation && (angle == 90 || angle == 180 || angle == 270))
+  {
+    rotate_orientation(&pic->pending_orientation, angle);
+    return;
+  }
+
   // capture current picture size
   int new_width = pic->width;
   int new_height = pic->height;
@@ -60,7 +71,7 @@ void rotate_picture(struct picture *pic, int angle)
 
   // make new temporary picture to work in
   struct picture tmp;
-  init_picture_from_size(&tmp, new_width, new_height);
+  init_picture_like(&tmp, pic, new_width, new_height);
 
   // iterate over each pixel in the picture
   for (int i = 0; i < new_width; i++)
@@ -81,7 +92,7 @@ void rotate_picture(struct picture *pic, int angle)
         rgb = get_pixel(pic, new_height - 1 - j, i);
         break;
       default:
-        printf("[!] rotate is undefined for angle %i (must be 90, 180 or 270)\n", angle);
+        fprintf(report_stream(), "[!] rotate is undefined for angle %i (must be 90, 180 or 270)\n", angle);
         clear_picture(&tmp);
         clear_picture(pic);
         exit(IO_ERROR);
@@ -90,16 +101,25 @@ void rotate_picture(struct picture *pic, int angle)
     }
   }
 
-  // clean-up the old picture and replace with new picture
-  clear_picture(pic);
-  overwrite_picture(pic, &tmp);
+  // replace the old picture with the new one, which its JPEG source (if
+  // any) can still be turned into losslessly
+  struct jpeg_orientation orientation = pic->jpeg_orientation;
+  rotate_orientation(&orientation, angle);
+  overwrite_reoriented_picture(pic, &tmp, orientation);
 }
 
 void flip_picture(struct picture *pic, char plane)
 {
+  // only record the flip, if asked to (see defer_orientation)
+  if (pic->defer_orientation && (plane == 'H' || plane == 'V'))
+  {
+    flip_orientation(&pic->pending_orientation, plane);
+    return;
+  }
+
   // make new temporary picture to work in
   struct picture tmp;
-  init_picture_from_size(&tmp, pic->width, pic->height);
+  init_picture_like(&tmp, pic, pic->width, pic->height);
 
   // iterate over each pixel in the picture
   for (int i = 0; i < tmp.width; i++)
@@ -117,7 +137,7 @@ void flip_picture(struct picture *pic, char plane)
         rgb = get_pixel(pic, tmp.width - 1 - i, j);
         break;
       default:
-        printf("[!] flip is undefined for plane %c\n", plane);
+        fprintf(report_stream(), "[!] flip is undefined for plane %c\n", plane);
         clear_picture(&tmp);
         clear_picture(pic);
         exit(IO_ERROR);
@@ -126,16 +146,18 @@ void flip_picture(struct picture *pic, char plane)
     }
   }
 
-  // clean-up the old picture and replace with new picture
-  clear_picture(pic);
-  overwrite_picture(pic, &tmp);
+  // replace the old picture with the new one, which its JPEG source (if
+  // any) can still be turned into losslessly
+  struct jpeg_orientation orientation = pic->jpeg_orientation;
+  flip_orientation(&orientation, plane);
+  overwrite_reoriented_picture(pic, &tmp, orientation);
 }
 
 void blur_picture(struct picture *pic)
 {
   // make new temporary picture to work in
   struct picture tmp;
-  init_picture_from_size(&tmp, pic->width, pic->height);
+  init_picture_like(&tmp, pic, pic->width, pic->height);
 
   // iterate over each pixel in the picture
   for (int i = 0; i < tmp.width; i++)
@@ -293,7 +315,7 @@ void parallel_blur_picture(struct picture *pic)
 {
   /* Create a temporary picture struct to hold the blurred image, and initialise it using pic. */
   struct picture tmp;
-  init_picture_from_size(&tmp, pic->width, pic->height);
+  init_picture_like(&tmp, pic, pic->width, pic->height);
 
   /* Array to store thread IDs for parallel execution. */
   pthread_t threads[MAX_THREAD];
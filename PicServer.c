@@ -0,0 +1,290 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "PicServer.h"
+#include "PicInterp.h"
+#include "SharedPic.h"
+
+#define CONNECTION_BACKLOG 16
+
+/* Stores information about a connected client. */
+struct client_conn
+{
+  int fd;
+  int id;
+  struct pic_store *pstore;
+  struct client_conn *next;
+};
+
+/* Connected clients, so that they can be told to finish on shutdown. */
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t drained;
+  struct client_conn *clients;
+  int active;
+} server = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0};
+
+/* Self-pipe used to wake the accept loop from the signal handler. */
+static int stop_pipe[2] = {-1, -1};
+
+static void request_stop(int signo)
+{
+  (void)signo;
+  int saved_errno = errno;
+  if (write(stop_pipe[1], "x", 1) < 0)
+  {
+    /* nothing more can be done from inside a signal handler */
+  }
+  errno = saved_errno;
+}
+
+static void forget_client(struct client_conn *conn)
+{
+  pthread_mutex_lock(&server.lock);
+  struct client_conn **link = &server.clients;
+  while (*link != NULL && *link != conn)
+  {
+    link = &(*link)->next;
+  }
+  if (*link != NULL)
+  {
+    *link = conn->next;
+  }
+  if (--server.active == 0)
+  {
+    pthread_cond_broadcast(&server.drained);
+  }
+  pthread_mutex_unlock(&server.lock);
+}
+
+/*
+   Feeds the connection's commands to the interpreter line by line. Reading with
+   recvmsg lets clients pass shared memory segments alongside "attach" commands.
+   Parameters:
+     - session: Pointer to the connection's session.
+     - fd: The connection's socket.
+*/
+static void read_commands(struct pic_session *session, int fd)
+{
+  char line[MAX_COMMAND_LENGTH];
+  size_t len = 0;
+  bool running = true;
+
+  while (running)
+  {
+    int fds[MAX_PASSED_FDS];
+    int nfds;
+    ssize_t got = receive_with_fds(fd, line + len, sizeof(line) - 1 - len, fds, &nfds);
+    for (int i = 0; i < nfds; i++)
+    {
+      add_passed_fd(session, fds[i]);
+    }
+    if (got <= 0)
+    {
+      /* run a final unterminated command before finishing */
+      if (len > 0)
+      {
+        line[len] = '\0';
+        run_command(session, line);
+      }
+      break;
+    }
+    len += got;
+
+    /* run every complete line, keeping any partial one for the next read */
+    char *start = line;
+    char *newline;
+    while (running && (newline = memchr(start, '\n', len - (start - line))) != NULL)
+    {
+      *newline = '\0';
+      running = run_command(session, start);
+      start = newline + 1;
+    }
+    len -= start - line;
+    memmove(line, start, len);
+
+    if (len == sizeof(line) - 1)
+    {
+      fprintf(session->out, "[!] command too long, discarded\n");
+      len = 0;
+    }
+  }
+  wait_for_session(session);
+  fflush(session->out);
+}
+
+/*
+   Runs the interpreter for a single connection in its own namespace. Output is
+   line buffered so that clients see results as soon as they are produced.
+   Parameters:
+     - conn_arg: Pointer to the client_conn describing the connection.
+*/
+static void *serve_client(void *conn_arg)
+{
+  struct client_conn *conn = (struct client_conn *)conn_arg;
+  int out_fd = dup(conn->fd);
+  FILE *out = out_fd == IO_ERROR ? NULL : fdopen(out_fd, "w");
+
+  if (out != NULL)
+  {
+    setvbuf(out, NULL, _IOLBF, 0);
+    struct pic_session session;
+    open_session(conn->pstore, &session, out, conn->fd);
+    read_commands(&session, conn->fd);
+    close_session(&session);
+    fclose(out);
+  }
+  else if (out_fd != IO_ERROR)
+  {
+    close(out_fd);
+  }
+
+  /* Forget the connection before its descriptor can be reused. */
+  forget_client(conn);
+  close(conn->fd);
+  free(conn);
+  return NULL;
+}
+
+static int open_listener(const char *socket_path)
+{
+  struct sockaddr_un addr;
+  if (strlen(socket_path) >= sizeof(addr.sun_path))
+  {
+    printf("[!] socket path %s is too long\n", socket_path);
+    return IO_ERROR;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == IO_ERROR)
+  {
+    printf("[!] unable to create socket\n");
+    return IO_ERROR;
+  }
+  /* Replace any stale socket left behind by a previous server. */
+  unlink(socket_path);
+  /* Only the owning user may submit work, so the socket is created without
+     access for anyone else rather than opened up until the chmod (no session
+     is writing files yet, so narrowing the process's umask is safe). */
+  mode_t old_mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+  bool bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != IO_ERROR;
+  umask(old_mask);
+  if (!bound || chmod(socket_path, S_IRUSR | S_IWUSR) == IO_ERROR || listen(fd, CONNECTION_BACKLOG) == IO_ERROR)
+  {
+    printf("[!] unable to listen on %s\n", socket_path);
+    if (bound)
+    {
+      unlink(socket_path);
+    }
+    close(fd);
+    return IO_ERROR;
+  }
+  return fd;
+}
+
+bool run_server(struct pic_store *pstore, const char *socket_path)
+{
+  if (pipe(stop_pipe) == IO_ERROR)
+  {
+    return false;
+  }
+  int listen_fd = open_listener(socket_path);
+  if (listen_fd == IO_ERROR)
+  {
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    return false;
+  }
+
+  struct sigaction stop_action;
+  memset(&stop_action, 0, sizeof(stop_action));
+  stop_action.sa_handler = request_stop;
+  sigaction(SIGINT, &stop_action, NULL);
+  sigaction(SIGTERM, &stop_action, NULL);
+  /* A client hanging up must not take the server down with it. */
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("listening on %s\n", socket_path);
+  fflush(stdout);
+
+  int next_id = 1;
+  struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+  for (;;)
+  {
+    if (poll(fds, 2, -1) == IO_ERROR)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      break;
+    }
+    if (fds[1].revents)
+    {
+      break;
+    }
+    if (!(fds[0].revents & POLLIN))
+    {
+      continue;
+    }
+
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == IO_ERROR)
+    {
+      continue;
+    }
+    struct client_conn *conn = malloc(sizeof(struct client_conn));
+    if (conn == NULL)
+    {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->id = next_id++;
+    conn->pstore = pstore;
+
+    pthread_mutex_lock(&server.lock);
+    conn->next = server.clients;
+    server.clients = conn;
+    server.active++;
+    pthread_mutex_unlock(&server.lock);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_client, conn) != 0)
+    {
+      forget_client(conn);
+      close(fd);
+      free(conn);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  /* Stop reading from every client; their sessions then finish queued work. */
+  close(listen_fd);
+  unlink(socket_path);
+  pthread_mutex_lock(&server.lock);
+  for (struct client_conn *conn = server.clients; conn != NULL; conn = conn->next)
+  {
+    shutdown(conn->fd, SHUT_RD);
+  }
+  while (server.active > 0)
+  {
+    pthread_cond_wait(&server.drained, &server.lock);
+  }
+  pthread_mutex_unlock(&server.lock);
+
+  close(stop_pipe[0]);
+  close(stop_pipe[1]);
+  printf("server on %s stopped\n", socket_path);
+  return true;
+}
@@ -0,0 +1,11 @@
+#ifndef PICSERVER_H
+#define PICSERVER_H
+
+#include "PicStore.h"
+
+  // serve the interpreter's command language on a Unix domain socket; every
+  // connection runs in its own namespace of the shared store. Returns once the
+  // server receives SIGINT or SIGTERM and all connected clients have finished.
+  bool run_server(struct pic_store *pstore, const char *socket_path);
+
+#endif
@@ -1,21 +1,1215 @@
 #include "PicStore.h"
+#include "SharedPic.h"
+#include <string.h>
+#include <unistd.h>
 
-void init_picstore(struct pic_store *pstore){
- //TODO: implement this function for the Optional Extension
-}    
+#define MAX_REPLY_LENGTH 1024
+// file reads and writes the store keeps in flight at once
+#define FILE_QUEUE_DEPTH 64
 
-void print_picstore(struct pic_store *pstore){
- //TODO: implement this function for the Optional Extension   
+static void run_entry_jobs(void *entry_arg);
+
+// ---------- session bookkeeping ---------- \\
+
+static void job_queued(struct pic_session *session){
+  pthread_mutex_lock(&session->lock);
+  session->pending++;
+  pthread_mutex_unlock(&session->lock);
+}
+
+static void job_finished(struct pic_session *session){
+  pthread_mutex_lock(&session->lock);
+  if(--session->pending == 0){
+    pthread_cond_broadcast(&session->idle);
+  }
+  pthread_mutex_unlock(&session->lock);
+}
+
+// ---------- entry lookup (caller holds the store lock) ---------- \\
+
+static struct pic_entry *find_entry(struct pic_session *session, const char *filename){
+  for(struct pic_entry *entry = session->store->entries; entry != NULL; entry = entry->next){
+    if(entry->session == session && !strcmp(entry->name, filename)){
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void detach_entry(struct pic_store *pstore, struct pic_entry *target){
+  struct pic_entry **link = &pstore->entries;
+  while(*link != NULL && *link != target){
+    link = &(*link)->next;
+  }
+  if(*link != NULL){
+    *link = target->next;
+  }
+  target->next = NULL;
+}
+
+// ---------- shared work (caller holds the store lock) ---------- \\
+
+static struct pic_chain *start_chain(const struct pic_job *load, const struct stat *source_stat){
+  struct pic_chain *chain = calloc(1, sizeof(struct pic_chain));
+  if(chain == NULL || (chain->path = strdup(load->arg)) == NULL){
+    free(chain);
+    return NULL;
+  }
+  chain->stat = *source_stat;
+  chain->scale = load->scale;
+  chain->region = load->region;
+  chain->defer_orientation = load->defer_orientation;
+  chain->open = true;
+  return chain;
+}
+
+static void free_chain(struct pic_chain *chain){
+  if(chain == NULL){
+    return;
+  }
+  struct pic_step *step = chain->steps;
+  while(step != NULL){
+    struct pic_step *next = step->next;
+    free(step->arg);
+    free(step);
+    step = next;
+  }
+  free(chain->path);
+  free(chain);
+}
+
+static void extend_chain(struct pic_chain *chain, const struct pic_job *job){
+  if(!chain->open){
+    return;
+  }
+  struct pic_step *step = calloc(1, sizeof(struct pic_step));
+  if(step == NULL || (job->arg != NULL && (step->arg = strdup(job->arg)) == NULL)){
+    free(step);
+    chain->open = false;
+    return;
+  }
+  step->transform = job->transform;
+  if(chain->last_step == NULL){
+    chain->steps = step;
+  } else {
+    chain->last_step->next = step;
+  }
+  chain->last_step = step;
+}
+
+// true if a transformation is the step a chain takes after its first depth
+// steps (the load being the first)
+static bool is_next_step(const struct pic_chain *chain, int depth, const struct pic_job *job){
+  struct pic_step *step = chain->steps;
+  for(int i = 1; i < depth && step != NULL; i++){
+    step = step->next;
+  }
+  if(step == NULL || step->transform != job->transform){
+    return false;
+  }
+  return step->arg == NULL ? job->arg == NULL : job->arg != NULL && !strcmp(step->arg, job->arg);
+}
+
+static bool same_source(const struct pic_chain *chain, const struct pic_job *load, const struct stat *source_stat){
+  return !strcmp(chain->path, load->arg) && chain->scale == load->scale
+         && chain->region.x == load->region.x && chain->region.y == load->region.y
+         && chain->region.width == load->region.width && chain->region.height == load->region.height
+         && chain->defer_orientation == load->defer_orientation
+         && chain->stat.st_dev == source_stat->st_dev && chain->stat.st_ino == source_stat->st_ino
+         && chain->stat.st_size == source_stat->st_size
+         && chain->stat.st_mtim.tv_sec == source_stat->st_mtim.tv_sec
+         && chain->stat.st_mtim.tv_nsec == source_stat->st_mtim.tv_nsec;
+}
+
+// a picture of the session loading the same file in the same way, which has
+// not yet been taken past its load
+static struct pic_entry *find_leader(struct pic_session *session, const char *filename, const struct pic_job *load,
+                                     const struct stat *source_stat){
+  for(struct pic_entry *entry = session->store->entries; entry != NULL; entry = entry->next){
+    if(entry->session == session && entry->chain != NULL && entry->started <= 1 && !entry->retiring
+       && strcmp(entry->name, filename) && same_source(entry->chain, load, source_stat)){
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void follow_entry(struct pic_entry *entry, struct pic_entry *leader){
+  entry->leader = leader;
+  entry->depth = 1;
+  entry->next_follower = leader->followers;
+  leader->followers = entry;
+}
+
+static void stop_following(struct pic_entry *entry){
+  struct pic_entry **link = &entry->leader->followers;
+  while(*link != entry){
+    link = &(*link)->next_follower;
+  }
+  *link = entry->next_follower;
+  entry->next_follower = NULL;
+  entry->leader = NULL;
+}
+
+// ---------- file ordering (caller holds the store lock) ---------- \\
+
+// the session's record of saves to a file (made if asked to, and missing)
+static struct pic_path *find_path(struct pic_session *session, const char *path, bool create){
+  for(struct pic_path *order = session->paths; order != NULL; order = order->next){
+    if(!strcmp(order->path, path)){
+      return order;
+    }
+  }
+  if(!create){
+    return NULL;
+  }
+  struct pic_path *order = calloc(1, sizeof(struct pic_path));
+  if(order == NULL || (order->path = strdup(path)) == NULL){
+    free(order);
+    return NULL;
+  }
+  order->next = session->paths;
+  session->paths = order;
+  return order;
+}
+
+// true if a job has to wait for saves to its file first, in which case its
+// entry is woken once another of them has been written
+static bool job_waits(struct pic_entry *entry, struct pic_job *job){
+  struct pic_path *order = job->order;
+  if(order == NULL || order->finished >= job->after){
+    return false;
+  }
+  if(!entry->waiting_on_path){
+    entry->waiting_on_path = true;
+    entry->next_waiter = order->waiters;
+    order->waiters = entry;
+  }
+  return true;
+}
+
+// make sure some worker is draining the entry's queue, unless it is waiting
+// for its picture to be read or supplied, or for saves to a file it uses, or
+// its picture is not needed yet (caller holds the store lock)
+static void schedule_entry(struct pic_entry *entry){
+  struct pic_job *head = entry->jobs_head;
+  if(!entry->scheduled && head != NULL && !head->reading && !head->waiting && !(head->lazy && entry->jobs_tail->lazy)
+     && !job_waits(entry, head)){
+    entry->scheduled = true;
+    submit_owned_task(&entry->session->store->pool, &entry->task, run_entry_jobs, entry);
+  }
+}
+
+static struct pic_job *make_job(int kind, pic_transform transform, const char *arg){
+  struct pic_job *job = malloc(sizeof(struct pic_job));
+  if(job == NULL){
+    return NULL;
+  }
+  job->kind = kind;
+  job->transform = transform;
+  job->arg = arg == NULL ? NULL : strdup(arg);
+  job->profile = DEFAULT_JPEG_PROFILE;
+  job->scale = 1;
+  job->region = (struct image_region){ 0, 0, 0, 0 };
+  job->defer_orientation = false;
+  job->reading = false;
+  job->lazy = false;
+  job->speculative = false;
+  job->data = NULL;
+  job->size = 0;
+  job->waiting = false;
+  job->supplied = false;
+  job->order = NULL;
+  job->after = 0;
+  job->deferred = false;
+  job->keyed = false;
+  job->copy = NULL;
+  return job;
+}
+
+static void enqueue_job(struct pic_entry *entry, struct pic_job *job);
+
+// a follower with jobs of its own needs its picture as the leader has it at
+// the follower's depth: the leader hands it over once it gets that far (or
+// before going further), having been asked to unless it is retiring anyway
+static void freeze_follower(struct pic_entry *entry){
+  entry->frozen = true;
+  if(entry->leader->retiring){
+    return;
+  }
+  struct pic_job *share = make_job(JOB_SHARE, NULL, NULL);
+  if(share != NULL){
+    enqueue_job(entry->leader, share);
+    return;
+  }
+  fprintf(entry->session->out, "[!] out of memory queueing work for %s\n", entry->name);
+  stop_following(entry);
+  entry->jobs_head->waiting = false;
+  entry->jobs_head->supplied = true;
+  entry->ready = false;
+}
+
+// append a job to an entry and make sure some worker is draining its queue
+static void enqueue_job(struct pic_entry *entry, struct pic_job *job){
+  job->next = NULL;
+  // a follower goes on sharing its leader's work while its transformations
+  // are the leader's next steps; anything else but an unload freezes it
+  if(entry->leader != NULL && !entry->frozen){
+    if(job->kind == JOB_TRANSFORM && is_next_step(entry->leader->chain, entry->depth, job)){
+      entry->depth++;
+      free(job->arg);
+      free(job);
+      return;
+    }
+    if(job->kind == JOB_UNLOAD){
+      stop_following(entry);
+      entry->jobs_head->waiting = false;
+    } else {
+      freeze_follower(entry);
+    }
+  }
+  if(job->kind == JOB_UNLOAD || job->kind == JOB_DETACH){
+    entry->retiring = true;
+  }
+  if(job->kind == JOB_TRANSFORM && entry->chain != NULL){
+    extend_chain(entry->chain, job);
+  }
+  // a save takes its turn writing its file (unordered if it cannot)
+  if(job->kind == JOB_SAVE && (job->order = find_path(entry->session, job->arg, true)) != NULL){
+    job->after = job->order->issued++;
+  }
+
+  // a held back load only becomes work the session waits for once a job
+  // needs the picture's pixels (an unload just drops it, undecoded, unless
+  // followers are still waiting for the picture); with a result cache, the
+  // transformations of a keyed picture are held back behind it too, as its
+  // saves may all turn out to be copied from the cache
+  struct pic_job *head = entry->jobs_head;
+  if(head != NULL && head->lazy){
+    if(job->kind == JOB_TRANSFORM && entry->keyed){
+      job->lazy = true;
+    } else if(job->kind != JOB_UNLOAD || entry->followers != NULL){
+      for(struct pic_job *held = head; held != NULL && held->lazy; held = held->next){
+        held->lazy = false;
+        job_queued(entry->session);
+      }
+    }
+  }
+  if(!job->lazy){
+    job_queued(entry->session);
+  }
+
+  if(entry->jobs_tail == NULL){
+    entry->jobs_head = job;
+  } else {
+    entry->jobs_tail->next = job;
+  }
+  entry->jobs_tail = job;
+
+  schedule_entry(entry);
+}
+
+// ---------- file queue completions ---------- \\
+
+// a load's file has been read (or could not be, in which case the load falls
+// back to reading it itself): the load is always the first job of its entry,
+// and stays at the head of its queue until now
+static void picture_read(void *entry_arg, unsigned char *data, size_t size, bool ok){
+  struct pic_entry *entry = (struct pic_entry *)entry_arg;
+  struct pic_store *pstore = entry->session->store;
+  if(!ok){
+    free(data);
+    data = NULL;
+    size = 0;
+  }
+  pthread_mutex_lock(&pstore->lock);
+  struct pic_job *job = entry->jobs_head;
+  job->data = data;
+  job->size = size;
+  job->reading = false;
+  schedule_entry(entry);
+  pthread_mutex_unlock(&pstore->lock);
+}
+
+// a save has been written out (or given up on): the next save to its file,
+// and loads waiting for it, may go ahead
+static void save_finished(struct pic_session *session, struct pic_path *order){
+  if(order == NULL){
+    return;
+  }
+  struct pic_store *pstore = session->store;
+  pthread_mutex_lock(&pstore->lock);
+  order->finished++;
+  struct pic_entry *waiter = order->waiters;
+  order->waiters = NULL;
+  while(waiter != NULL){
+    struct pic_entry *next = waiter->next_waiter;
+    waiter->waiting_on_path = false;
+    waiter->next_waiter = NULL;
+    schedule_entry(waiter);
+    waiter = next;
+  }
+  pthread_mutex_unlock(&pstore->lock);
+}
+
+// an encoded picture queued for writing out
+struct pending_save {
+  struct pic_session *session;
+  char *path;
+  struct pic_path *order;
+};
+
+static void picture_written(void *save_arg, unsigned char *unused, size_t size, bool ok){
+  (void)unused;
+  (void)size;
+  struct pending_save *save = (struct pending_save *)save_arg;
+  if(!ok){
+    fprintf(save->session->out, "[!] error saving file to %s\n", save->path);
+  }
+  save_finished(save->session, save->order);
+  job_finished(save->session);
+  free(save->path);
+  free(save);
+}
+
+// ---------- job execution (runs on the worker pool) ---------- \\
+
+// hand a picture back to the session's client as a shared memory segment;
+// only pictures that do not already live in shared memory need copying
+static void send_picture(struct pic_entry *entry){
+  struct pic_session *session = entry->session;
+  struct picture *pic = &entry->pic;
+
+  // the client sees the pixels, so they must be the right way round
+  if(!settle_orientation(pic)){
+    fprintf(session->out, "[!] unable to turn %s for the client\n", entry->name);
+    return;
+  }
+  if(pic->memory != PIC_MEM_SHARED){
+    struct picture shared;
+    if(!create_shared_picture(&shared, pic->width, pic->height)){
+      fprintf(session->out, "[!] unable to create a shared segment for %s\n", entry->name);
+      return;
+    }
+    copy_picture_pixels(&shared, pic);
+    clear_picture(pic);
+    overwrite_picture(pic, &shared);
+  }
+
+  char reply[MAX_REPLY_LENGTH];
+  snprintf(reply, sizeof(reply), "detached %s %i %i\n", entry->name, pic->width, pic->height);
+  // keep the reply in order with any text already written to the client
+  flockfile(session->out);
+  fflush(session->out);
+  if(!send_with_fd(session->sock, reply, pic->shm_fd)){
+    fprintf(session->out, "[!] unable to send %s to the client\n", entry->name);
+  }
+  funlockfile(session->out);
+}
+
+// save a picture, encoding it on this worker and leaving the file queue to
+// write it out (pictures saved straight from their source JPEG, and raw ones,
+// which are written a plane at a time, are saved to their file directly)
+static void save_entry_picture(struct pic_entry *entry, struct pic_job *job){
+  struct pic_session *session = entry->session;
+  enum image_format format = image_format_from_path(job->arg);
+  struct result_cache *cache = session->store->cache;
+  if(format == IMAGE_FORMAT_RAW){
+    // (a failure is reported by the library, to the session's stream)
+    save_picture_with_profile(&entry->pic, job->arg, &job->profile);
+    save_finished(session, job->order);
+    return;
+  }
+  if(save_picture_from_source(&entry->pic, job->arg, &job->profile)){
+    if(job->keyed && !entry->stale){
+      store_cached_file(cache, &job->key, job->arg);
+    }
+    save_finished(session, job->order);
+    return;
+  }
+  unsigned char *data;
+  size_t size;
+  struct pending_save *save = malloc(sizeof(struct pending_save));
+  if(save == NULL || (save->path = strdup(job->arg)) == NULL
+     || !save_picture_to_buffer(&entry->pic, format, &job->profile, &data, &size)){
+    fprintf(session->out, "[!] error saving file to %s\n", job->arg);
+    if(save != NULL){
+      free(save->path);
+    }
+    free(save);
+    save_finished(session, job->order);
+    return;
+  }
+  if(job->keyed && !entry->stale){
+    store_cached_result(cache, &job->key, data, size);
+  }
+  // the session waits for the write as it would for any other job
+  save->session = session;
+  save->order = job->order;
+  job_queued(session);
+  if(!queue_file_write(&session->store->files, job->arg, data, size, picture_written, save)){
+    picture_written(save, NULL, 0, false);
+  }
+}
+
+// a load that waited for saves to its file is checked only once they have
+// been written, as any other is when it is issued
+static bool check_deferred_load(struct pic_entry *entry, struct pic_job *job){
+  if(access(job->arg, F_OK) == IO_ERROR){
+    fprintf(entry->session->out, "[!] error reading from file %s (check it exists)\n", job->arg);
+    return false;
+  }
+  int width, height, channels;
+  return job->region.width == 0 || !probe_image(job->arg, &width, &height, &channels)
+         || !region_outside(job->region, width, height);
+}
+
+// move a save's copy of a cached result into place
+static void place_cached_copy(struct pic_entry *entry, struct pic_job *job){
+  if(rename(job->copy, job->arg) == IO_ERROR){
+    fprintf(entry->session->out, "[!] error saving file to %s\n", job->arg);
+    unlink(job->copy);
+  }
+  save_finished(entry->session, job->order);
+}
+
+static void start_source_key(struct cache_key *key, int scale, const struct image_region *region,
+                             bool defer_orientation);
+
+// the result cache key of the bytes a load actually decodes, from its file's
+// contents as read through the file queue or (for loads reading the file
+// themselves) as they are just before the picture is decoded
+static bool read_source_key(struct pic_job *job, struct cache_key *key, struct stat *before){
+  start_source_key(key, job->scale, &job->region, job->defer_orientation);
+  if(job->data != NULL){
+    add_to_cache_key(key, job->data, job->size);
+    return true;
+  }
+  return stat(job->arg, before) == 0 && add_file_to_cache_key(key, job->arg);
+}
+
+// true if a file is as it was (the same file, of the same size and age)
+static bool same_file_state(const char *path, const struct stat *before){
+  struct stat st;
+  return stat(path, &st) == 0 && st.st_dev == before->st_dev && st.st_ino == before->st_ino
+         && st.st_size == before->st_size && st.st_mtim.tv_sec == before->st_mtim.tv_sec
+         && st.st_mtim.tv_nsec == before->st_mtim.tv_nsec;
+}
+
+// runs a single job, returning true if the entry has been retired by it
+static bool execute_job(struct pic_entry *entry, struct pic_job *job){
+  switch(job->kind){
+    case JOB_LOAD:
+      // a follower's picture has already been copied from its leader's
+      if(job->supplied){
+        break;
+      }
+      if(job->deferred && !check_deferred_load(entry, job)){
+        entry->ready = false;
+        break;
+      }
+      // a keyed picture's saves are only stored in the result cache if the
+      // bytes decoded are those its key was made from when the load was issued
+      struct cache_key read_key;
+      struct stat before;
+      bool read_keyed = job->keyed && read_source_key(job, &read_key, &before);
+      bool from_memory = job->data != NULL;
+      // pictures not read through the file queue (reduced, cropped and raw
+      // ones, or any it failed to read) are loaded from their file
+      if(job->data != NULL){
+        entry->ready = init_cached_picture_from_file_data(&entry->pic, entry->session->store->decode_cache, job->arg,
+                                                          job->data, job->size);
+        free(job->data);
+      } else if(job->region.width > 0){
+        entry->ready = init_picture_from_region(&entry->pic, job->arg, job->region);
+      } else {
+        entry->ready = init_cached_picture_from_file(&entry->pic, entry->session->store->decode_cache, job->arg,
+                                                     job->scale);
+      }
+      entry->pic.defer_orientation = job->defer_orientation;
+      if(job->keyed){
+        entry->stale = !read_keyed || memcmp(&read_key, &job->key, sizeof(read_key))
+                       || (!from_memory && !same_file_state(job->arg, &before));
+      }
+      break;
+    case JOB_TRANSFORM:
+      if(entry->ready){
+        job->transform(&entry->pic, job->arg);
+      }
+      break;
+    case JOB_SAVE:
+      if(job->copy != NULL){
+        place_cached_copy(entry, job);
+      } else if(!entry->ready){
+        fprintf(entry->session->out, "[!] %s could not be loaded, nothing saved to %s\n", entry->name, job->arg);
+        save_finished(entry->session, job->order);
+      } else {
+        save_entry_picture(entry, job);
+      }
+      break;
+    case JOB_DETACH:
+      if(entry->ready){
+        send_picture(entry);
+        clear_picture(&entry->pic);
+        entry->ready = false;
+      }
+      return true;
+    case JOB_UNLOAD:
+      if(entry->ready){
+        clear_picture(&entry->pic);
+        entry->ready = false;
+      }
+      return true;
+    case JOB_SHARE:
+      break;
+  }
+  return false;
 }
 
-void load_picture(struct pic_store *pstore, const char *path, const char *filename){
- //TODO: implement this function for the Optional Extension    
+// note the dimensions a picture has been loaded with (caller holds the store
+// lock); rotations still pending swap them, as they would when saved, and so
+// do those queued since the load
+static void record_dimensions(struct pic_entry *entry){
+  struct picture *pic = &entry->pic;
+  bool transposed = pic->pending_orientation.transpose != entry->sideways;
+  entry->width = transposed ? pic->height : pic->width;
+  entry->height = transposed ? pic->width : pic->height;
+  entry->channels = pic->img.c;
+}
+
+// follow the dimensions of a picture through a transformation issued for it
+// (caller holds the store lock): quarter rotations swap them
+static void turn_dimensions(struct pic_entry *entry, const char *step, const char *extra_arg){
+  if(strcmp(step, "rotate") || extra_arg == NULL || !strcmp(extra_arg, "180")){
+    return;
+  }
+  int width = entry->width;
+  entry->width = entry->height;
+  entry->height = width;
+  entry->sideways = !entry->sideways;
+}
+
+// take the followers due a copy of the entry's picture off its list: those at
+// the depth it has reached, before it changes or drops the picture (just the
+// frozen ones when only asked to share it)
+static struct pic_entry *take_followers(struct pic_entry *entry, bool frozen_only){
+  struct pic_entry *served = NULL;
+  struct pic_entry **link = &entry->followers;
+  while(*link != NULL){
+    struct pic_entry *follower = *link;
+    if(follower->depth == entry->started && (follower->frozen || !frozen_only)){
+      *link = follower->next_follower;
+      follower->leader = NULL;
+      follower->next_follower = served;
+      served = follower;
+    } else {
+      link = &follower->next_follower;
+    }
+  }
+  return served;
+}
+
+// hand each follower taken its own copy of the entry's picture (the last one
+// taking the picture itself, copy free, when the entry is being unloaded)
+static void supply_followers(struct pic_entry *entry, struct pic_entry *served, bool unloading){
+  struct pic_store *pstore = entry->session->store;
+  while(served != NULL){
+    struct pic_entry *follower = served;
+    served = follower->next_follower;
+    follower->next_follower = NULL;
+
+    bool ready = false;
+    if(entry->ready && unloading && served == NULL){
+      follower->pic = entry->pic;
+      entry->ready = false;
+      ready = true;
+    } else if(entry->ready){
+      ready = clone_picture(&follower->pic, &entry->pic);
+      if(!ready){
+        fprintf(follower->session->out, "[!] out of memory copying %s to %s\n", entry->name, follower->name);
+      }
+    }
+
+    pthread_mutex_lock(&pstore->lock);
+    follower->ready = ready;
+    follower->stale = entry->stale;
+    follower->jobs_head->waiting = false;
+    follower->jobs_head->supplied = true;
+    schedule_entry(follower);
+    pthread_mutex_unlock(&pstore->lock);
+  }
+}
+
+static void run_entry_jobs(void *entry_arg){
+  struct pic_entry *entry = (struct pic_entry *)entry_arg;
+  struct pic_session *session = entry->session;
+  struct pic_store *pstore = session->store;
+
+  for(;;){
+    pthread_mutex_lock(&pstore->lock);
+    // (those of pictures whose files could not be probed become known once
+    // the load, always the first job, has run)
+    if(entry->ready && entry->width == 0){
+      record_dimensions(entry);
+    }
+    struct pic_job *job = entry->jobs_head;
+    if(job == NULL || job->reading || job_waits(entry, job)){
+      entry->scheduled = false;
+      pthread_mutex_unlock(&pstore->lock);
+      return;
+    }
+    entry->jobs_head = job->next;
+    if(entry->jobs_head == NULL){
+      entry->jobs_tail = NULL;
+    }
+    if(job->speculative){
+      pstore->speculative_loads--;
+    }
+    struct pic_entry *served = NULL;
+    if(!job->lazy && job->kind != JOB_LOAD && job->kind != JOB_SAVE){
+      served = take_followers(entry, job->kind == JOB_SHARE);
+    }
+    if(job->kind == JOB_LOAD || job->kind == JOB_TRANSFORM){
+      entry->started++;
+    }
+    pthread_mutex_unlock(&pstore->lock);
+    supply_followers(entry, served, job->kind == JOB_UNLOAD);
+
+    // jobs still held back are only followed by an unload, so are dropped
+    if(job->lazy){
+      free(job->data);
+      free(job->arg);
+      free(job);
+      continue;
+    }
+    // (the library's reports of failed loads and saves go to the client)
+    set_report_stream(session->out);
+    bool retired = execute_job(entry, job);
+    set_report_stream(NULL);
+    free(job->copy);
+    free(job->arg);
+    free(job);
+
+    // an unload is always the final job of a (detached) entry
+    if(retired){
+      free_chain(entry->chain);
+      free(entry->name);
+      free(entry);
+      job_finished(session);
+      return;
+    }
+    job_finished(session);
+  }
+}
+
+// ---------- store and session lifecycle ---------- \\
+
+bool init_picstore(struct pic_store *pstore, int no_workers){
+  pstore->entries = NULL;
+  pstore->speculative_loads = 0;
+  pthread_mutex_init(&pstore->lock, NULL);
+  if(!init_file_queue(&pstore->files, FILE_QUEUE_DEPTH)){
+    pthread_mutex_destroy(&pstore->lock);
+    return false;
+  }
+  if(!init_thread_pool(&pstore->pool, no_workers)){
+    destroy_file_queue(&pstore->files);
+    pthread_mutex_destroy(&pstore->lock);
+    return false;
+  }
+  pstore->cache = open_env_result_cache(&pstore->results) ? &pstore->results : NULL;
+  pstore->decode_cache = open_env_decode_cache(&pstore->decodes) ? &pstore->decodes : NULL;
+  return true;
+}
+
+void destroy_picstore(struct pic_store *pstore){
+  destroy_thread_pool(&pstore->pool);
+  destroy_file_queue(&pstore->files);
+  if(pstore->cache != NULL){
+    close_result_cache(pstore->cache);
+  }
+  if(pstore->decode_cache != NULL){
+    close_result_cache(pstore->decode_cache);
+  }
+  pthread_mutex_destroy(&pstore->lock);
+}
+
+void open_session(struct pic_store *pstore, struct pic_session *session, FILE *out, int sock){
+  session->store = pstore;
+  session->out = out;
+  // the session's commands run on the calling thread, which reports to it
+  set_report_stream(out);
+  session->sock = sock;
+  session->defer_orientation = false;
+  session->no_passed_fds = 0;
+  session->paths = NULL;
+  session->pending = 0;
+  pthread_mutex_init(&session->lock, NULL);
+  pthread_cond_init(&session->idle, NULL);
+}
+
+void wait_for_session(struct pic_session *session){
+  pthread_mutex_lock(&session->lock);
+  while(session->pending > 0){
+    pthread_cond_wait(&session->idle, &session->lock);
+  }
+  pthread_mutex_unlock(&session->lock);
+}
+
+void close_session(struct pic_session *session){
+  struct pic_store *pstore = session->store;
+
+  // retire every picture still held in the session's namespace
+  pthread_mutex_lock(&pstore->lock);
+  struct pic_entry **link = &pstore->entries;
+  while(*link != NULL){
+    struct pic_entry *entry = *link;
+    if(entry->session != session){
+      link = &entry->next;
+      continue;
+    }
+    *link = entry->next;
+    entry->next = NULL;
+    struct pic_job *job = make_job(JOB_UNLOAD, NULL, NULL);
+    if(job != NULL){
+      enqueue_job(entry, job);
+    }
+  }
+  pthread_mutex_unlock(&pstore->lock);
+
+  wait_for_session(session);
+  fflush(session->out);
+  for(int i = 0; i < session->no_passed_fds; i++){
+    close(session->passed_fds[i]);
+  }
+  while(session->paths != NULL){
+    struct pic_path *order = session->paths;
+    session->paths = order->next;
+    free(order->path);
+    free(order);
+  }
+  pthread_cond_destroy(&session->idle);
+  pthread_mutex_destroy(&session->lock);
+  set_report_stream(NULL);
+}
+
+bool add_passed_fd(struct pic_session *session, int fd){
+  if(session->no_passed_fds == MAX_SESSION_FDS){
+    close(fd);
+    return false;
+  }
+  session->passed_fds[session->no_passed_fds++] = fd;
+  return true;
+}
+
+// append a ready-made picture to the session's namespace, replacing any
+// picture previously stored under the same name (caller holds the store lock)
+static struct pic_entry *insert_entry(struct pic_session *session, struct pic_entry *entry){
+  struct pic_store *pstore = session->store;
+  struct pic_entry *old = find_entry(session, entry->name);
+  if(old != NULL){
+    detach_entry(pstore, old);
+    struct pic_job *unload = make_job(JOB_UNLOAD, NULL, NULL);
+    if(unload != NULL){
+      enqueue_job(old, unload);
+    }
+  }
+  struct pic_entry **link = &pstore->entries;
+  while(*link != NULL){
+    link = &(*link)->next;
+  }
+  *link = entry;
+  return entry;
+}
+
+// ---------- command-line interpreter routines ---------- \\
+
+void print_picstore(struct pic_session *session, bool dimensions){
+  struct pic_store *pstore = session->store;
+  pthread_mutex_lock(&pstore->lock);
+  for(struct pic_entry *entry = pstore->entries; entry != NULL; entry = entry->next){
+    if(entry->session != session){
+      continue;
+    }
+    if(!dimensions){
+      fprintf(session->out, "%s\n", entry->name);
+    } else if(entry->width > 0){
+      fprintf(session->out, "%s %ix%i, %i channels\n", entry->name, entry->width, entry->height, entry->channels);
+    } else {
+      fprintf(session->out, "%s (unknown dimensions)\n", entry->name);
+    }
+  }
+  pthread_mutex_unlock(&pstore->lock);
+  fflush(session->out);
+}
+
+// a load's result cache key, before the bytes of its file are added
+static void start_source_key(struct cache_key *key, int scale, const struct image_region *region,
+                             bool defer_orientation){
+  struct image_region whole = { 0, 0, 0, 0 };
+  if(region == NULL || region->width == 0){
+    region = &whole;
+  }
+  start_cache_key(key, "concurrent_picture_lib");
+  add_to_cache_key(key, &scale, sizeof(scale));
+  add_to_cache_key(key, &region->x, sizeof(region->x));
+  add_to_cache_key(key, &region->y, sizeof(region->y));
+  add_to_cache_key(key, &region->width, sizeof(region->width));
+  add_to_cache_key(key, &region->height, sizeof(region->height));
+  add_to_cache_key(key, &defer_orientation, sizeof(defer_orientation));
+}
+
+bool source_cache_key(struct pic_session *session, const char *path, int scale, const struct image_region *region,
+                      struct cache_key *key){
+  if(session->store->cache == NULL || image_format_from_path(path) == IMAGE_FORMAT_RAW){
+    return false;
+  }
+  start_source_key(key, scale, region, session->defer_orientation);
+  return add_file_to_cache_key(key, path);
+}
+
+void step_cache_key(struct cache_key *key, const char *name, const char *extra_arg){
+  add_text_to_cache_key(key, name);
+  add_text_to_cache_key(key, extra_arg);
+}
+
+bool output_cache_key(struct cache_key *key, const char *path, const struct jpeg_profile *profile){
+  enum image_format format = image_format_from_path(path);
+  if(format == IMAGE_FORMAT_RAW){
+    return false;
+  }
+  add_text_to_cache_key(key, "save");
+  add_to_cache_key(key, &format, sizeof(format));
+  add_to_cache_key(key, &profile->quality, sizeof(profile->quality));
+  add_to_cache_key(key, &profile->subsampling, sizeof(profile->subsampling));
+  return true;
+}
+
+void load_picture(struct pic_session *session, const char *path, const char *filename, int scale,
+                  const struct image_region *region, enum load_demand demand, const struct cache_key *source_key){
+  struct pic_store *pstore = session->store;
+
+  // a file the session is still saving to is only read once the saves
+  // issued before the load have been written (see pic_path)
+  pthread_mutex_lock(&pstore->lock);
+  struct pic_path *order = find_path(session, path, false);
+  bool deferred = order != NULL && order->finished < order->issued;
+  unsigned long after = deferred ? order->issued : 0;
+  pthread_mutex_unlock(&pstore->lock);
+
+  // report missing files straight away, so the store never lists them
+  if(!deferred && access(path, F_OK) == IO_ERROR){
+    fprintf(session->out, "[!] error reading from file %s (check it exists)\n", path);
+    return;
+  }
+
+  struct pic_entry *entry = calloc(1, sizeof(struct pic_entry));
+  struct pic_job *job = make_job(JOB_LOAD, NULL, path);
+  if(entry == NULL || job == NULL || (entry->name = strdup(filename)) == NULL){
+    fprintf(session->out, "[!] out of memory loading %s\n", path);
+    if(job != NULL){
+      free(job->arg);
+    }
+    free(entry);
+    free(job);
+    return;
+  }
+  entry->session = session;
+  // (the file's contents are not known yet if it is still being saved to)
+  if(deferred){
+    entry->keyed = false;
+  } else if(source_key != NULL){
+    entry->key = *source_key;
+    entry->keyed = true;
+  } else {
+    entry->keyed = source_cache_key(session, path, scale, region, &entry->key);
+  }
+  job->scale = scale;
+  job->defer_orientation = session->defer_orientation;
+  if(region != NULL){
+    job->region = *region;
+  }
+  if(deferred){
+    job->order = order;
+    job->after = after;
+    job->deferred = true;
+  }
+  // (checked against the bytes the load ends up decoding)
+  job->key = entry->key;
+  job->keyed = entry->keyed;
+
+  // just the header is read for now (when the picture is decoded is left
+  // to its demand, below)
+  if(!deferred && probe_image(path, &entry->width, &entry->height, &entry->channels)){
+    if(job->region.width > 0){
+      // regions that cannot be cut are reported straight away too
+      if(region_outside(job->region, entry->width, entry->height)){
+        free(entry->name);
+        free(entry);
+        free(job->arg);
+        free(job);
+        return;
+      }
+      entry->width = job->region.width;
+      entry->height = job->region.height;
+    } else {
+      entry->width = (entry->width + scale - 1) / scale;
+      entry->height = (entry->height + scale - 1) / scale;
+    }
+  }
+  // whole pictures are read through the file queue, the entry's jobs only
+  // being scheduled for a worker once the read has finished
+  // (and deferred ones read it themselves, once their turn comes)
+  bool queued_read = !deferred && scale == 1 && job->region.width == 0
+                     && image_format_from_path(path) != IMAGE_FORMAT_RAW;
+  // raw pictures are mapped copy-on-write already, so are never shared
+  struct stat source_stat;
+  bool shareable = !deferred && image_format_from_path(path) != IMAGE_FORMAT_RAW && stat(path, &source_stat) == 0;
+
+  // re-loading a name replaces the picture previously stored under it
+  pthread_mutex_lock(&pstore->lock);
+  struct pic_entry *leader = shareable ? find_leader(session, filename, job, &source_stat) : NULL;
+  if(leader != NULL){
+    // another picture is being loaded from the same file: this one follows
+    // it, held back until its own jobs stop matching the leader's
+    queued_read = false;
+    job->waiting = true;
+    job->lazy = true;
+  } else {
+    // a picture known to be needed is decoded as soon as it has been read,
+    // and one known not to be never is; others are decoded speculatively if
+    // there are workers to spare
+    job->speculative = demand == LOAD_DEMAND_UNKNOWN && pstore->speculative_loads < pstore->pool.no_workers
+                       && thread_pool_idle(&pstore->pool);
+    job->lazy = demand != LOAD_DEMAND_SOON && !job->speculative;
+    if(job->speculative){
+      pstore->speculative_loads++;
+    }
+    if(shareable){
+      entry->chain = start_chain(job, &source_stat);
+    }
+  }
+  job->reading = queued_read;
+  enqueue_job(insert_entry(session, entry), job);
+  if(leader != NULL){
+    follow_entry(entry, leader);
+  }
+  pthread_mutex_unlock(&pstore->lock);
+
+  if(queued_read && !queue_file_read(&pstore->files, path, picture_read, entry)){
+    picture_read(entry, NULL, 0, false);
+  }
+}
+
+bool load_would_replace(struct pic_session *session, const char *path, const struct image_region *region){
+  struct pic_store *pstore = session->store;
+  pthread_mutex_lock(&pstore->lock);
+  struct pic_path *order = find_path(session, path, false);
+  bool deferred = order != NULL && order->finished < order->issued;
+  pthread_mutex_unlock(&pstore->lock);
+  // (the checks load_picture makes before storing anything, which deferred
+  // loads leave until the saves before them have been written)
+  if(deferred){
+    return true;
+  }
+  if(access(path, F_OK) == IO_ERROR){
+    return false;
+  }
+  int width, height, channels;
+  return region->width == 0 || !probe_image(path, &width, &height, &channels) || region_fits(*region, width, height);
+}
+
+void attach_picture(struct pic_session *session, const char *filename){
+  struct pic_store *pstore = session->store;
+  if(session->no_passed_fds == 0){
+    fprintf(session->out, "[!] no shared segment was passed to attach as %s\n", filename);
+    return;
+  }
+
+  // segments are attached in the order the client passed them
+  int fd = session->passed_fds[0];
+  session->no_passed_fds--;
+  memmove(session->passed_fds, session->passed_fds + 1, session->no_passed_fds * sizeof(int));
+
+  struct pic_entry *entry = calloc(1, sizeof(struct pic_entry));
+  if(entry == NULL || (entry->name = strdup(filename)) == NULL){
+    fprintf(session->out, "[!] out of memory attaching %s\n", filename);
+    free(entry);
+    close(fd);
+    return;
+  }
+  if(!map_shared_picture(&entry->pic, fd)){
+    fprintf(session->out, "[!] invalid shared segment passed for %s\n", filename);
+    free(entry->name);
+    free(entry);
+    return;
+  }
+  entry->session = session;
+  entry->ready = true;
+  record_dimensions(entry);
+
+  pthread_mutex_lock(&pstore->lock);
+  insert_entry(session, entry);
+  pthread_mutex_unlock(&pstore->lock);
+}
+
+void detach_picture(struct pic_session *session, const char *filename){
+  struct pic_store *pstore = session->store;
+  if(session->sock == IO_ERROR){
+    fprintf(session->out, "[!] detach is only available to socket clients\n");
+    return;
+  }
+  pthread_mutex_lock(&pstore->lock);
+  struct pic_entry *entry = find_entry(session, filename);
+  if(entry == NULL){
+    pthread_mutex_unlock(&pstore->lock);
+    fprintf(session->out, "[!] no picture named %s in the store\n", filename);
+    return;
+  }
+  // the picture leaves the store once all work queued on it has finished
+  detach_entry(pstore, entry);
+  struct pic_job *job = make_job(JOB_DETACH, NULL, NULL);
+  if(job != NULL){
+    enqueue_job(entry, job);
+  }
+  pthread_mutex_unlock(&pstore->lock);
+}
+
+void unload_picture(struct pic_session *session, const char *filename){
+  struct pic_store *pstore = session->store;
+  pthread_mutex_lock(&pstore->lock);
+  struct pic_entry *entry = find_entry(session, filename);
+  if(entry == NULL){
+    pthread_mutex_unlock(&pstore->lock);
+    fprintf(session->out, "[!] no picture named %s in the store\n", filename);
+    return;
+  }
+  detach_entry(pstore, entry);
+  struct pic_job *job = make_job(JOB_UNLOAD, NULL, NULL);
+  if(job != NULL){
+    enqueue_job(entry, job);
+  }
+  pthread_mutex_unlock(&pstore->lock);
+}
+
+// queue a job on the named picture, reporting unknown names (a named step
+// carries the picture's cache key along with it)
+static void submit_job(struct pic_session *session, const char *filename, struct pic_job *job, const char *step){
+  struct pic_store *pstore = session->store;
+  if(job == NULL){
+    fprintf(session->out, "[!] out of memory queueing work for %s\n", filename);
+    return;
+  }
+  pthread_mutex_lock(&pstore->lock);
+  struct pic_entry *entry = find_entry(session, filename);
+  if(entry == NULL){
+    pthread_mutex_unlock(&pstore->lock);
+    fprintf(session->out, "[!] no picture named %s in the store\n", filename);
+    free(job->arg);
+    free(job);
+    return;
+  }
+  if(step != NULL){
+    turn_dimensions(entry, step, job->arg);
+    if(entry->keyed){
+      step_cache_key(&entry->key, step, job->arg);
+    }
+  }
+  enqueue_job(entry, job);
+  pthread_mutex_unlock(&pstore->lock);
+}
+
+// copy the result cached for a save straight away, beside the file it is
+// saved to (so an entry evicted before the save's turn comes is not missed);
+// NULL if there is none
+static char *fetch_cached_copy(struct result_cache *cache, const struct cache_key *key, const char *path){
+  size_t length = strlen(path);
+  char *copy = malloc(length + sizeof(".XXXXXX"));
+  if(copy == NULL){
+    return NULL;
+  }
+  memcpy(copy, path, length);
+  memcpy(copy + length, ".XXXXXX", sizeof(".XXXXXX"));
+  int fd = mkstemp(copy);
+  if(fd == IO_ERROR){
+    free(copy);
+    return NULL;
+  }
+  close(fd);
+  if(!fetch_cached_result(cache, key, copy)){
+    unlink(copy);
+    free(copy);
+    return NULL;
+  }
+  return copy;
+}
+
+// queue a save served from the result cache in its file's order of saves, on
+// an entry of its own (it needs no picture, so waits for none)
+static void queue_cached_save(struct pic_session *session, struct pic_job *job){
+  struct pic_store *pstore = session->store;
+  struct pic_entry *entry = calloc(1, sizeof(struct pic_entry));
+  struct pic_job *unload = make_job(JOB_UNLOAD, NULL, NULL);
+  if(entry == NULL || unload == NULL || (entry->name = strdup(job->arg)) == NULL){
+    fprintf(session->out, "[!] out of memory saving to %s\n", job->arg);
+    unlink(job->copy);
+    free(job->copy);
+    free(job->arg);
+    free(job);
+    free(unload);
+    free(entry);
+    return;
+  }
+  entry->session = session;
+  pthread_mutex_lock(&pstore->lock);
+  enqueue_job(entry, job);
+  enqueue_job(entry, unload);
+  pthread_mutex_unlock(&pstore->lock);
+}
+
+void save_picture(struct pic_session *session, const char *filename, const char *path, const struct jpeg_profile *profile){
+  struct pic_store *pstore = session->store;
+  struct pic_job *job = make_job(JOB_SAVE, NULL, path);
+  if(job != NULL){
+    job->profile = *profile;
+  }
+
+  // a picture made the same way before is copied from the result cache, and
+  // nothing queued on the picture (what its held back jobs would have done
+  // is then never needed, unless another save is)
+  if(job != NULL && pstore->cache != NULL){
+    pthread_mutex_lock(&pstore->lock);
+    struct pic_entry *entry = find_entry(session, filename);
+    if(entry != NULL && entry->keyed){
+      job->key = entry->key;
+      job->keyed = output_cache_key(&job->key, path, profile);
+    }
+    pthread_mutex_unlock(&pstore->lock);
+    if(job->keyed && (job->copy = fetch_cached_copy(pstore->cache, &job->key, path)) != NULL){
+      queue_cached_save(session, job);
+      return;
+    }
+  }
+  submit_job(session, filename, job, NULL);
 }
 
-void unload_picture(struct pic_store *pstore, const char *filename){
- //TODO: implement this function for the Optional Extension   
+void transform_picture(struct pic_session *session, const char *filename, const char *name, pic_transform transform,
+                       const char *extra_arg){
+  submit_job(session, filename, make_job(JOB_TRANSFORM, transform, extra_arg), name);
 }
 
-void save_picture(struct pic_store *pstore, const char *filename, const char *path){
- //TODO: implement this function for the Optional Extension    
+void discard_transform(struct pic_session *session, const char *filename, const char *name, const char *extra_arg){
+  struct pic_store *pstore = session->store;
+  pthread_mutex_lock(&pstore->lock);
+  struct pic_entry *entry = find_entry(session, filename);
+  if(entry != NULL){
+    turn_dimensions(entry, name, extra_arg);
+    if(entry->keyed){
+      step_cache_key(&entry->key, name, extra_arg);
+    }
+  }
+  pthread_mutex_unlock(&pstore->lock);
+  if(entry == NULL){
+    fprintf(session->out, "[!] no picture named %s in the store\n", filename);
+  }
 }
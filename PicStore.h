@@ -3,19 +3,240 @@
 
 #include "Picture.h"
 #include "Utils.h"
+#include "ThreadPool.h"
+#include "FileQueue.h"
+#include "ResultCache.h"
+#include <pthread.h>
+#include <sys/stat.h>
 
+struct pic_session;
+
+// maximum number of received descriptors waiting to be attached
+#define MAX_SESSION_FDS 16
+
+/* What the interpreter can tell of a loaded picture's future from the commands
+   it has read ahead: whether a command will need its pixels, or it will be
+   unloaded or replaced (or the script end) first. */
+enum load_demand { LOAD_DEMAND_UNKNOWN, LOAD_DEMAND_SOON, LOAD_DEMAND_NEVER };
+
+/* A file the session's saves write to. Saves to it are written in the order
+   they were issued, and loads from it read it once every save issued before
+   them has been written, each waiting its turn at the head of its entry's
+   queue. Kept until the session closes. */
+struct pic_path
+{
+  char *path;
+  // saves issued to the file, and how many of them have been written
+  unsigned long issued;
+  unsigned long finished;
+  // entries whose next job is waiting for the file
+  struct pic_entry *waiters;
+  struct pic_path *next;
+};
+
+/* A transformation queued against a stored picture. */
+typedef void (*pic_transform)(struct picture *pic, const char *extra_arg);
+
+/* A unit of work queued against a single stored picture (shares hand copies
+   of it to the entries following it, see pic_entry). */
+struct pic_job
+{
+  enum { JOB_LOAD, JOB_TRANSFORM, JOB_SAVE, JOB_DETACH, JOB_UNLOAD, JOB_SHARE } kind;
+  pic_transform transform;
+  char *arg;
+  struct jpeg_profile profile;
+  int scale;
+  struct image_region region;
+  bool defer_orientation;
+  // a load's file contents, while (and once) read through the file queue
+  bool reading;
+  // a load held back until some later job needs the picture's pixels, or
+  // one started before any did as there were workers to spare
+  bool lazy;
+  bool speculative;
+  unsigned char *data;
+  size_t size;
+  // a load whose picture is computed by the entry's leader instead, until
+  // it has been supplied
+  bool waiting;
+  bool supplied;
+  // the file a load or save waits for, until after of its saves have been
+  // written (a save's own turn being the number issued before it); a load
+  // that waited is only checked then, as it otherwise would be when issued
+  struct pic_path *order;
+  unsigned long after;
+  bool deferred;
+  // a save's result cache key (see pic_entry's key), or the key a load's
+  // file was expected to have when the load was issued
+  struct cache_key key;
+  bool keyed;
+  // a save served from the result cache: the copy made of the cached file
+  // when the save was issued, renamed over the save's file in its turn
+  char *copy;
+  struct pic_job *next;
+};
+
+/* A transformation recorded in a pic_chain. */
+struct pic_step
+{
+  pic_transform transform;
+  char *arg;
+  struct pic_step *next;
+};
+
+/* How a loaded picture comes about: the file it is loaded from (as it was when
+   the load was issued) and how it is decoded, then the transformations queued
+   on it since, in order. Loads matching one in the same session share its
+   work for as long as their own transformations follow the same steps. */
+struct pic_chain
+{
+  char *path;
+  struct stat stat;
+  int scale;
+  struct image_region region;
+  bool defer_orientation;
+  struct pic_step *steps;
+  struct pic_step *last_step;
+  // no more steps are recorded once one could not be
+  bool open;
+};
+
+/* A named picture together with its queue of pending jobs. Jobs on one entry
+   run strictly in submission order; jobs on different entries run in parallel.
+   Identical loads and transformations of several entries are only run on one
+   of them, the others following it (see pic_chain). */
+struct pic_entry
+{
+  char *name;
+  struct pic_session *session;
+  struct picture pic;
+  bool ready;
+  // dimensions as of the commands issued so far: from the file's header,
+  // turned by each quarter rotation as it is queued (0 if unknown until the
+  // picture has been loaded, sideways recording whether the rotations queued
+  // meanwhile turn it)
+  int width;
+  int height;
+  int channels;
+  bool sideways;
+
+  struct pic_job *jobs_head;
+  struct pic_job *jobs_tail;
+  bool scheduled;
+  // the pool task draining the queue while scheduled (owned by the entry, so
+  // scheduling never fails for want of memory)
+  struct pool_task task;
+  // the next job is waiting for a file (on its pic_path's waiters)
+  bool waiting_on_path;
+  struct pic_entry *next_waiter;
+  // an unload or detach has been queued
+  bool retiring;
+
+  // the work a loaded picture results from, while other loads may follow it,
+  // and how many of its steps have been taken from the queue
+  struct pic_chain *chain;
+  int started;
+  // an entry following a leader has no picture of its own yet: it is the
+  // leader's after the first depth steps of its chain, and is copied from it
+  // before the leader goes further (or once this entry has jobs of its own,
+  // which freeze it at that depth)
+  struct pic_entry *leader;
+  int depth;
+  bool frozen;
+  struct pic_entry *followers;
+  struct pic_entry *next_follower;
+
+  // with a result cache, the key of the picture as the commands issued so far
+  // leave it, whether or not their jobs have run (or ever will: they are held
+  // back behind a held back load until a job needs their result); stale once
+  // the bytes its load decoded turn out not to be those the key was made from,
+  // so that none of its saves are stored under it
+  struct cache_key key;
+  bool keyed;
+  bool stale;
+
+  struct pic_entry *next;
+};
+
+/* Picture container shared by every session, together with the warm worker
+   pool that all transformations, loads and saves run on, and the queue their
+   file reads and writes are batched through. */
 struct pic_store {
-  // TODO: implement this struct with a picture container for the Optional Extension
+  struct pic_entry *entries;
+  pthread_mutex_t lock;
+  struct thread_pool pool;
+  struct file_queue files;
+  // loads decoding before any job needs them, no more than there are workers
+  int speculative_loads;
+  // saves made before (by any run) copied instead of redone, if the
+  // environment names a result cache
+  struct result_cache results;
+  struct result_cache *cache;
+  // and pictures decoded before mapped instead of decoded again, if it names
+  // a decode cache
+  struct result_cache decodes;
+  struct result_cache *decode_cache;
 };
 
-// picture library initialisation 
-void init_picstore(struct pic_store *pstore);
+/* A client's view of the store: picture names are resolved among the session's
+   own pictures (entries are kept apart by the session they belong to), and all
+   interpreter output goes to the session's stream. Sessions on a socket can
+   also exchange shared memory segments with the client. */
+struct pic_session {
+  struct pic_store *store;
+  FILE *out;
+
+  int sock;
+  // pictures loaded while set record rotations and flips as EXIF tags
+  bool defer_orientation;
+  int passed_fds[MAX_SESSION_FDS];
+  int no_passed_fds;
+
+  // files saved to (guarded by the store's lock)
+  struct pic_path *paths;
+
+  int pending;
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+};
+
+// picture library initialisation
+bool init_picstore(struct pic_store *pstore, int no_workers);
+void destroy_picstore(struct pic_store *pstore);
+
+// session management (sock is the client's socket, or IO_ERROR when there is none)
+void open_session(struct pic_store *pstore, struct pic_session *session, FILE *out, int sock);
+bool add_passed_fd(struct pic_session *session, int fd);
+void wait_for_session(struct pic_session *session);
+void close_session(struct pic_session *session);
 
 // command-line interpreter routines
-void print_picstore(struct pic_store *pstore);
-void load_picture(struct pic_store *pstore, const char *path, const char *filename);
-void unload_picture(struct pic_store *pstore, const char *filename);
-void save_picture(struct pic_store *pstore, const char *filename, const char *path);
+void print_picstore(struct pic_session *session, bool dimensions);
+// (source_key is the load's result cache key if the caller has worked it out,
+// or NULL to have it worked out here)
+void load_picture(struct pic_session *session, const char *path, const char *filename, int scale,
+                  const struct image_region *region, enum load_demand demand, const struct cache_key *source_key);
+// whether a load issued now would replace the picture stored under its name
+// (a load that fails on a missing file or a region outside the picture
+// leaves it in place), without reporting anything
+bool load_would_replace(struct pic_session *session, const char *path, const struct image_region *region);
+void unload_picture(struct pic_session *session, const char *filename);
+void save_picture(struct pic_session *session, const char *filename, const char *path, const struct jpeg_profile *profile);
+void attach_picture(struct pic_session *session, const char *filename);
+void detach_picture(struct pic_session *session, const char *filename);
+void transform_picture(struct pic_session *session, const char *filename, const char *name, pic_transform transform,
+                       const char *extra_arg);
+// stand in for a transformation whose result will never be seen, reporting
+// an unknown picture exactly as transform_picture would but queueing nothing
+void discard_transform(struct pic_session *session, const char *filename, const char *name, const char *extra_arg);
 
-#endif
+// result cache keys: of a picture loaded from a file (false if there is no
+// cache, or the file cannot be read), then extended by each transformation
+// (named as the interpreter names it), and finally by how it is saved (false
+// for raw files, which are never cached)
+bool source_cache_key(struct pic_session *session, const char *path, int scale, const struct image_region *region,
+                      struct cache_key *key);
+void step_cache_key(struct cache_key *key, const char *name, const char *extra_arg);
+bool output_cache_key(struct cache_key *key, const char *path, const struct jpeg_profile *profile);
 
+#endif
@@ -0,0 +1,321 @@
+#include <string.h>
+#include <unistd.h>
+#include "PicStream.h"
+#include "PicProcess.h"
+#include "JpegDecode.h"
+#include "JpegEncode.h"
+
+#define BLUR_REGION_SIZE 9
+#define BLUR_WINDOW 3
+#define RGB_BYTES 3
+
+/* One transformation in a streaming chain. Blur keeps a ring of the last
+   BLUR_WINDOW input rows; the other ops work on each row in place. */
+struct stream_stage
+{
+  enum stream_op op;
+  int rows_in;
+  float *window[BLUR_WINDOW];
+  float *out;
+};
+
+/* A picture on its way from decoder to encoder. Rows are held in sod's planar
+   layout (all red, then all green, then all blue), so each row can be wrapped
+   as a one-row picture and handled with the usual pixel accessors. */
+struct stream
+{
+  int width;
+  struct stream_stage *stages;
+  int no_stages;
+  struct jpeg_encoder *enc;
+  unsigned char *bytes;
+  bool ok;
+};
+
+bool find_stream_op(const char *name, const char *arg, enum stream_op *op)
+{
+  if (!strcmp(name, "invert"))
+  {
+    *op = STREAM_INVERT;
+  }
+  else if (!strcmp(name, "grayscale"))
+  {
+    *op = STREAM_GRAYSCALE;
+  }
+  else if (!strcmp(name, "blur"))
+  {
+    *op = STREAM_BLUR;
+  }
+  else if (!strcmp(name, "flip") && arg != NULL && !strcmp(arg, "H"))
+  {
+    *op = STREAM_FLIP_H;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+/*
+   Mirrors one row about its vertical centre line.
+   Parameters:
+     - row: The row, as a one-row picture.
+*/
+static void flip_row(struct picture *row)
+{
+  for (int i = 0; i < row->width / 2; i++)
+  {
+    struct pixel left = get_pixel(row, i, 0);
+    struct pixel right = get_pixel(row, row->width - 1 - i, 0);
+    set_pixel(row, i, 0, &right);
+    set_pixel(row, row->width - 1 - i, 0, &left);
+  }
+}
+
+/*
+   Blurs the middle row of a three-row window exactly as blur_picture does
+   for an interior row (the first and last pixels are left unchanged).
+   Parameters:
+     - rows: The rows above, at and below the row being blurred.
+     - out: The one-row picture receiving the result.
+*/
+static void blur_row(struct picture rows[BLUR_WINDOW], struct picture *out)
+{
+  for (int i = 0; i < out->width; i++)
+  {
+    struct pixel rgb = get_pixel(&rows[1], i, 0);
+    if (i != 0 && i != out->width - 1)
+    {
+      int sum_red = 0;
+      int sum_green = 0;
+      int sum_blue = 0;
+      for (int n = -1; n <= 1; n++)
+      {
+        for (int m = 0; m < BLUR_WINDOW; m++)
+        {
+          struct pixel near = get_pixel(&rows[m], i + n, 0);
+          sum_red += near.red;
+          sum_green += near.green;
+          sum_blue += near.blue;
+        }
+      }
+      rgb.red = sum_red / BLUR_REGION_SIZE;
+      rgb.green = sum_green / BLUR_REGION_SIZE;
+      rgb.blue = sum_blue / BLUR_REGION_SIZE;
+    }
+    set_pixel(out, i, 0, &rgb);
+  }
+}
+
+/*
+   Converts a finished row back to bytes (as sod_image_to_blob does) and
+   hands it to the encoder.
+   Parameters:
+     - st: The stream.
+     - row: The row in planar float layout.
+*/
+static void encode_row(struct stream *st, float *row)
+{
+  for (int c = 0; c < RGB_BYTES; c++)
+  {
+    for (int i = 0; i < st->width; i++)
+    {
+      st->bytes[i * RGB_BYTES + c] = (unsigned char)(255 * row[c * st->width + i]);
+    }
+  }
+  st->ok = write_jpeg_row(st->enc, st->bytes) && st->ok;
+}
+
+/*
+   Feeds the next row into a stage of the chain; rows leave the last stage
+   for the encoder. Stages may modify the row they are given.
+   Parameters:
+     - st: The stream.
+     - no: Index of the receiving stage (no_stages for the encoder).
+     - data: The row in planar float layout.
+*/
+static void push_row(struct stream *st, int no, float *data)
+{
+  if (no == st->no_stages)
+  {
+    encode_row(st, data);
+    return;
+  }
+
+  struct stream_stage *stage = &st->stages[no];
+  size_t row_size = (size_t)st->width * RGB_BYTES * sizeof(float);
+  struct picture row;
+  init_picture_from_buffer(&row, data, st->width, 1);
+
+  switch (stage->op)
+  {
+  case STREAM_INVERT:
+    invert_picture(&row);
+    push_row(st, no + 1, data);
+    break;
+  case STREAM_GRAYSCALE:
+    grayscale_picture(&row);
+    push_row(st, no + 1, data);
+    break;
+  case STREAM_FLIP_H:
+    flip_row(&row);
+    push_row(st, no + 1, data);
+    break;
+  case STREAM_BLUR:
+  {
+    int y = stage->rows_in++;
+    memcpy(stage->window[y % BLUR_WINDOW], data, row_size);
+    /* The top row is a boundary row, passed on unchanged. */
+    if (y == 0)
+    {
+      memcpy(stage->out, data, row_size);
+      push_row(st, no + 1, stage->out);
+    }
+    /* Each further row completes the window around the row before it. */
+    if (y >= 2)
+    {
+      struct picture rows[BLUR_WINDOW];
+      struct picture out;
+      for (int m = 0; m < BLUR_WINDOW; m++)
+      {
+        init_picture_from_buffer(&rows[m], stage->window[(y - 2 + m) % BLUR_WINDOW], st->width, 1);
+      }
+      init_picture_from_buffer(&out, stage->out, st->width, 1);
+      blur_row(rows, &out);
+      push_row(st, no + 1, stage->out);
+    }
+    break;
+  }
+  }
+}
+
+/*
+   Signals the end of the picture to a stage and everything after it, so
+   stages holding back rows can release them.
+   Parameters:
+     - st: The stream.
+     - no: Index of the stage to flush.
+*/
+static void finish_stage(struct stream *st, int no)
+{
+  if (no == st->no_stages)
+  {
+    return;
+  }
+  struct stream_stage *stage = &st->stages[no];
+  /* The bottom row is a boundary row, passed on unchanged. */
+  if (stage->op == STREAM_BLUR && stage->rows_in >= 2)
+  {
+    memcpy(stage->out, stage->window[(stage->rows_in - 1) % BLUR_WINDOW], (size_t)st->width * RGB_BYTES * sizeof(float));
+    push_row(st, no + 1, stage->out);
+  }
+  finish_stage(st, no + 1);
+}
+
+/*
+   Allocates the per-stage row buffers (only blur stages need any).
+   Parameters:
+     - st: The stream, with width, stages and no_stages set.
+*/
+static bool init_stages(struct stream *st, const enum stream_op *ops)
+{
+  size_t row_size = (size_t)st->width * RGB_BYTES * sizeof(float);
+  bool ok = true;
+  for (int no = 0; no < st->no_stages; no++)
+  {
+    struct stream_stage *stage = &st->stages[no];
+    stage->op = ops[no];
+    stage->rows_in = 0;
+    stage->out = NULL;
+    for (int m = 0; m < BLUR_WINDOW; m++)
+    {
+      stage->window[m] = NULL;
+    }
+    if (stage->op == STREAM_BLUR)
+    {
+      stage->out = malloc(row_size);
+      ok = ok && stage->out != NULL;
+      for (int m = 0; m < BLUR_WINDOW; m++)
+      {
+        stage->window[m] = malloc(row_size);
+        ok = ok && stage->window[m] != NULL;
+      }
+    }
+  }
+  return ok;
+}
+
+static void clear_stages(struct stream *st)
+{
+  for (int no = 0; no < st->no_stages; no++)
+  {
+    free(st->stages[no].out);
+    for (int m = 0; m < BLUR_WINDOW; m++)
+    {
+      free(st->stages[no].window[m]);
+    }
+  }
+  free(st->stages);
+}
+
+bool stream_picture(const char *src, const char *dst, const enum stream_op *ops, int no_ops,
+                    const struct jpeg_profile *profile)
+{
+  struct jpeg_decoder *dec = open_jpeg_decoder(src);
+  if (dec == NULL)
+  {
+    return false;
+  }
+
+  struct stream st;
+  st.width = jpeg_decoder_width(dec);
+  st.no_stages = no_ops;
+  st.stages = no_ops > 0 ? calloc(no_ops, sizeof(struct stream_stage)) : NULL;
+  st.bytes = malloc((size_t)st.width * RGB_BYTES);
+  float *row = malloc((size_t)st.width * RGB_BYTES * sizeof(float));
+  st.ok = (no_ops == 0 || st.stages != NULL) && st.bytes != NULL && row != NULL && init_stages(&st, ops);
+  st.enc = st.ok ? open_jpeg_encoder(dst, st.width, jpeg_decoder_height(dec), profile) : NULL;
+  st.ok = st.ok && st.enc != NULL;
+
+  /* Decode, convert to sod's float intensities and push through the chain. */
+  for (int y = 0; st.ok && y < jpeg_decoder_height(dec); y++)
+  {
+    if (!read_jpeg_row(dec, st.bytes))
+    {
+      st.ok = false;
+      break;
+    }
+    for (int c = 0; c < RGB_BYTES; c++)
+    {
+      for (int i = 0; i < st.width; i++)
+      {
+        row[c * st.width + i] = (float)st.bytes[i * RGB_BYTES + c] / 255.;
+      }
+    }
+    push_row(&st, 0, row);
+  }
+  if (st.ok)
+  {
+    finish_stage(&st, 0);
+  }
+  if (st.enc != NULL)
+  {
+    st.ok = close_jpeg_encoder(st.enc) && st.ok;
+    /* A partial output is not left behind for the caller's fallback (or a
+       result cache) to mistake for the result. */
+    if (!st.ok)
+    {
+      unlink(dst);
+    }
+  }
+
+  if (st.stages != NULL)
+  {
+    clear_stages(&st);
+  }
+  free(st.bytes);
+  free(row);
+  close_jpeg_decoder(dec);
+  return st.ok;
+}
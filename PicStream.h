@@ -0,0 +1,28 @@
+#ifndef PICSTREAM_H
+#define PICSTREAM_H
+
+#include <stdbool.h>
+#include "JpegEncode.h"
+
+/* Transformations that only ever look at a window of neighbouring rows, and
+   so can be applied to a picture while it streams from decoder to encoder. */
+enum stream_op
+{
+  STREAM_INVERT,
+  STREAM_GRAYSCALE,
+  STREAM_FLIP_H,
+  STREAM_BLUR
+};
+
+// look up a transformation (and its argument, if any) as a streamable op;
+// returns false for transformations that need the whole picture resident
+bool find_stream_op(const char *name, const char *arg, enum stream_op *op);
+
+// decode src a scanline at a time, apply ops in order and encode the result
+// straight to dst as a JPEG, with memory proportional to the picture width.
+// Returns false, having written nothing, if src cannot be streamed (e.g. it
+// is not a colour JPEG); the caller should then load the picture whole.
+bool stream_picture(const char *src, const char *dst, const enum stream_op *ops, int no_ops,
+                    const struct jpeg_profile *profile);
+
+#endif
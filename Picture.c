@@ -1,17 +1,190 @@
+#include <string.h>
 #include "Picture.h"
+#include "SharedPic.h"
+#include "RawPic.h"
+
+  // record that the picture's buffer is owned by sod's allocator
+  static void set_heap_memory(struct picture *pic){
+    pic->memory = PIC_MEM_HEAP;
+    pic->shm_fd = IO_ERROR;
+    pic->shm_base = NULL;
+    pic->shm_size = 0;
+    pic->jpeg_source = NULL;
+    pic->jpeg_orientation = IDENTITY_ORIENTATION;
+    pic->defer_orientation = false;
+    pic->pending_orientation = IDENTITY_ORIENTATION;
+  }
+
+  // remember the JPEG file a picture was decoded from, as it is now
+  static void set_jpeg_source(struct picture *pic, const char *path){
+    if(image_format_from_path(path) == IMAGE_FORMAT_JPEG && stat(path, &pic->jpeg_source_stat) == 0){
+      pic->jpeg_source = strdup(path);
+    }
+  }
+
+  // true if the picture's JPEG source is unchanged since it was loaded (it
+  // may since have been overwritten, even by a save of the picture itself)
+  static bool jpeg_source_intact(struct picture *pic){
+    struct stat st;
+    return stat(pic->jpeg_source, &st) == 0 && st.st_dev == pic->jpeg_source_stat.st_dev
+           && st.st_ino == pic->jpeg_source_stat.st_ino && st.st_size == pic->jpeg_source_stat.st_size
+           && st.st_mtim.tv_sec == pic->jpeg_source_stat.st_mtim.tv_sec
+           && st.st_mtim.tv_nsec == pic->jpeg_source_stat.st_mtim.tv_nsec;
+  }
+
+  // point the picture at the planes of a mapped raw picture file, keeping
+  // the row stride it was saved with
+  static void adopt_mapping(struct picture *pic, struct raw_mapping map){
+    pic->memory = PIC_MEM_MAPPED;
+    pic->shm_base = map.base;
+    pic->shm_size = map.size;
+    pic->img.data = map.data;
+    pic->img.w = map.header.stride;
+    pic->img.h = map.header.height;
+    pic->img.c = map.header.channels;
+    pic->width = map.header.width;
+    pic->height = map.header.height;
+    pic->stride = map.header.stride;
+  }
+
+  static bool map_picture_file(struct picture *pic, const char *path){
+    struct raw_mapping map;
+    if(!map_raw_picture(path, &map)){
+      fprintf(report_stream(), "[!] %s is not a valid raw picture\n", path);
+      return false;
+    }
+    adopt_mapping(pic, map);
+    return true;
+  }
+
+  // the decode cache key of the picture in the file at path, decoded at scale:
+  // the file's path, size and modification time, and a hash of its contents
+  // (data, if they have been read already); false if it cannot be read
+  static bool decoded_picture_key(struct cache_key *key, const char *path, int scale,
+                                  const unsigned char *data, size_t size){
+    struct stat st;
+    if(path == NULL || stat(path, &st) != 0 || !S_ISREG(st.st_mode)){
+      return false;
+    }
+    start_cache_key(key, "decoded picture");
+    add_text_to_cache_key(key, path);
+    add_to_cache_key(key, &st.st_size, sizeof(st.st_size));
+    add_to_cache_key(key, &st.st_mtim.tv_sec, sizeof(st.st_mtim.tv_sec));
+    add_to_cache_key(key, &st.st_mtim.tv_nsec, sizeof(st.st_mtim.tv_nsec));
+    add_to_cache_key(key, &scale, sizeof(scale));
+    if(data != NULL){
+      add_to_cache_key(key, data, size);
+      return true;
+    }
+    return add_file_to_cache_key(key, path);
+  }
+
+  // map the pixels an earlier decode left in the cache (false, with nothing
+  // mapped, if there are none or they cannot be mapped)
+  static bool map_cached_picture(struct picture *pic, struct result_cache *cache, const struct cache_key *key){
+    char *path = find_cached_result(cache, key);
+    struct raw_mapping map;
+    bool mapped = path != NULL && map_raw_picture(path, &map);
+    free(path);
+    if(mapped){
+      adopt_mapping(pic, map);
+    }
+    return mapped;
+  }
+
+  // leave a freshly decoded picture in the cache for later loads of its file
+  static void cache_decoded_picture(struct picture *pic, struct result_cache *cache, const struct cache_key *key){
+    char *path = cached_result_path(cache, key);
+    if(path != NULL && write_raw_picture(path, pic->img.data, pic->width, pic->height, pic->img.c, pic->stride)){
+      note_cached_result(cache, key);
+    }
+    free(path);
+  }
 
   bool init_picture_from_file(struct picture *pic, const char *path){
-    pic->img = load_image(path);
+    return init_scaled_picture_from_file(pic, path, 1);
+  }
+
+  bool init_scaled_picture_from_file(struct picture *pic, const char *path, int scale){
+    return init_cached_picture_from_file(pic, NULL, path, scale);
+  }
+
+  bool init_cached_picture_from_file(struct picture *pic, struct result_cache *cache, const char *path, int scale){
+    set_heap_memory(pic);
+    if(scale == 1 && image_format_from_path(path) == IMAGE_FORMAT_RAW){
+      return map_picture_file(pic, path);
+    }
+    struct cache_key key;
+    bool keyed = cache != NULL && decoded_picture_key(&key, path, scale, NULL, 0);
+    // a reduced picture cannot be saved by reorienting its source
+    if(scale == 1){
+      set_jpeg_source(pic, path);
+    }
+    if(keyed && map_cached_picture(pic, cache, &key)){
+      return true;
+    }
+    pic->img = load_scaled_image(path, scale);
     // check for picture initialisation error
     if( pic->img.data == 0 ){
+      forget_jpeg_source(pic);
       return false;
     }    
     pic->width = get_image_width(pic->img);
     pic->height = get_image_height(pic->img);
+    pic->stride = pic->width;
+    if(keyed){
+      cache_decoded_picture(pic, cache, &key);
+    }
+    return true;
+  }
+
+  bool init_picture_from_region(struct picture *pic, const char *path, struct image_region region){
+    set_heap_memory(pic);
+    pic->img = load_image_region(path, region);
+    if( pic->img.data == 0 ){
+      return false;
+    }
+    pic->width = get_image_width(pic->img);
+    pic->height = get_image_height(pic->img);
+    pic->stride = pic->width;
+    return true;
+  }
+
+  bool load_picture_from_buffer(struct picture *pic, const unsigned char *data, size_t size){
+    return init_picture_from_file_data(pic, NULL, data, size);
+  }
+
+  bool init_picture_from_file_data(struct picture *pic, const char *path, const unsigned char *data, size_t size){
+    return init_cached_picture_from_file_data(pic, NULL, path, data, size);
+  }
+
+  bool init_cached_picture_from_file_data(struct picture *pic, struct result_cache *cache, const char *path,
+                                          const unsigned char *data, size_t size){
+    set_heap_memory(pic);
+    struct cache_key key;
+    bool keyed = cache != NULL && decoded_picture_key(&key, path, 1, data, size);
+    if(path != NULL){
+      set_jpeg_source(pic, path);
+    }
+    if(keyed && map_cached_picture(pic, cache, &key)){
+      return true;
+    }
+    pic->img = load_image_from_memory(data, size);
+    if( pic->img.data == 0 ){
+      forget_jpeg_source(pic);
+      return false;
+    }
+    pic->width = get_image_width(pic->img);
+    pic->height = get_image_height(pic->img);
+    pic->stride = pic->width;
+    if(keyed){
+      cache_decoded_picture(pic, cache, &key);
+    }
     return true;
   }
 
   bool init_picture_from_size(struct picture *pic, int width, int height){
+    set_heap_memory(pic);
     pic->img = create_image(width, height);
     // check for picture initialisation error
     if ( pic->img.data == 0 ){
@@ -19,17 +192,192 @@
     }
     pic->width = width;
     pic->height = height;
+    pic->stride = pic->img.w;
     return true;
   }
+
+  bool init_picture_like(struct picture *tmp, struct picture *pic, int width, int height){
+    if(pic->memory == PIC_MEM_SHARED){
+      return create_shared_picture(tmp, width, height);
+    }
+    return init_picture_from_size(tmp, width, height);
+  }
+
+  void init_picture_from_buffer(struct picture *pic, float *data, int width, int height){
+    set_heap_memory(pic);
+    pic->memory = PIC_MEM_BORROWED;
+    pic->img.data = data;
+    pic->img.w = width;
+    pic->img.h = height;
+    pic->img.c = FULL_COLOUR_CHANNELS;
+    pic->width = width;
+    pic->height = height;
+    pic->stride = width;
+  }
+
+  void copy_picture_pixels(struct picture *dst, struct picture *src){
+    if(dst->stride == src->stride){
+      memcpy(dst->img.data, src->img.data, (size_t)src->stride * src->height * src->img.c * sizeof(float));
+      return;
+    }
+    size_t row_bytes = (size_t)src->width * sizeof(float);
+    for(int c = 0; c < src->img.c; c++){
+      for(int y = 0; y < src->height; y++){
+        memcpy(dst->img.data + ((size_t)c * dst->height + y) * dst->stride,
+               src->img.data + ((size_t)c * src->height + y) * src->stride, row_bytes);
+      }
+    }
+  }
   
+  bool clone_picture(struct picture *dst, struct picture *src){
+    if(!init_picture_from_size(dst, src->width, src->height)){
+      return false;
+    }
+    copy_picture_pixels(dst, src);
+    dst->defer_orientation = src->defer_orientation;
+    dst->pending_orientation = src->pending_orientation;
+    // without a copy of the source's path the clone just saves by encoding
+    if(src->jpeg_source != NULL && (dst->jpeg_source = strdup(src->jpeg_source)) != NULL){
+      dst->jpeg_source_stat = src->jpeg_source_stat;
+      dst->jpeg_orientation = src->jpeg_orientation;
+    }
+    return true;
+  }
+
   void overwrite_picture(struct picture *pic1, struct picture *pic2){
-    pic1->img = pic2->img;
-    pic1->width = pic2->width;
-    pic1->height = pic2->height;
+    // the new pixels are still to be turned as the old ones were
+    bool defer_orientation = pic1->defer_orientation;
+    struct jpeg_orientation pending_orientation = pic1->pending_orientation;
+    *pic1 = *pic2;
+    pic1->defer_orientation = defer_orientation;
+    pic1->pending_orientation = pending_orientation;
+  }
+
+  void overwrite_reoriented_picture(struct picture *pic, struct picture *tmp, struct jpeg_orientation orientation){
+    char *source = pic->jpeg_source;
+    struct stat source_stat = pic->jpeg_source_stat;
+    pic->jpeg_source = NULL;
+    clear_picture(pic);
+    overwrite_picture(pic, tmp);
+    pic->jpeg_source = source;
+    pic->jpeg_source_stat = source_stat;
+    pic->jpeg_orientation = orientation;
+  }
+
+  void forget_jpeg_source(struct picture *pic){
+    free(pic->jpeg_source);
+    pic->jpeg_source = NULL;
+    pic->jpeg_orientation = IDENTITY_ORIENTATION;
+  }
+
+  bool settle_orientation(struct picture *pic){
+    struct jpeg_orientation pending = pic->pending_orientation;
+    if(is_identity_orientation(pending)){
+      return true;
+    }
+    int width = pending.transpose ? pic->height : pic->width;
+    int height = pending.transpose ? pic->width : pic->height;
+    struct picture tmp;
+    if(!init_picture_like(&tmp, pic, width, height)){
+      return false;
+    }
+    // one pass over the turned picture, undoing the flips and then the
+    // transpose to find where each of its pixels is stored
+    for(int c = 0; c < tmp.img.c; c++){
+      const float *plane = pic->img.data + (size_t)(c < pic->img.c ? c : 0) * pic->stride * pic->height;
+      for(int y = 0; y < height; y++){
+        float *row = tmp.img.data + ((size_t)c * height + y) * tmp.stride;
+        int sy = pending.flip_v ? height - 1 - y : y;
+        for(int x = 0; x < width; x++){
+          int sx = pending.flip_h ? width - 1 - x : x;
+          row[x] = pending.transpose ? plane[(size_t)sx * pic->stride + sy] : plane[(size_t)sy * pic->stride + sx];
+        }
+      }
+    }
+    // the JPEG source (if any) can still be turned into the result losslessly
+    struct jpeg_orientation orientation = pic->jpeg_orientation;
+    compose_orientation(&orientation, pending);
+    pic->pending_orientation = IDENTITY_ORIENTATION;
+    overwrite_reoriented_picture(pic, &tmp, orientation);
+    return true;
+  }
+
+  // ready a picture whose rotations and flips are still pending to be saved
+  // in a format: JPEGs keep the pixels as they are and record the
+  // orientation as an EXIF tag in the profile they are saved with, while
+  // other formats, having no such tag, have the pixels turned first
+  static bool orient_for_saving(struct picture *pic, enum image_format format, struct jpeg_profile *profile){
+    if(is_identity_orientation(pic->pending_orientation)){
+      return true;
+    }
+    if(format != IMAGE_FORMAT_JPEG){
+      return settle_orientation(pic);
+    }
+    profile->exif_orientation = exif_orientation_tag(pic->pending_orientation);
+    return true;
   }
 
   bool save_picture_to_file(struct picture *pic, const char *path){
-    return save_image(pic->img, path);   
+    struct jpeg_profile profile = DEFAULT_JPEG_PROFILE;
+    return save_picture_with_profile(pic, path, &profile);
+  }
+
+  bool save_picture_from_source(struct picture *pic, const char *path, const struct jpeg_profile *profile){
+    // the source keeps its own quality and subsampling, so it is only reused
+    // when no particular encoding was asked for
+    if(pic->jpeg_source == NULL || !is_default_jpeg_profile(profile)
+       || image_format_from_path(path) != IMAGE_FORMAT_JPEG || !jpeg_source_intact(pic)){
+      return false;
+    }
+    // pending turns of an otherwise untouched source are added to a copy of
+    // the file as an EXIF tag, while turns made to the pixels are made to the
+    // source's coefficients instead
+    if(!is_identity_orientation(pic->pending_orientation)){
+      return is_identity_orientation(pic->jpeg_orientation)
+             && tag_jpeg_file(pic->jpeg_source, path, pic->pending_orientation);
+    }
+    return !is_identity_orientation(pic->jpeg_orientation)
+           && transform_jpeg_file(pic->jpeg_source, path, pic->jpeg_orientation);
+  }
+
+  bool save_picture_with_profile(struct picture *pic, const char *path, const struct jpeg_profile *profile){
+    if(save_picture_from_source(pic, path, profile)){
+      return true;
+    }
+    struct jpeg_profile oriented = *profile;
+    if(!orient_for_saving(pic, image_format_from_path(path), &oriented)){
+      fprintf(report_stream(), "[!] error saving file to %s\n", path);
+      return false;
+    }
+    return save_image(pic->img, pic->width, path, &oriented);
+  }
+
+  bool save_picture_to_stream(struct picture *pic, FILE *stream, enum image_format format,
+                              const struct jpeg_profile *profile){
+    struct jpeg_profile oriented = *profile;
+    if(!orient_for_saving(pic, format, &oriented)){
+      fprintf(report_stream(), "[!] error writing the picture out\n");
+      return false;
+    }
+    return save_image_to_stream(pic->img, pic->width, stream, format, &oriented);
+  }
+
+  bool save_picture_to_buffer(struct picture *pic, enum image_format format, const struct jpeg_profile *profile,
+                              unsigned char **data, size_t *size){
+    *data = NULL;
+    *size = 0;
+    FILE *stream = open_memstream((char **)data, size);
+    if(stream == NULL){
+      return false;
+    }
+    bool saved = save_picture_to_stream(pic, stream, format, profile);
+    saved = fclose(stream) == 0 && saved;
+    if(!saved){
+      free(*data);
+      *data = NULL;
+      *size = 0;
+    }
+    return saved;
   }
 
   // enum mapping to support get/set pixel functions
@@ -58,5 +406,19 @@
   }
   
   void clear_picture(struct picture *pic){
-    free_image(pic->img); 
+    switch(pic->memory){
+      case PIC_MEM_HEAP:
+        free_image(pic->img);
+        break;
+      case PIC_MEM_SHARED:
+        release_shared_picture(pic);
+        break;
+      case PIC_MEM_MAPPED:
+        unmap_raw_picture(pic->shm_base, pic->shm_size);
+        break;
+      case PIC_MEM_BORROWED:
+        break;
+    }
+    forget_jpeg_source(pic);
+    pic->img.data = 0;
   }  
@@ -2,7 +2,10 @@
 #define PICTURE_H
 
 #include "Utils.h"
+#include "JpegTransform.h"
+#include "ResultCache.h"
 #include <stdbool.h>
+#include <sys/stat.h>
 
   // The pixel struct is used to represent a pixel of an image in RGB format
   struct pixel {
@@ -11,6 +14,14 @@
     int blue;
   };
 
+  // Ownership of the pixel buffer behind a picture's sod image
+  enum pic_memory {
+    PIC_MEM_HEAP,     // allocated by sod, released by clear_picture
+    PIC_MEM_SHARED,   // maps a shared memory segment, unmapped by clear_picture
+    PIC_MEM_MAPPED,   // private mapping of a raw picture file, unmapped by clear_picture
+    PIC_MEM_BORROWED  // owned by the caller, never released by clear_picture
+  };
+
   // The picture struct provides a wrapper for image manipulation 
   // via the SOD library (https://sod.pixlab.io/intro.html)
   struct picture {    
@@ -18,20 +29,114 @@
     sod_img img;
     int width;
     int height;
+    // floats from one row of a plane to the next; rows of created pictures are
+    // padded for alignment, and sod indexes them with img.w = stride
+    int stride;
+    // who releases img.data, and the segment (or file mapping) it lives in
+    enum pic_memory memory;
+    int shm_fd;
+    void *shm_base;
+    size_t shm_size;
+    // the JPEG file the picture was loaded from (and its state then), kept
+    // while the pixels are still that file's turned by jpeg_orientation, so
+    // a save can reorient the file's own coefficients instead; NULL once the
+    // pixels change in any other way
+    char *jpeg_source;
+    struct stat jpeg_source_stat;
+    struct jpeg_orientation jpeg_orientation;
+    // with defer_orientation set, rotations and flips are only recorded, in
+    // pending_orientation, and saved to JPEGs as an EXIF Orientation tag;
+    // the pixels (and width and height) stay unturned until settled (every
+    // other transformation works the same on turned and unturned pixels)
+    bool defer_orientation;
+    struct jpeg_orientation pending_orientation;
   };    
       
-  // initialise picture struct with image from a provided file
+  // initialise picture struct with image from a provided file (raw pictures
+  // are mapped rather than read, and copied page by page only as they change)
   bool init_picture_from_file(struct picture *pic, const char *path);
 
-  // initialise picture struct of the specified size 
+  // initialise picture struct with image from a provided file, reduced by
+  // scale (1, 2, 4 or 8; see load_scaled_image)
+  bool init_scaled_picture_from_file(struct picture *pic, const char *path, int scale);
+
+  // as init_scaled_picture_from_file, but with a decode cache (NULL for none):
+  // a picture decoded from the same file before, by any run, is mapped from
+  // the cache instead of being decoded again, and one that had not been is
+  // left in the cache (as a raw picture) once decoded
+  bool init_cached_picture_from_file(struct picture *pic, struct result_cache *cache, const char *path, int scale);
+
+  // initialise picture struct with just a region of the image in a provided
+  // file (see load_image_region)
+  bool init_picture_from_region(struct picture *pic, const char *path, struct image_region region);
+
+  // initialise picture struct with an image already encoded in memory (a
+  // JPEG, PNG, BMP, PNM, ... read from a pipe or socket, say)
+  bool load_picture_from_buffer(struct picture *pic, const unsigned char *data, size_t size);
+
+  // initialise picture struct with the contents of the file at path, already
+  // read into memory (by a file_queue, say); path may be NULL if unknown
+  bool init_picture_from_file_data(struct picture *pic, const char *path, const unsigned char *data, size_t size);
+
+  // as init_picture_from_file_data, with a decode cache (see
+  // init_cached_picture_from_file; a picture with no path is never cached)
+  bool init_cached_picture_from_file_data(struct picture *pic, struct result_cache *cache, const char *path,
+                                          const unsigned char *data, size_t size);
+
+  // initialise picture struct of the specified size (pixels must all be set,
+  // as its buffer may be recycled from an earlier picture)
   bool init_picture_from_size(struct picture *pic, int width, int height); 
+
+  // initialise picture struct of the specified size, backed by the same kind of
+  // memory as pic (so results of shared pictures stay in shared memory)
+  bool init_picture_like(struct picture *tmp, struct picture *pic, int width, int height);
+
+  // initialise picture struct around a caller-owned planar RGB buffer
+  void init_picture_from_buffer(struct picture *pic, float *data, int width, int height);
   
+  // copy the pixels of src into dst, which must have the same dimensions
+  // (their strides may differ)
+  void copy_picture_pixels(struct picture *dst, struct picture *src);
+
+  // initialise picture struct as an independent copy of src: its pixels,
+  // and the JPEG source and pending orientation they follow from
+  bool clone_picture(struct picture *dst, struct picture *src);
+
   // overwrites the stored image in pic1 with the stored image in pic2
   void overwrite_picture(struct picture *pic1, struct picture *pic2);
 
-  // save picture to specified file
+  // replaces the stored image in pic with tmp, pic turned to a further
+  // orientation of its JPEG source (which is kept, unlike overwrite_picture)
+  void overwrite_reoriented_picture(struct picture *pic, struct picture *tmp, struct jpeg_orientation orientation);
+
+  // note that the pixels no longer follow from the picture's JPEG source
+  void forget_jpeg_source(struct picture *pic);
+
+  // turn the pixels to the picture's pending orientation, for anything that
+  // needs them the way round they are to be seen (see defer_orientation)
+  bool settle_orientation(struct picture *pic);
+
+  // save picture to specified file (a JPEG picture that has only been rotated
+  // or flipped since it was loaded is saved losslessly, by transform_jpeg_file)
   bool save_picture_to_file(struct picture *pic, const char *path);
 
+  // save picture to specified file straight from the JPEG it was loaded from,
+  // if it has only been rotated or flipped since and no particular encoding
+  // was asked for (false, without saving, otherwise)
+  bool save_picture_from_source(struct picture *pic, const char *path, const struct jpeg_profile *profile);
+
+  // save picture to specified file, with the given JPEG quality and subsampling
+  bool save_picture_with_profile(struct picture *pic, const char *path, const struct jpeg_profile *profile);
+
+  // write picture to an open stream in the given format (used for pipes,
+  // where the format cannot come from a file extension)
+  bool save_picture_to_stream(struct picture *pic, FILE *stream, enum image_format format,
+                              const struct jpeg_profile *profile);
+
+  // encode picture into a newly allocated buffer (freed by the caller)
+  bool save_picture_to_buffer(struct picture *pic, enum image_format format, const struct jpeg_profile *profile,
+                              unsigned char **data, size_t *size);
+
   // extract a single pixel from the image as a colour struct
   struct pixel get_pixel(struct picture *pic, int x, int y);
 
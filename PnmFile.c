@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "PnmFile.h"
+
+#define RGB_BYTES 3
+#define MAX_SAMPLE 255
+/* Rows are converted and written (or read and converted) this many bytes at a
+   time, keeping the batch cache-resident while amortising the system calls. */
+#define PNM_BATCH_BYTES ((size_t)1024 * 1024)
+#define MAX_HEADER_LENGTH 128
+#define MAX_TOKEN_LENGTH 32
+
+struct pnm_reader
+{
+  FILE *file;
+  int width;
+  int height;
+};
+
+/*
+   Writes out every byte described by an I/O vector, resuming after short
+   writes (which the vector is updated to skip).
+   Parameters:
+     - fd: The file to write to.
+     - iov: The buffers to write, in order.
+     - count: The number of buffers.
+*/
+static bool write_all(int fd, struct iovec *iov, int count)
+{
+  while (count > 0)
+  {
+    ssize_t written = writev(fd, iov, count);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return false;
+    }
+    while (count > 0 && (size_t)written >= iov->iov_len)
+    {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+/*
+   Number of rows converted per batch.
+   Parameters:
+     - row_bytes: The size of one row.
+     - height: The number of rows in the picture.
+*/
+static int batch_rows(size_t row_bytes, int height)
+{
+  size_t rows = PNM_BATCH_BYTES / row_bytes;
+  if (rows < 1)
+  {
+    rows = 1;
+  }
+  return rows < (size_t)height ? (int)rows : height;
+}
+
+/*
+   Formats the header of a picture.
+   Parameters:
+     - header: Where to store the header.
+     - width, height, channels, pam: The picture, as for write_pnm.
+   Returns the length of the header.
+*/
+static int format_header(char header[MAX_HEADER_LENGTH], int width, int height, int channels, bool pam)
+{
+  if (pam)
+  {
+    return snprintf(header, MAX_HEADER_LENGTH, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\nTUPLTYPE %s\nENDHDR\n",
+                    width, height, channels, MAX_SAMPLE, channels == 1 ? "GRAYSCALE" : "RGB");
+  }
+  return snprintf(header, MAX_HEADER_LENGTH, "P%c\n%d %d\n%d\n", channels == 1 ? '5' : '6', width, height,
+                  MAX_SAMPLE);
+}
+
+bool write_pnm(const char *path, int width, int height, int channels, bool pam,
+               pnm_row_source fill_row, void *arg)
+{
+  if (width <= 0 || height <= 0 || (channels != 1 && channels != RGB_BYTES))
+  {
+    return false;
+  }
+
+  char header[MAX_HEADER_LENGTH];
+  int header_length = format_header(header, width, height, channels, pam);
+
+  size_t row_bytes = (size_t)width * channels;
+  int rows = batch_rows(row_bytes, height);
+  unsigned char *batch = malloc(row_bytes * rows);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = batch != NULL && fd != -1;
+
+  /* The header goes out with the first batch, in the same system call. */
+  for (int y = 0; ok && y < height; y += rows)
+  {
+    int no_rows = height - y < rows ? height - y : rows;
+    for (int i = 0; i < no_rows; i++)
+    {
+      fill_row(arg, y + i, batch + (size_t)i * row_bytes);
+    }
+    struct iovec iov[2];
+    int count = 0;
+    if (y == 0)
+    {
+      iov[count].iov_base = header;
+      iov[count++].iov_len = header_length;
+    }
+    iov[count].iov_base = batch;
+    iov[count++].iov_len = row_bytes * no_rows;
+    ok = write_all(fd, iov, count);
+  }
+  if (fd != -1)
+  {
+    ok = close(fd) == 0 && ok;
+  }
+  free(batch);
+  return ok;
+}
+
+bool write_pnm_to_stream(FILE *stream, int width, int height, int channels, bool pam,
+                         pnm_row_source fill_row, void *arg)
+{
+  if (width <= 0 || height <= 0 || (channels != 1 && channels != RGB_BYTES))
+  {
+    return false;
+  }
+
+  char header[MAX_HEADER_LENGTH];
+  int header_length = format_header(header, width, height, channels, pam);
+  size_t row_bytes = (size_t)width * channels;
+  int rows = batch_rows(row_bytes, height);
+  unsigned char *batch = malloc(row_bytes * rows);
+  bool ok = batch != NULL && fwrite(header, 1, header_length, stream) == (size_t)header_length;
+  for (int y = 0; ok && y < height; y += rows)
+  {
+    int no_rows = height - y < rows ? height - y : rows;
+    for (int i = 0; i < no_rows; i++)
+    {
+      fill_row(arg, y + i, batch + (size_t)i * row_bytes);
+    }
+    ok = fwrite(batch, row_bytes, no_rows, stream) == (size_t)no_rows;
+  }
+  free(batch);
+  return fflush(stream) == 0 && ok;
+}
+
+/*
+   Reads the next whitespace-separated header token, skipping comments. The
+   single whitespace character ending the token is consumed, as the format
+   requires before the raster.
+   Parameters:
+     - file: The file positioned within its header.
+     - token: Where to store the token.
+*/
+static bool read_token(FILE *file, char token[MAX_TOKEN_LENGTH])
+{
+  int c = getc(file);
+  while (c == '#' || (c != EOF && strchr(" \t\r\n", c) != NULL))
+  {
+    if (c == '#')
+    {
+      while (c != EOF && c != '\n')
+      {
+        c = getc(file);
+      }
+    }
+    c = getc(file);
+  }
+  int length = 0;
+  while (c != EOF && strchr(" \t\r\n", c) == NULL)
+  {
+    if (length == MAX_TOKEN_LENGTH - 1)
+    {
+      return false;
+    }
+    token[length++] = (char)c;
+    c = getc(file);
+  }
+  token[length] = '\0';
+  return length > 0;
+}
+
+/*
+   Reads a positive integer header token.
+   Parameters:
+     - file: The file positioned within its header.
+     - value: Where to store the value.
+*/
+static bool read_number(FILE *file, int *value)
+{
+  char token[MAX_TOKEN_LENGTH];
+  if (!read_token(file, token))
+  {
+    return false;
+  }
+  char *end;
+  long number = strtol(token, &end, 10);
+  if (*end != '\0' || number <= 0 || number > 0xFFFFFF)
+  {
+    return false;
+  }
+  *value = (int)number;
+  return true;
+}
+
+/*
+   Parses the header of a PAM file, following its magic number.
+   Parameters:
+     - reader: The reader, whose dimensions are filled in.
+     - depth: Where to store the number of channels.
+     - maxval: Where to store the largest sample value.
+*/
+static bool read_pam_header(struct pnm_reader *reader, int *depth, int *maxval)
+{
+  char token[MAX_TOKEN_LENGTH];
+  while (read_token(reader->file, token) && strcmp(token, "ENDHDR"))
+  {
+    bool ok = true;
+    if (!strcmp(token, "WIDTH"))
+    {
+      ok = read_number(reader->file, &reader->width);
+    }
+    else if (!strcmp(token, "HEIGHT"))
+    {
+      ok = read_number(reader->file, &reader->height);
+    }
+    else if (!strcmp(token, "DEPTH"))
+    {
+      ok = read_number(reader->file, depth);
+    }
+    else if (!strcmp(token, "MAXVAL"))
+    {
+      ok = read_number(reader->file, maxval);
+    }
+    else if (!strcmp(token, "TUPLTYPE"))
+    {
+      ok = read_token(reader->file, token);
+    }
+    if (!ok)
+    {
+      return false;
+    }
+  }
+  return !strcmp(token, "ENDHDR");
+}
+
+/*
+   Reads the header of a picture.
+   Parameters:
+     - file: The open file (or NULL, if it could not be opened), which the
+             reader takes over.
+*/
+static struct pnm_reader *open_reader(FILE *file)
+{
+  struct pnm_reader *reader = calloc(1, sizeof(struct pnm_reader));
+  if (reader == NULL)
+  {
+    if (file != NULL)
+    {
+      fclose(file);
+    }
+    return NULL;
+  }
+  reader->file = file;
+  char magic[MAX_TOKEN_LENGTH];
+  int depth = 0, maxval = 0;
+  bool ok = reader->file != NULL && read_token(reader->file, magic);
+  if (ok && !strcmp(magic, "P6"))
+  {
+    depth = RGB_BYTES;
+    ok = read_number(reader->file, &reader->width) && read_number(reader->file, &reader->height)
+         && read_number(reader->file, &maxval);
+  }
+  else if (ok && !strcmp(magic, "P7"))
+  {
+    ok = read_pam_header(reader, &depth, &maxval);
+  }
+  else
+  {
+    ok = false;
+  }
+  if (!ok || depth != RGB_BYTES || maxval != MAX_SAMPLE || reader->width <= 0 || reader->height <= 0)
+  {
+    close_pnm_reader(reader);
+    return NULL;
+  }
+  return reader;
+}
+
+struct pnm_reader *open_pnm_reader(const char *path)
+{
+  return open_reader(fopen(path, "rb"));
+}
+
+struct pnm_reader *open_pnm_reader_from_memory(const unsigned char *data, size_t size)
+{
+  return open_reader(size > 0 ? fmemopen((void *)data, size, "rb") : NULL);
+}
+
+int pnm_reader_width(struct pnm_reader *reader)
+{
+  return reader->width;
+}
+
+int pnm_reader_height(struct pnm_reader *reader)
+{
+  return reader->height;
+}
+
+bool read_pnm_rows(struct pnm_reader *reader, pnm_row_sink store_row, void *arg)
+{
+  size_t row_bytes = (size_t)reader->width * RGB_BYTES;
+  int rows = batch_rows(row_bytes, reader->height);
+  unsigned char *batch = malloc(row_bytes * rows);
+  bool ok = batch != NULL;
+
+  for (int y = 0; ok && y < reader->height; y += rows)
+  {
+    int no_rows = reader->height - y < rows ? reader->height - y : rows;
+    ok = fread(batch, row_bytes, no_rows, reader->file) == (size_t)no_rows;
+    for (int i = 0; ok && i < no_rows; i++)
+    {
+      store_row(arg, y + i, batch + (size_t)i * row_bytes);
+    }
+  }
+  free(batch);
+  return ok;
+}
+
+void close_pnm_reader(struct pnm_reader *reader)
+{
+  if (reader->file != NULL)
+  {
+    fclose(reader->file);
+  }
+  free(reader);
+}
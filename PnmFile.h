@@ -0,0 +1,49 @@
+#ifndef PNMFILE_H
+#define PNMFILE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/* Uncompressed Netpbm pictures: binary PPM/PGM (P6/P5) and PAM (P7), with one
+   byte per sample. They cost almost nothing to encode or decode, so they suit
+   intermediate files that are written and read back between steps of a job. */
+
+// produces row y of a picture as width * channels interleaved bytes; may be
+// called for several consecutive rows before any of them is written
+typedef void (*pnm_row_source)(void *arg, int y, unsigned char *row);
+
+// write a width x height picture of 1 (gray) or 3 (RGB) channels to path, as
+// PAM if pam is set and as PGM/PPM otherwise; rows are produced in batches and
+// handed to the kernel with writev, straight from the batch buffer
+bool write_pnm(const char *path, int width, int height, int channels, bool pam,
+               pnm_row_source fill_row, void *arg);
+
+// write a picture as write_pnm does, to an open stream (left open)
+bool write_pnm_to_stream(FILE *stream, int width, int height, int channels, bool pam,
+                         pnm_row_source fill_row, void *arg);
+
+// receives row y of a picture as width interleaved RGB byte triples
+typedef void (*pnm_row_sink)(void *arg, int y, const unsigned char *rgb);
+
+// an RGB picture being read from a PPM or PAM file
+struct pnm_reader;
+
+// open the 8 bit RGB PPM or PAM file at path; returns NULL if it is missing
+// or stored in another form (which sod's loader may still understand)
+struct pnm_reader *open_pnm_reader(const char *path);
+
+// open a picture held in memory (size bytes at data, which must outlive the
+// reader) as open_pnm_reader opens files
+struct pnm_reader *open_pnm_reader_from_memory(const unsigned char *data, size_t size);
+
+// dimensions of the picture being read
+int pnm_reader_width(struct pnm_reader *reader);
+int pnm_reader_height(struct pnm_reader *reader);
+
+// read every row of the picture into store_row, in order
+bool read_pnm_rows(struct pnm_reader *reader, pnm_row_sink store_row, void *arg);
+
+// close the file and release the reader
+void close_pnm_reader(struct pnm_reader *reader);
+
+#endif
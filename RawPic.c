@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "RawPic.h"
+
+/* Suffix of the temporary file a raw picture is written to before it is
+   renamed over the destination. */
+#define TEMP_SUFFIX ".XXXXXX"
+
+/*
+   Checks that a header describes a picture this build understands, whose
+   pixels lie entirely inside a file of the given size.
+   Parameters:
+     - header: The header read from the file.
+     - size: The size of the file in bytes.
+*/
+static bool valid_header(const struct raw_pic_header *header, size_t size)
+{
+  if (header->magic != RAW_PIC_MAGIC || header->version != RAW_PIC_VERSION ||
+      header->layout != RAW_PIC_PLANAR_FLOAT || (header->channels != 1 && header->channels != 3) ||
+      header->width == 0 || header->height == 0 || header->stride < header->width ||
+      header->data_offset < sizeof(struct raw_pic_header) || header->data_offset % sizeof(float) != 0)
+  {
+    return false;
+  }
+  /* Never trust the dimensions: the planes must fit inside the file. */
+  uint64_t floats = (uint64_t)header->stride * header->height * header->channels;
+  return floats <= (uint64_t)INT32_MAX && header->data_offset <= size &&
+         floats * sizeof(float) <= size - header->data_offset;
+}
+
+bool map_raw_picture(const char *path, struct raw_mapping *map)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+  {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct raw_pic_header))
+  {
+    close(fd);
+    return false;
+  }
+  /* A private writable mapping: pages are read on demand, and a picture
+     transformed in place copies only the pages it writes. */
+  size_t size = st.st_size;
+  void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+  {
+    return false;
+  }
+
+  memcpy(&map->header, base, sizeof(struct raw_pic_header));
+  if (!valid_header(&map->header, size))
+  {
+    munmap(base, size);
+    return false;
+  }
+  map->base = base;
+  map->size = size;
+  map->data = (float *)((char *)base + map->header.data_offset);
+  return true;
+}
+
+void unmap_raw_picture(void *base, size_t size)
+{
+  munmap(base, size);
+}
+
+/*
+   Writes out every byte described by an I/O vector, resuming after short
+   writes (which the vector is updated to skip).
+   Parameters:
+     - fd: The file to write to.
+     - iov: The buffers to write, in order.
+     - count: The number of buffers.
+*/
+static bool write_all(int fd, struct iovec *iov, int count)
+{
+  while (count > 0)
+  {
+    ssize_t written = writev(fd, iov, count);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return false;
+    }
+    while (count > 0 && (size_t)written >= iov->iov_len)
+    {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+bool write_raw_picture(const char *path, const float *data, int width, int height, int channels, int stride)
+{
+  static char header_page[RAW_PIC_DATA_OFFSET];
+  struct raw_pic_header header;
+  memset(&header, 0, sizeof(header));
+  header.magic = RAW_PIC_MAGIC;
+  header.version = RAW_PIC_VERSION;
+  header.width = width;
+  header.height = height;
+  header.channels = channels;
+  header.stride = stride;
+  header.layout = RAW_PIC_PLANAR_FLOAT;
+  header.data_offset = RAW_PIC_DATA_OFFSET;
+
+  size_t length = strlen(path);
+  char *temp_path = malloc(length + sizeof(TEMP_SUFFIX));
+  if (temp_path == NULL)
+  {
+    return false;
+  }
+  memcpy(temp_path, path, length);
+  memcpy(temp_path + length, TEMP_SUFFIX, sizeof(TEMP_SUFFIX));
+  int fd = mkstemp(temp_path);
+  if (fd == -1)
+  {
+    free(temp_path);
+    return false;
+  }
+
+  /* The header (padded out to a page) and the planes go out in one call,
+     straight from the picture's buffer. */
+  struct iovec iov[3] = {
+    {&header, sizeof(header)},
+    {header_page, RAW_PIC_DATA_OFFSET - sizeof(header)},
+    {(void *)data, (size_t)stride * height * channels * sizeof(float)}
+  };
+  bool ok = fchmod(fd, 0644) == 0 && write_all(fd, iov, 3);
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(temp_path, path) == 0;
+  if (!ok)
+  {
+    unlink(temp_path);
+  }
+  free(temp_path);
+  return ok;
+}
@@ -0,0 +1,57 @@
+#ifndef RAWPIC_H
+#define RAWPIC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+  // identifies a raw picture file ("RPIC")
+  #define RAW_PIC_MAGIC 0x43495052
+  #define RAW_PIC_VERSION 1
+  // planes start on the first page boundary after the header, so they can be
+  // mapped straight into memory
+  #define RAW_PIC_DATA_OFFSET 4096
+
+  // how the pixels of a raw picture are laid out (the only layout so far is
+  // sod's own: one plane of 32 bit floats per channel, rows stride floats apart)
+  enum raw_pic_layout {
+    RAW_PIC_PLANAR_FLOAT = 1
+  };
+
+  // Header at the start of every raw picture file. It is followed, at
+  // data_offset, by channels planes of stride * height floats (0.0 - 1.0),
+  // one straight after another, exactly as they sit in memory.
+  struct raw_pic_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    uint32_t stride;
+    uint32_t layout;
+    uint32_t reserved;
+    uint64_t data_offset;
+  };
+
+  // a raw picture file mapped privately into memory: writes to the pixels
+  // copy the touched pages, leaving the file itself unchanged
+  struct raw_mapping {
+    void *base;
+    size_t size;
+    struct raw_pic_header header;
+    float *data;
+  };
+
+  // map the raw picture file at path; fails (mapping nothing) if it is
+  // missing, truncated or not a raw picture
+  bool map_raw_picture(const char *path, struct raw_mapping *map);
+
+  // release a mapping made by map_raw_picture
+  void unmap_raw_picture(void *base, size_t size);
+
+  // write a picture's planes (channels planes of stride * height floats) to
+  // path, straight from memory; the file is replaced atomically, so a picture
+  // mapped from the old file stays intact
+  bool write_raw_picture(const char *path, const float *data, int width, int height, int channels, int stride);
+
+#endif
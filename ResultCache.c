@@ -0,0 +1,495 @@
+#include "ResultCache.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#define ENTRY_SUFFIX ".res"
+// hex digits of a key, the suffix and the terminator
+#define ENTRY_NAME_LENGTH (32 + sizeof(ENTRY_SUFFIX))
+#define STATS_FILE "stats"
+#define COPY_CHUNK (1 << 16)
+
+/* An entry found while scanning the cache's directory. */
+struct cache_entry
+{
+  char name[ENTRY_NAME_LENGTH];
+  off_t size;
+  struct timespec used;
+};
+
+void start_cache_key(struct cache_key *key, const char *domain)
+{
+  key->h[0] = 0xcbf29ce484222325ULL;
+  key->h[1] = 0x6a09e667f3bcc908ULL;
+  add_text_to_cache_key(key, domain);
+}
+
+void add_to_cache_key(struct cache_key *key, const void *data, size_t size)
+{
+  const unsigned char *bytes = (const unsigned char *)data;
+  uint64_t h0 = key->h[0];
+  uint64_t h1 = key->h[1];
+  for (size_t i = 0; i < size; i++)
+  {
+    // FNV-1a in one lane, a multiply and rotate mix in the other
+    h0 = (h0 ^ bytes[i]) * 0x100000001b3ULL;
+    h1 = (h1 ^ bytes[i]) * 0x9e3779b97f4a7c15ULL;
+    h1 = (h1 << 31) | (h1 >> 33);
+  }
+  key->h[0] = h0;
+  key->h[1] = h1;
+}
+
+void add_text_to_cache_key(struct cache_key *key, const char *text)
+{
+  // the terminator keeps "ab" + "c" apart from "a" + "bc"
+  if (text == NULL)
+  {
+    unsigned char none = 0xff;
+    add_to_cache_key(key, &none, 1);
+    return;
+  }
+  add_to_cache_key(key, text, strlen(text) + 1);
+}
+
+bool add_file_to_cache_key(struct cache_key *key, const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+  {
+    return false;
+  }
+  unsigned char buffer[COPY_CHUNK];
+  ssize_t got;
+  while ((got = read(fd, buffer, sizeof(buffer))) > 0)
+  {
+    add_to_cache_key(key, buffer, got);
+  }
+  close(fd);
+  return got == 0;
+}
+
+/*
+   Writes the path of a key's entry in the cache's directory.
+   Parameters:
+     - cache: The cache holding the entry.
+     - key: The entry's key.
+   Returns a newly allocated path (freed by the caller), or NULL.
+*/
+static char *entry_path(struct result_cache *cache, const struct cache_key *key)
+{
+  size_t length = strlen(cache->dir) + 1 + ENTRY_NAME_LENGTH;
+  char *path = malloc(length);
+  if (path != NULL)
+  {
+    snprintf(path, length, "%s/%016llx%016llx" ENTRY_SUFFIX, cache->dir, (unsigned long long)key->h[0],
+             (unsigned long long)key->h[1]);
+  }
+  return path;
+}
+
+/*
+   Lists the entries in the cache's directory.
+   Parameters:
+     - cache: The cache to scan.
+     - count: Set to the number of entries listed.
+     - bytes: Set to the entries' total size.
+   Returns a newly allocated array of the entries (NULL if there are none, or
+   the directory cannot be read).
+*/
+static struct cache_entry *scan_entries(struct result_cache *cache, size_t *count, size_t *bytes)
+{
+  *count = 0;
+  *bytes = 0;
+  DIR *dir = opendir(cache->dir);
+  if (dir == NULL)
+  {
+    return NULL;
+  }
+  size_t capacity = 0;
+  struct cache_entry *entries = NULL;
+  struct dirent *item;
+  while ((item = readdir(dir)) != NULL)
+  {
+    size_t length = strlen(item->d_name);
+    struct stat st;
+    if (length != ENTRY_NAME_LENGTH - 1 || strcmp(item->d_name + 32, ENTRY_SUFFIX)
+        || fstatat(dirfd(dir), item->d_name, &st, 0) == -1)
+    {
+      continue;
+    }
+    if (*count == capacity)
+    {
+      capacity = capacity == 0 ? 64 : capacity * 2;
+      struct cache_entry *grown = realloc(entries, capacity * sizeof(struct cache_entry));
+      if (grown == NULL)
+      {
+        break;
+      }
+      entries = grown;
+    }
+    strcpy(entries[*count].name, item->d_name);
+    entries[*count].size = st.st_size;
+    entries[*count].used = st.st_mtim;
+    *bytes += st.st_size;
+    (*count)++;
+  }
+  closedir(dir);
+  return entries;
+}
+
+static int by_last_use(const void *a, const void *b)
+{
+  const struct timespec *x = &((const struct cache_entry *)a)->used;
+  const struct timespec *y = &((const struct cache_entry *)b)->used;
+  if (x->tv_sec != y->tv_sec)
+  {
+    return x->tv_sec < y->tv_sec ? -1 : 1;
+  }
+  return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+/*
+   Deletes the least recently used entries until the cache is within its bound
+   (entries are marked used by their modification time, which hits refresh).
+   Parameters:
+     - cache: The cache to trim (its lock held by the caller).
+*/
+static void evict_entries(struct result_cache *cache)
+{
+  size_t count;
+  struct cache_entry *entries = scan_entries(cache, &count, &cache->bytes);
+  qsort(entries, count, sizeof(struct cache_entry), by_last_use);
+  int dir = open(cache->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  for (size_t i = 0; i < count && cache->bytes > cache->limit && dir != -1; i++)
+  {
+    if (unlinkat(dir, entries[i].name, 0) == 0)
+    {
+      cache->bytes -= entries[i].size;
+    }
+  }
+  if (dir != -1)
+  {
+    close(dir);
+  }
+  free(entries);
+}
+
+/*
+   Opens a cache named by environment variables, creating its directory if
+   need be.
+   Parameters:
+     - cache: The cache to open.
+     - dir_var: The variable naming the directory (no cache if unset).
+     - size_var: The variable giving the size bound in MiB.
+     - default_mib: The bound if size_var is unset.
+     - what: What the cache holds, for reporting it unavailable.
+   Returns true if the cache is open.
+*/
+static bool open_env_cache(struct result_cache *cache, const char *dir_var, const char *size_var, long default_mib,
+                           const char *what)
+{
+  const char *dir = getenv(dir_var);
+  if (dir == NULL || dir[0] == '\0')
+  {
+    return false;
+  }
+  const char *size = getenv(size_var);
+  long mib = size == NULL ? default_mib : atol(size);
+  if (mib <= 0 || (mkdir(dir, 0777) == -1 && errno != EEXIST) || (cache->dir = strdup(dir)) == NULL)
+  {
+    printf("[!] %s cache %s is unavailable\n", what, dir);
+    return false;
+  }
+  cache->limit = (size_t)mib << 20;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->counter = 0;
+  pthread_mutex_init(&cache->lock, NULL);
+
+  size_t count;
+  free(scan_entries(cache, &count, &cache->bytes));
+  return true;
+}
+
+bool open_env_result_cache(struct result_cache *cache)
+{
+  return open_env_cache(cache, RESULT_CACHE_DIR_VAR, RESULT_CACHE_SIZE_VAR, DEFAULT_RESULT_CACHE_MIB, "result");
+}
+
+bool open_env_decode_cache(struct result_cache *cache)
+{
+  return open_env_cache(cache, DECODE_CACHE_DIR_VAR, DECODE_CACHE_SIZE_VAR, DEFAULT_DECODE_CACHE_MIB, "decode");
+}
+
+void close_result_cache(struct result_cache *cache)
+{
+  // another process may be updating the totals at the same time
+  size_t length = strlen(cache->dir) + sizeof("/" STATS_FILE);
+  char *path = malloc(length);
+  int fd = -1;
+  if (path != NULL)
+  {
+    snprintf(path, length, "%s/" STATS_FILE, cache->dir);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  }
+  FILE *stats = fd == -1 ? NULL : fdopen(fd, "r+");
+  if (stats != NULL && flock(fd, LOCK_EX) == 0)
+  {
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+    if (fscanf(stats, "%lu hits, %lu misses", &hits, &misses) != 2)
+    {
+      hits = misses = 0;
+    }
+    rewind(stats);
+    fprintf(stats, "%lu hits, %lu misses\n", hits + cache->hits, misses + cache->misses);
+    fflush(stats);
+    ftruncate(fd, ftell(stats));
+    flock(fd, LOCK_UN);
+  }
+  if (stats != NULL)
+  {
+    fclose(stats);
+  }
+  else if (fd != -1)
+  {
+    close(fd);
+  }
+  free(path);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->dir);
+}
+
+bool cache_contains(struct result_cache *cache, const struct cache_key *key)
+{
+  char *path = entry_path(cache, key);
+  bool found = path != NULL && access(path, R_OK) == 0;
+  free(path);
+  return found;
+}
+
+/*
+   Copies one open file to another, cloning its blocks where the file system
+   supports it.
+   Parameters:
+     - from: The file to copy.
+     - to: The file to copy it to, empty.
+   Returns true if the whole file was copied.
+*/
+static bool copy_file(int from, int to)
+{
+#ifdef FICLONE
+  if (ioctl(to, FICLONE, from) == 0)
+  {
+    return true;
+  }
+#endif
+  unsigned char buffer[COPY_CHUNK];
+  ssize_t got;
+  while ((got = read(from, buffer, sizeof(buffer))) > 0)
+  {
+    for (ssize_t written = 0; written < got;)
+    {
+      ssize_t put = write(to, buffer + written, got - written);
+      if (put <= 0)
+      {
+        return false;
+      }
+      written += put;
+    }
+  }
+  return got == 0;
+}
+
+/*
+   Counts a lookup in the cache.
+   Parameters:
+     - cache: The cache looked in.
+     - hit: Whether the entry looked for was there.
+*/
+static void count_lookup(struct result_cache *cache, bool hit)
+{
+  pthread_mutex_lock(&cache->lock);
+  if (hit)
+  {
+    cache->hits++;
+  }
+  else
+  {
+    cache->misses++;
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+bool fetch_cached_result(struct result_cache *cache, const struct cache_key *key, const char *path)
+{
+  char *source = entry_path(cache, key);
+  int from = source == NULL ? -1 : open(source, O_RDONLY | O_CLOEXEC);
+  bool hit = false;
+  if (from != -1)
+  {
+    // a hit refreshes the entry, so it is evicted last
+    futimens(from, NULL);
+    int to = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    hit = to != -1 && copy_file(from, to);
+    if (to != -1)
+    {
+      close(to);
+    }
+    close(from);
+  }
+  free(source);
+  count_lookup(cache, hit);
+  return hit;
+}
+
+char *find_cached_result(struct result_cache *cache, const struct cache_key *key)
+{
+  char *path = entry_path(cache, key);
+  bool hit = path != NULL && utimensat(AT_FDCWD, path, NULL, 0) == 0;
+  count_lookup(cache, hit);
+  if (!hit)
+  {
+    free(path);
+    return NULL;
+  }
+  return path;
+}
+
+char *cached_result_path(struct result_cache *cache, const struct cache_key *key)
+{
+  return entry_path(cache, key);
+}
+
+/*
+   Counts a new entry's size towards the cache's, evicting entries if the
+   cache has outgrown its bound.
+   Parameters:
+     - cache: The cache the entry was added to.
+     - size: The size of the entry.
+*/
+static void account_entry(struct result_cache *cache, size_t size)
+{
+  pthread_mutex_lock(&cache->lock);
+  cache->bytes += size;
+  if (cache->bytes > cache->limit)
+  {
+    evict_entries(cache);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+   Adds a new entry to the cache, written under a temporary name and then
+   renamed, so other processes never see it half written.
+   Parameters:
+     - cache: The cache to add to.
+     - key: The entry's key.
+     - from: A file to copy the entry from, or -1 to write it from data.
+     - data: The entry's contents, when from is -1.
+     - size: The size of the entry.
+*/
+static void add_entry(struct result_cache *cache, const struct cache_key *key, int from,
+                      const unsigned char *data, size_t size)
+{
+  char *path = entry_path(cache, key);
+  if (path == NULL)
+  {
+    return;
+  }
+  pthread_mutex_lock(&cache->lock);
+  unsigned counter = cache->counter++;
+  pthread_mutex_unlock(&cache->lock);
+
+  size_t length = strlen(cache->dir) + 64;
+  char *temporary = malloc(length);
+  int to = -1;
+  if (temporary != NULL)
+  {
+    snprintf(temporary, length, "%s/.tmp.%ld.%u", cache->dir, (long)getpid(), counter);
+    to = open(temporary, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  }
+  bool written = false;
+  if (to != -1)
+  {
+    if (from != -1)
+    {
+      written = copy_file(from, to);
+    }
+    else
+    {
+      written = true;
+      for (size_t done = 0; done < size && written;)
+      {
+        ssize_t put = write(to, data + done, size - done);
+        written = put > 0;
+        done += written ? put : 0;
+      }
+    }
+    close(to);
+    if (!written || rename(temporary, path) == -1)
+    {
+      unlink(temporary);
+      written = false;
+    }
+  }
+  free(temporary);
+  free(path);
+
+  if (written)
+  {
+    account_entry(cache, size);
+  }
+}
+
+void store_cached_result(struct result_cache *cache, const struct cache_key *key, const unsigned char *data,
+                         size_t size)
+{
+  add_entry(cache, key, -1, data, size);
+}
+
+void store_cached_file(struct result_cache *cache, const struct cache_key *key, const char *path)
+{
+  int from = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (from == -1)
+  {
+    return;
+  }
+  if (fstat(from, &st) == 0 && S_ISREG(st.st_mode))
+  {
+    add_entry(cache, key, from, NULL, st.st_size);
+  }
+  close(from);
+}
+
+void note_cached_result(struct result_cache *cache, const struct cache_key *key)
+{
+  char *path = entry_path(cache, key);
+  struct stat st;
+  if (path != NULL && stat(path, &st) == 0)
+  {
+    account_entry(cache, st.st_size);
+  }
+  free(path);
+}
+
+void result_cache_stats(struct result_cache *cache, unsigned long *hits, unsigned long *misses, size_t *bytes)
+{
+  pthread_mutex_lock(&cache->lock);
+  *hits = cache->hits;
+  *misses = cache->misses;
+  *bytes = cache->bytes;
+  pthread_mutex_unlock(&cache->lock);
+}
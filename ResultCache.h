@@ -0,0 +1,87 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// environment variables naming the cache's directory (no cache if unset) and
+// its size bound in MiB
+#define RESULT_CACHE_DIR_VAR "PICTURE_CACHE_DIR"
+#define RESULT_CACHE_SIZE_VAR "PICTURE_CACHE_SIZE"
+#define DEFAULT_RESULT_CACHE_MIB 256
+// and the same for the cache of decoded pictures (see init_cached_picture_from_file)
+#define DECODE_CACHE_DIR_VAR "PICTURE_DECODE_CACHE_DIR"
+#define DECODE_CACHE_SIZE_VAR "PICTURE_DECODE_CACHE_SIZE"
+#define DEFAULT_DECODE_CACHE_MIB 1024
+
+/* A 128 bit hash of everything an output file follows from: the bytes of the
+   input file, how it was decoded, the transformations applied and how the
+   result was encoded. Not cryptographic, just wide enough that distinct
+   inputs do not collide by accident. */
+struct cache_key
+{
+  uint64_t h[2];
+};
+
+/* Files made by earlier runs (output files, or decoded pictures), kept in a
+   directory under the hash of what they were made from. Least recently used
+   entries are evicted once the directory grows past its bound; the hits and
+   misses of every process using the directory are added up in its stats
+   file. */
+struct result_cache
+{
+  char *dir;
+  size_t limit;
+  // bytes in the directory, as of the last scan plus entries stored since
+  size_t bytes;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned counter;
+  pthread_mutex_t lock;
+};
+
+// cache key construction (domain keeps different programs' results apart)
+void start_cache_key(struct cache_key *key, const char *domain);
+void add_to_cache_key(struct cache_key *key, const void *data, size_t size);
+void add_text_to_cache_key(struct cache_key *key, const char *text);
+bool add_file_to_cache_key(struct cache_key *key, const char *path);
+
+/* Opens the cache named by the environment, creating its directory if need be.
+   Returns false (after reporting why, if one was asked for) when there is no
+   cache to use. */
+bool open_env_result_cache(struct result_cache *cache);
+bool open_env_decode_cache(struct result_cache *cache);
+
+/* Adds the cache's hits and misses to its directory's totals and releases it. */
+void close_result_cache(struct result_cache *cache);
+
+/* Returns true if the cache holds a result for key, without using it. */
+bool cache_contains(struct result_cache *cache, const struct cache_key *key);
+
+/* Copies the result cached for key to path (sharing its blocks where the file
+   system can). Returns true on a hit, and counts the hit or miss. */
+bool fetch_cached_result(struct result_cache *cache, const struct cache_key *key, const char *path);
+
+/* Returns the path of the entry cached for key (newly allocated), marked as
+   just used, for the caller to use in place; or NULL on a miss. Counts the
+   hit or miss. */
+char *find_cached_result(struct result_cache *cache, const struct cache_key *key);
+
+/* Returns the path an entry for key is kept at (newly allocated), for callers
+   writing the entry themselves; it must appear there atomically (by a rename),
+   after which note_cached_result adds it to the cache's size. */
+char *cached_result_path(struct result_cache *cache, const struct cache_key *key);
+void note_cached_result(struct result_cache *cache, const struct cache_key *key);
+
+/* Store a result for key, from memory or from the file just written to path,
+   evicting the least recently used entries if the cache outgrows its bound. */
+void store_cached_result(struct result_cache *cache, const struct cache_key *key, const unsigned char *data,
+                         size_t size);
+void store_cached_file(struct result_cache *cache, const struct cache_key *key, const char *path);
+
+/* Reads the cache's counters and size consistently. */
+void result_cache_stats(struct result_cache *cache, unsigned long *hits, unsigned long *misses, size_t *bytes);
+
+#endif
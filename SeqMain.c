@@ -1,9 +1,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
 #include "Utils.h"
 #include "Picture.h"
 #include "PicProcess.h"
+#include "PicStream.h"
+#include "TiledPic.h"
+#include "JpegDecode.h"
+#include "JpegTransform.h"
+#include "ResultCache.h"
+
+  // pictures with more pixels than this are too large for sod's float format
+  #define TILED_PIXEL_THRESHOLD ((int64_t)64 * 1024 * 1024)
 
   // list of all possible picture transformations
   static char *cmd_strings[] = { 
@@ -64,19 +73,203 @@
   // size of look-up table (for safe IO error reporting)
   static int no_of_cmds = sizeof(cmds) / sizeof(cmds[0]);
 
+  // run a transformation tile by tile on a picture loaded into tiles
+  static bool process_tiled(struct tiled_picture *tiled, const char *target_file,
+                            const char *process, const char *extra_arg,
+                            const struct jpeg_profile *profile){
+    bool done;
+    printf("calling %s (tiled)\n", process);
+    if(!strcmp(process, "invert")){
+      done = invert_tiled_picture(tiled);
+    } else if(!strcmp(process, "grayscale")){
+      done = grayscale_tiled_picture(tiled);
+    } else if(!strcmp(process, "rotate")){
+      done = rotate_tiled_picture(tiled, extra_arg == NULL ? 0 : atoi(extra_arg));
+    } else if(!strcmp(process, "flip")){
+      done = flip_tiled_picture(tiled, extra_arg == NULL ? '\0' : extra_arg[0]);
+    } else if(!strcmp(process, "blur") || !strcmp(process, "parallel-blur")){
+      done = blur_tiled_picture(tiled);
+    } else {
+      printf("[!] invalid process requested: %s is not defined\n    aborting...\n", process);
+      done = false;
+    }
+    return done && save_tiled_picture(tiled, target_file, profile);
+  }
+
+
+  // the orientation a rotate or flip process turns a picture to (false if
+  // the process is neither, or its argument is invalid)
+  static bool parse_reorientation(const char *process, const char *extra_arg,
+                                  struct jpeg_orientation *orientation){
+    *orientation = IDENTITY_ORIENTATION;
+    if(extra_arg == NULL){
+      return false;
+    }
+    if(!strcmp(process, "rotate")){
+      int angle = atoi(extra_arg);
+      if(angle != 90 && angle != 180 && angle != 270){
+        return false;
+      }
+      rotate_orientation(orientation, angle);
+    } else if(!strcmp(process, "flip")){
+      if(strcmp(extra_arg, "H") && strcmp(extra_arg, "V")){
+        return false;
+      }
+      flip_orientation(orientation, extra_arg[0]);
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+
+  // read all of a stream (stdin, when the input file is "-") into memory
+  static unsigned char *read_all(FILE *stream, size_t *size){
+    size_t capacity = 1 << 16;
+    unsigned char *data = malloc(capacity);
+    *size = 0;
+    while(data != NULL){
+      *size += fread(data + *size, 1, capacity - *size, stream);
+      if(*size < capacity){
+        break;
+      }
+      capacity *= 2;
+      unsigned char *grown = realloc(data, capacity);
+      if(grown == NULL){
+        free(data);
+      }
+      data = grown;
+    }
+    return data;
+  }
+
+  // load the picture to process from a file, or from stdin for "-"
+  // (through the decode cache, if the environment names one; see ResultCache.h)
+  static bool load_input(struct picture *pic, const char *filename, int scale, struct image_region region){
+    if(strcmp(filename, "-")){
+      if(region.width > 0){
+        return init_picture_from_region(pic, filename, region);
+      }
+      struct result_cache decodes;
+      bool cached = open_env_decode_cache(&decodes);
+      bool loaded = init_cached_picture_from_file(pic, cached ? &decodes : NULL, filename, scale);
+      if(cached){
+        close_result_cache(&decodes);
+      }
+      return loaded;
+    }
+    if(scale != 1 || region.width > 0){
+      printf("[!] --scale and --region need an input file\n");
+      return false;
+    }
+    size_t size;
+    unsigned char *data = read_all(stdin, &size);
+    bool loaded = data != NULL && load_picture_from_buffer(pic, data, size);
+    if(data != NULL && !loaded){
+      printf("[!] could not decode the picture read from stdin\n");
+    }
+    free(data);
+    return loaded;
+  }
+
+
+  // key of the output of a run: the input file's bytes and every option the
+  // output follows from (false if the input cannot be read)
+  static bool result_key(struct cache_key *key, const char *filename, int scale, struct image_region region,
+                         bool exif_orientation, const char *process, const char *extra_arg,
+                         enum image_format format, const struct jpeg_profile *profile){
+    start_cache_key(key, "picture_lib");
+    add_to_cache_key(key, &scale, sizeof(scale));
+    add_to_cache_key(key, &region.x, sizeof(region.x));
+    add_to_cache_key(key, &region.y, sizeof(region.y));
+    add_to_cache_key(key, &region.width, sizeof(region.width));
+    add_to_cache_key(key, &region.height, sizeof(region.height));
+    add_to_cache_key(key, &exif_orientation, sizeof(exif_orientation));
+    add_text_to_cache_key(key, process);
+    add_text_to_cache_key(key, extra_arg);
+    add_to_cache_key(key, &format, sizeof(format));
+    add_to_cache_key(key, &profile->quality, sizeof(profile->quality));
+    add_to_cache_key(key, &profile->subsampling, sizeof(profile->subsampling));
+    return add_file_to_cache_key(key, filename);
+  }
+
+  // true if the environment names a decode cache (see ResultCache.h)
+  static bool decode_cache_named(void){
+    const char *dir = getenv(DECODE_CACHE_DIR_VAR);
+    return dir != NULL && dir[0] != '\0';
+  }
+
+  // report a finished run, first keeping its output for later runs if there
+  // is a result cache (and the output was saved)
+  static int complete(struct result_cache *cache, const struct cache_key *key, const char *target_file, bool saved){
+    if(cache != NULL){
+      if(saved){
+        store_cached_file(cache, key, target_file);
+      }
+      close_result_cache(cache);
+    }
+    printf("-- picture processing complete --\n");
+    return 0;
+  }
+
 
 // ---------- MAIN PROGRAM ---------- \\
 
   int main(int argc, char **argv){
 
-    printf("Running the C Picture Processor... \n");
+    // optional input reduction (or cropping) and output encoding settings
+    // come before the positional arguments (by default the whole picture is
+    // processed at full size and saved at the best quality, as sod does)
+    struct jpeg_profile profile = DEFAULT_JPEG_PROFILE;
+    int scale = 1;
+    struct image_region region = { 0, 0, 0, 0 };
+    bool exif_orientation = false;
+    enum image_format stdout_format = IMAGE_FORMAT_JPEG;
+    int first = 1;
+    while(first + 1 < argc && !strncmp(argv[first], "--", 2)){
+      bool valid;
+      if(!strcmp(argv[first], "--quality")){
+        valid = parse_jpeg_profile(&profile, argv[first + 1], NULL);
+      } else if(!strcmp(argv[first], "--subsampling")){
+        valid = parse_jpeg_profile(&profile, NULL, argv[first + 1]);
+      } else if(!strcmp(argv[first], "--scale")){
+        valid = parse_image_scale(argv[first + 1], &scale) && region.width == 0;
+      } else if(!strcmp(argv[first], "--orientation")){
+        valid = !strcmp(argv[first + 1], "exif") || !strcmp(argv[first + 1], "pixels");
+        exif_orientation = !strcmp(argv[first + 1], "exif");
+      } else if(!strcmp(argv[first], "--region")){
+        valid = parse_image_region(argv[first + 1], &region) && scale == 1;
+      } else if(!strcmp(argv[first], "--format")){
+        valid = parse_image_format(argv[first + 1], &stdout_format) && stdout_format != IMAGE_FORMAT_RAW;
+      } else {
+        valid = false;
+      }
+      if(!valid){
+        printf("[!] invalid option: %s %s\n", argv[first], argv[first + 1]);
+        exit(IO_ERROR);
+      }
+      first += 2;
+    }
 
     // capture and check command line arguments
-    const char * filename = argv[1];
-    const char * target_file = argv[2];
-    const char * process = argv[3];
-    const char * extra_arg = argv[4];
+    const char * filename = first < argc ? argv[first] : NULL;
+    const char * target_file = first + 1 < argc ? argv[first + 1] : NULL;
+    const char * process = first + 2 < argc ? argv[first + 2] : NULL;
+    const char * extra_arg = first + 3 < argc ? argv[first + 3] : NULL;
     
+    // with a target of "-" the picture is written to stdout (as a JPEG, or in
+    // the --format given), and these messages go to stderr instead
+    bool stdout_target = target_file != NULL && !strcmp(target_file, "-");
+    int image_fd = STDOUT_FILENO;
+    if(stdout_target){
+      image_fd = dup(STDOUT_FILENO);
+      if(image_fd == IO_ERROR || dup2(STDERR_FILENO, STDOUT_FILENO) == IO_ERROR){
+        printf("[!] could not write to stdout\n");
+        exit(IO_ERROR);
+      }
+    }
+    printf("Running the C Picture Processor... \n");
+
     if(filename == NULL || target_file == NULL || process == NULL){
       printf("[!] insufficient command line arguments provided\n");
       exit(IO_ERROR);
@@ -88,12 +281,83 @@
     printf("  extra arg = %s\n", extra_arg);
   
     printf("\n");
-  
+
+    enum image_format target_format = stdout_target ? stdout_format : image_format_from_path(target_file);
+
+    // with a result cache (see ResultCache.h), output made by an earlier run
+    // from the same input bytes in the same way is copied instead of redone;
+    // raw targets are left out, as pictures are mapped from them
+    struct result_cache results;
+    struct result_cache *cache = NULL;
+    struct cache_key key;
+    if(strcmp(filename, "-") && !stdout_target && target_format != IMAGE_FORMAT_RAW && open_env_result_cache(&results)){
+      cache = &results;
+      if(!result_key(&key, filename, scale, region, exif_orientation, process, extra_arg, target_format, &profile)){
+        close_result_cache(cache);
+        cache = NULL;
+      }
+    }
+    if(cache != NULL && fetch_cached_result(cache, &key, target_file)){
+      printf("calling %s (cached)\n", process);
+      close_result_cache(cache);
+      printf("-- picture processing complete --\n");
+      return 0;
+    }
+
+    // rotations and flips of a JPEG keep its own encoding (unless another
+    // was asked for) and lose nothing, or with --orientation exif just copy
+    // it with an EXIF tag added; the shortcuts below all work on the whole,
+    // full-size picture, between files
+    bool jpeg_target = target_format == IMAGE_FORMAT_JPEG;
+    bool whole_files = scale == 1 && region.width == 0 && strcmp(filename, "-") && !stdout_target;
+    struct jpeg_orientation orientation;
+    bool reorients = parse_reorientation(process, extra_arg, &orientation);
+    if(whole_files && jpeg_target && is_default_jpeg_profile(&profile) && reorients){
+      if(exif_orientation && tag_jpeg_file(filename, target_file, orientation)){
+        printf("calling %s (EXIF orientation tag)\n", process);
+        return complete(cache, &key, target_file, true);
+      }
+      if(!exif_orientation && transform_jpeg_file(filename, target_file, orientation)){
+        printf("calling %s (lossless)\n", process);
+        return complete(cache, &key, target_file, true);
+      }
+    }
+
+    // the streamed and tiled shortcuts turn the pixels themselves, so with
+    // --orientation exif rotations and flips are left to the picture path
+    bool pixel_shortcuts = whole_files && !(exif_orientation && reorients);
+
+    // row-local transformations stream from decoder to encoder, so the
+    // whole picture is never resident (falls back for non-JPEG input); with
+    // a decode cache the picture is decoded whole instead, to be mapped from
+    // the cache by later runs rather than decoded again
+    enum stream_op op;
+    if(pixel_shortcuts && !decode_cache_named() && jpeg_target && find_stream_op(process, extra_arg, &op)
+       && stream_picture(filename, target_file, &op, 1, &profile)){
+      printf("calling %s (streamed row by row)\n", process);
+      return complete(cache, &key, target_file, true);
+    }
+
+    // other transformations of very large pictures run tile by tile, with
+    // tiles paged between memory and a backing file
+    int width, height;
+    struct tiled_picture tiled;
+    if(pixel_shortcuts && jpeg_target && read_jpeg_dimensions(filename, &width, &height) && (int64_t)width * height > TILED_PIXEL_THRESHOLD
+       && load_tiled_picture(&tiled, filename, DEFAULT_TILE_CACHE_BYTES)){
+      bool done = process_tiled(&tiled, target_file, process, extra_arg, &profile);
+      clear_tiled_picture(&tiled);
+      if(!done){
+        exit(IO_ERROR);
+      }
+      return complete(cache, &key, target_file, true);
+    }
+
     // create original image object
     struct picture pic;
-    if(!init_picture_from_file(&pic, filename)){
+    if(!load_input(&pic, filename, scale, region)){
       exit(IO_ERROR);   
     }    
+    pic.defer_orientation = exif_orientation;
   
     // identify the picture transformation to run
     int cmd_no = 0;
@@ -112,8 +376,19 @@
     cmds[cmd_no](&pic, extra_arg);
 
     // save resulting picture and report success
-    save_picture_to_file(&pic, target_file);
-    printf("-- picture processing complete --\n");
+    if(stdout_target){
+      FILE *out = fdopen(image_fd, "wb");
+      bool saved = out != NULL && save_picture_to_stream(&pic, out, target_format, &profile);
+      if(out == NULL || fclose(out) != 0 || !saved){
+        printf("[!] error writing the picture to stdout\n");
+        clear_picture(&pic);
+        exit(IO_ERROR);
+      }
+      printf("-- picture processing complete --\n");
+    } else {
+      bool saved = save_picture_with_profile(&pic, target_file, &profile);
+      complete(cache, &key, target_file, saved);
+    }
     
     clear_picture(&pic);
     return 0;
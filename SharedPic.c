@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "SharedPic.h"
+
+/* Seals every segment carries, so that whoever maps it can rely on its size:
+   a segment shrunk under a mapping would fault on the next access. */
+#define SHARED_PIC_SEALS (F_SEAL_SHRINK | F_SEAL_GROW)
+
+/* Size in bytes of a segment holding a width x height RGB picture. */
+static size_t shared_segment_size(int width, int height)
+{
+  return SHARED_PIC_DATA_OFFSET + (size_t)width * height * FULL_COLOUR_CHANNELS * sizeof(float);
+}
+
+/*
+   Points pic at the pixels of a mapped segment; the picture takes ownership of
+   both the mapping and the descriptor. The dimensions are taken from a copy
+   of the header made (and checked) before, never from the mapping, which the
+   client can write to at any time.
+*/
+static void wrap_segment(struct picture *pic, const struct shared_pic_header *header, int fd, void *base,
+                         size_t size)
+{
+  pic->memory = PIC_MEM_SHARED;
+  pic->shm_fd = fd;
+  pic->shm_base = base;
+  pic->shm_size = size;
+  pic->width = header->width;
+  pic->height = header->height;
+  pic->stride = header->width;
+  pic->img.w = header->width;
+  pic->img.h = header->height;
+  pic->img.c = header->channels;
+  pic->img.data = (float *)((char *)base + SHARED_PIC_DATA_OFFSET);
+  pic->jpeg_source = NULL;
+  pic->jpeg_orientation = IDENTITY_ORIENTATION;
+  pic->defer_orientation = false;
+  pic->pending_orientation = IDENTITY_ORIENTATION;
+}
+
+bool create_shared_picture(struct picture *pic, int width, int height)
+{
+  size_t size = shared_segment_size(width, height);
+  int fd = memfd_create("picture", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == IO_ERROR)
+  {
+    return false;
+  }
+  if (ftruncate(fd, size) == IO_ERROR || fcntl(fd, F_ADD_SEALS, SHARED_PIC_SEALS) == IO_ERROR)
+  {
+    close(fd);
+    return false;
+  }
+  void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED)
+  {
+    close(fd);
+    return false;
+  }
+
+  struct shared_pic_header header = { SHARED_PIC_MAGIC, width, height, FULL_COLOUR_CHANNELS };
+  memcpy(base, &header, sizeof(header));
+  wrap_segment(pic, &header, fd, base, size);
+  return true;
+}
+
+bool map_shared_picture(struct picture *pic, int fd)
+{
+  /* Only a sealed segment keeps the size it is checked to have here. */
+  int seals = fcntl(fd, F_GET_SEALS);
+  struct stat st;
+  if (seals == IO_ERROR || (seals & SHARED_PIC_SEALS) != SHARED_PIC_SEALS || fstat(fd, &st) == IO_ERROR ||
+      (size_t)st.st_size < SHARED_PIC_DATA_OFFSET)
+  {
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED)
+  {
+    close(fd);
+    return false;
+  }
+
+  /* Never trust the header: it is copied out before it is checked, so the
+     client cannot change it in between, and the pixels must both fit inside
+     the segment and be indexable by sod, which uses int offsets. */
+  struct shared_pic_header header;
+  memcpy(&header, base, sizeof(header));
+  if (header.magic != SHARED_PIC_MAGIC || header.channels != FULL_COLOUR_CHANNELS || header.width == 0 ||
+      header.height == 0 || (uint64_t)header.width * header.height * FULL_COLOUR_CHANNELS > INT32_MAX ||
+      shared_segment_size(header.width, header.height) > size)
+  {
+    munmap(base, size);
+    close(fd);
+    return false;
+  }
+  wrap_segment(pic, &header, fd, base, size);
+  return true;
+}
+
+void release_shared_picture(struct picture *pic)
+{
+  munmap(pic->shm_base, pic->shm_size);
+  close(pic->shm_fd);
+  pic->shm_base = NULL;
+  pic->shm_fd = IO_ERROR;
+}
+
+bool send_with_fd(int sock, const char *line, int fd)
+{
+  struct iovec iov = {(void *)line, strlen(line)};
+  union
+  {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  return sendmsg(sock, &msg, 0) == (ssize_t)iov.iov_len;
+}
+
+ssize_t receive_with_fds(int sock, char *buf, size_t size, int fds[MAX_PASSED_FDS], int *nfds)
+{
+  struct iovec iov = {buf, size};
+  union
+  {
+    char buf[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  *nfds = 0;
+  ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  if (len < 0)
+  {
+    return len;
+  }
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+      continue;
+    }
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (int i = 0; i < count && *nfds < MAX_PASSED_FDS; i++)
+    {
+      memcpy(&fds[(*nfds)++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+    }
+  }
+  return len;
+}
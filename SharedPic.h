@@ -0,0 +1,44 @@
+#ifndef SHAREDPIC_H
+#define SHAREDPIC_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "Picture.h"
+
+  // identifies a shared picture segment ("SPIC")
+  #define SHARED_PIC_MAGIC 0x43495053
+  // pixel planes start one cache line into the segment
+  #define SHARED_PIC_DATA_OFFSET 64
+
+  // Header at the start of every shared picture segment. It is followed, at
+  // SHARED_PIC_DATA_OFFSET, by the picture in sod's native layout: one plane
+  // of width * height floats (0.0 - 1.0) per RGB channel.
+  struct shared_pic_header {
+    uint32_t magic;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+  };
+
+  // create a new memfd segment of the given size and map it as a picture,
+  // sealed against resizing; the segment's descriptor is kept in pic->shm_fd
+  // until the picture is cleared
+  bool create_shared_picture(struct picture *pic, int width, int height);
+
+  // map an existing segment (e.g. received from a client) as a picture, taking
+  // ownership of the descriptor; the pixels are used in place, without copying
+  // (segments not sealed against resizing, as created above, are refused)
+  bool map_shared_picture(struct picture *pic, int fd);
+
+  // unmap the picture's segment and close its descriptor
+  void release_shared_picture(struct picture *pic);
+
+  // pass a descriptor alongside a line of text over a Unix domain socket
+  bool send_with_fd(int sock, const char *line, int fd);
+
+  // receive up to size bytes, storing any passed descriptors in fds (at most
+  // MAX_PASSED_FDS, their number in *nfds); returns the number of bytes received
+  #define MAX_PASSED_FDS 4
+  ssize_t receive_with_fds(int sock, char *buf, size_t size, int fds[MAX_PASSED_FDS], int *nfds);
+
+#endif
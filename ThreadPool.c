@@ -0,0 +1,165 @@
+#include "ThreadPool.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MIN_POOL_SIZE 2
+#define MAX_POOL_SIZE 64
+
+/*
+   Worker loop: repeatedly takes the oldest queued task and runs it, until the
+   pool is shut down and the queue has been drained.
+   Parameters:
+     - pool_arg: Pointer to the thread_pool the worker belongs to.
+*/
+static void *pool_worker(void *pool_arg)
+{
+  struct thread_pool *pool = (struct thread_pool *)pool_arg;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&pool->lock);
+    pool->idle_workers++;
+    while (pool->head == NULL && !pool->shutting_down)
+    {
+      pthread_cond_wait(&pool->has_work, &pool->lock);
+    }
+    pool->idle_workers--;
+    /* Only exit once every queued task has been run. */
+    if (pool->head == NULL)
+    {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    struct pool_task *task = pool->head;
+    pool->head = task->next;
+    if (pool->head == NULL)
+    {
+      pool->tail = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    /* An owned task may be freed (or submitted again) by its own run. */
+    bool owned = task->owned;
+    task->run(task->arg);
+    if (!owned)
+    {
+      free(task);
+    }
+  }
+}
+
+bool init_thread_pool(struct thread_pool *pool, int no_workers)
+{
+  pool->head = NULL;
+  pool->tail = NULL;
+  pool->shutting_down = false;
+  pool->no_workers = 0;
+  pool->idle_workers = 0;
+  pool->workers = malloc(no_workers * sizeof(pthread_t));
+  if (pool->workers == NULL)
+  {
+    return false;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->has_work, NULL);
+
+  for (int i = 0; i < no_workers; i++)
+  {
+    if (pthread_create(&pool->workers[i], NULL, pool_worker, pool) != 0)
+    {
+      break;
+    }
+    pool->no_workers++;
+  }
+
+  /* A pool without workers would silently swallow every task. */
+  if (pool->no_workers == 0)
+  {
+    destroy_thread_pool(pool);
+    return false;
+  }
+  return true;
+}
+
+void destroy_thread_pool(struct thread_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->shutting_down = true;
+  pthread_cond_broadcast(&pool->has_work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->no_workers; i++)
+  {
+    pthread_join(pool->workers[i], NULL);
+  }
+  free(pool->workers);
+  pool->workers = NULL;
+  pool->no_workers = 0;
+
+  pthread_cond_destroy(&pool->has_work);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+/*
+   Appends a task to the queue and wakes a worker for it.
+   Parameters:
+     - pool: The pool to run the task on.
+     - task: The task, its run and arg filled in.
+*/
+static void queue_task(struct thread_pool *pool, struct pool_task *task)
+{
+  task->next = NULL;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail == NULL)
+  {
+    pool->head = task;
+  }
+  else
+  {
+    pool->tail->next = task;
+  }
+  pool->tail = task;
+  pthread_cond_signal(&pool->has_work);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+bool submit_task(struct thread_pool *pool, void (*run)(void *), void *arg)
+{
+  struct pool_task *task = malloc(sizeof(struct pool_task));
+  if (task == NULL)
+  {
+    return false;
+  }
+  task->run = run;
+  task->arg = arg;
+  task->owned = false;
+  queue_task(pool, task);
+  return true;
+}
+
+void submit_owned_task(struct thread_pool *pool, struct pool_task *task, void (*run)(void *), void *arg)
+{
+  task->run = run;
+  task->arg = arg;
+  task->owned = true;
+  queue_task(pool, task);
+}
+
+bool thread_pool_idle(struct thread_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  /* Queued tasks are about to take any waiting workers. */
+  bool idle = pool->head == NULL && pool->idle_workers > 0;
+  pthread_mutex_unlock(&pool->lock);
+  return idle;
+}
+
+int default_pool_size(void)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < MIN_POOL_SIZE)
+  {
+    return MIN_POOL_SIZE;
+  }
+  return cpus > MAX_POOL_SIZE ? MAX_POOL_SIZE : (int)cpus;
+}
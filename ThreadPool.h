@@ -0,0 +1,52 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/* A single unit of work waiting in the pool's queue. Tasks are allocated by
+   submit_task and freed once run, unless the submitter owns them. */
+struct pool_task
+{
+  void (*run)(void *arg);
+  void *arg;
+  bool owned;
+  struct pool_task *next;
+};
+
+/* A fixed set of long-lived worker threads consuming a shared FIFO of tasks,
+   so that callers never pay thread creation costs on the hot path. */
+struct thread_pool
+{
+  pthread_t *workers;
+  int no_workers;
+  int idle_workers;
+
+  struct pool_task *head;
+  struct pool_task *tail;
+
+  pthread_mutex_t lock;
+  pthread_cond_t has_work;
+  bool shutting_down;
+};
+
+// thread pool lifecycle
+bool init_thread_pool(struct thread_pool *pool, int no_workers);
+void destroy_thread_pool(struct thread_pool *pool);
+
+// queue a task for execution on one of the pool's workers
+bool submit_task(struct thread_pool *pool, void (*run)(void *), void *arg);
+
+// queue a task the caller owns, which cannot fail as nothing is allocated;
+// the task must not be submitted again until it has started running, and the
+// pool does not touch it once it has
+void submit_owned_task(struct thread_pool *pool, struct pool_task *task, void (*run)(void *), void *arg);
+
+// true if a worker is waiting for work (so a task submitted now would start
+// straight away)
+bool thread_pool_idle(struct thread_pool *pool);
+
+// number of workers to use when the caller has no preference
+int default_pool_size(void);
+
+#endif
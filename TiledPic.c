@@ -0,0 +1,657 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "Utils.h"
+#include "TiledPic.h"
+#include "ThreadPool.h"
+#include "JpegDecode.h"
+#include "JpegEncode.h"
+
+#define RGB_BYTES 3
+#define NO_RGB_COMPONENTS 3
+#define BLUR_REGION_SIZE 9
+/* Tiles a worker keeps pinned while reading a source picture: enough for a
+   3x3 neighbourhood that straddles tile corners. */
+#define VIEW_SLOTS 9
+
+static struct tile *tile_at(struct tiled_picture *tp, int tx, int ty)
+{
+  return &tp->tiles[(size_t)ty * tp->tiles_x + tx];
+}
+
+/* Offset of a tile within the backing file (64-bit: a 30k x 20k picture
+   occupies 1.8GB on disk). */
+static off_t tile_offset(struct tiled_picture *tp, struct tile *t)
+{
+  return (off_t)(t - tp->tiles) * (off_t)TILE_BYTES;
+}
+
+static bool write_fully(int fd, const unsigned char *buf, size_t size, off_t offset)
+{
+  while (size > 0)
+  {
+    ssize_t done = pwrite(fd, buf, size, offset);
+    if (done <= 0)
+    {
+      return false;
+    }
+    buf += done;
+    size -= done;
+    offset += done;
+  }
+  return true;
+}
+
+static bool read_fully(int fd, unsigned char *buf, size_t size, off_t offset)
+{
+  while (size > 0)
+  {
+    ssize_t done = pread(fd, buf, size, offset);
+    if (done <= 0)
+    {
+      return false;
+    }
+    buf += done;
+    size -= done;
+    offset += done;
+  }
+  return true;
+}
+
+bool init_tiled_picture(struct tiled_picture *tp, int width, int height, size_t cache_bytes)
+{
+  tp->width = width;
+  tp->height = height;
+  tp->tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+  tp->tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+  tp->max_resident = cache_bytes / TILE_BYTES > 0 ? cache_bytes / TILE_BYTES : 1;
+  tp->resident = 0;
+  tp->clock_hand = 0;
+  tp->tiles = calloc((size_t)tp->tiles_x * tp->tiles_y, sizeof(struct tile));
+  if (tp->tiles == NULL)
+  {
+    return false;
+  }
+
+  /* The backing file is unlinked at once, so it can never outlive us. */
+  const char *dir = getenv("TMPDIR");
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/picture-tiles-XXXXXX", dir != NULL ? dir : "/tmp");
+  tp->fd = mkstemp(path);
+  if (tp->fd == IO_ERROR)
+  {
+    free(tp->tiles);
+    return false;
+  }
+  unlink(path);
+
+  pthread_mutex_init(&tp->lock, NULL);
+  pthread_cond_init(&tp->io_done, NULL);
+  return true;
+}
+
+void clear_tiled_picture(struct tiled_picture *tp)
+{
+  for (size_t i = 0; i < (size_t)tp->tiles_x * tp->tiles_y; i++)
+  {
+    free(tp->tiles[i].pixels);
+  }
+  free(tp->tiles);
+  close(tp->fd);
+  pthread_mutex_destroy(&tp->lock);
+  pthread_cond_destroy(&tp->io_done);
+}
+
+/*
+   Moves the clock hand to the next eviction candidate: a resident, unpinned
+   tile not referenced since the hand last passed it.
+   Parameters:
+     - tp: The tiled picture (lock held).
+     - clean_only: Whether to skip tiles that would need writing back.
+*/
+static struct tile *find_victim(struct tiled_picture *tp, bool clean_only)
+{
+  size_t no_tiles = (size_t)tp->tiles_x * tp->tiles_y;
+  for (size_t step = 0; step < 2 * no_tiles; step++)
+  {
+    struct tile *t = &tp->tiles[tp->clock_hand];
+    tp->clock_hand = (tp->clock_hand + 1) % no_tiles;
+    if (t->pixels == NULL || t->pins > 0 || t->busy || (clean_only && t->dirty))
+    {
+      continue;
+    }
+    if (t->referenced)
+    {
+      t->referenced = false;
+      continue;
+    }
+    return t;
+  }
+  return NULL;
+}
+
+/*
+   Evicts tiles until there is room for one more, preferring clean tiles
+   (which are simply dropped) to dirty ones (which are written back first).
+   If every resident tile is pinned the budget is exceeded rather than
+   waiting, so callers can never deadlock on their own pins.
+   Parameters:
+     - tp: The tiled picture (lock held; released during write-back).
+*/
+static void make_room(struct tiled_picture *tp)
+{
+  while (tp->resident >= tp->max_resident)
+  {
+    struct tile *victim = find_victim(tp, true);
+    if (victim == NULL)
+    {
+      victim = find_victim(tp, false);
+    }
+    if (victim == NULL)
+    {
+      return;
+    }
+    if (victim->dirty)
+    {
+      /* Readers of the victim wait on busy until the write-back completes. */
+      victim->busy = true;
+      pthread_mutex_unlock(&tp->lock);
+      bool written = write_fully(tp->fd, victim->pixels, TILE_BYTES, tile_offset(tp, victim));
+      pthread_mutex_lock(&tp->lock);
+      victim->busy = false;
+      pthread_cond_broadcast(&tp->io_done);
+      if (!written)
+      {
+        return;
+      }
+      victim->dirty = false;
+      victim->on_disk = true;
+    }
+    free(victim->pixels);
+    victim->pixels = NULL;
+    tp->resident--;
+  }
+}
+
+unsigned char *acquire_tile(struct tiled_picture *tp, int tx, int ty, bool for_write)
+{
+  struct tile *t = tile_at(tp, tx, ty);
+  pthread_mutex_lock(&tp->lock);
+  while (t->busy)
+  {
+    pthread_cond_wait(&tp->io_done, &tp->lock);
+  }
+  t->pins++;
+  t->referenced = true;
+
+  if (t->pixels == NULL)
+  {
+    t->busy = true;
+    make_room(tp);
+    pthread_mutex_unlock(&tp->lock);
+    unsigned char *pixels = malloc(TILE_BYTES);
+    bool loaded = pixels != NULL;
+    if (loaded && t->on_disk)
+    {
+      loaded = read_fully(tp->fd, pixels, TILE_BYTES, tile_offset(tp, t));
+    }
+    else if (loaded)
+    {
+      memset(pixels, 0, TILE_BYTES);
+    }
+    pthread_mutex_lock(&tp->lock);
+    t->busy = false;
+    pthread_cond_broadcast(&tp->io_done);
+    if (!loaded)
+    {
+      free(pixels);
+      t->pins--;
+      pthread_mutex_unlock(&tp->lock);
+      return NULL;
+    }
+    t->pixels = pixels;
+    tp->resident++;
+  }
+  if (for_write)
+  {
+    t->dirty = true;
+  }
+  unsigned char *pixels = t->pixels;
+  pthread_mutex_unlock(&tp->lock);
+  return pixels;
+}
+
+void release_tile(struct tiled_picture *tp, int tx, int ty)
+{
+  pthread_mutex_lock(&tp->lock);
+  tile_at(tp, tx, ty)->pins--;
+  pthread_mutex_unlock(&tp->lock);
+}
+
+// ---------- pixel access across tiles ---------- \\
+
+/* A worker's window onto a source picture: a few pinned tiles, replaced
+   round-robin as the worker moves across tile boundaries. */
+struct tile_view
+{
+  struct tiled_picture *tp;
+  int tx[VIEW_SLOTS];
+  int ty[VIEW_SLOTS];
+  unsigned char *pixels[VIEW_SLOTS];
+  int next;
+  bool failed;
+  unsigned char blank[RGB_BYTES];
+};
+
+static void init_view(struct tile_view *view, struct tiled_picture *tp)
+{
+  memset(view, 0, sizeof(struct tile_view));
+  view->tp = tp;
+}
+
+static void release_view(struct tile_view *view)
+{
+  for (int s = 0; s < VIEW_SLOTS; s++)
+  {
+    if (view->pixels[s] != NULL)
+    {
+      release_tile(view->tp, view->tx[s], view->ty[s]);
+    }
+  }
+}
+
+/*
+   Finds the RGB bytes of pixel (x,y), pinning its tile if needed.
+   Parameters:
+     - view: The worker's view of the source picture.
+     - x, y: Coordinates within the picture.
+*/
+static unsigned char *view_pixel(struct tile_view *view, int x, int y)
+{
+  int tx = x / TILE_SIZE;
+  int ty = y / TILE_SIZE;
+  int s = 0;
+  while (s < VIEW_SLOTS && (view->pixels[s] == NULL || view->tx[s] != tx || view->ty[s] != ty))
+  {
+    s++;
+  }
+  if (s == VIEW_SLOTS)
+  {
+    s = view->next;
+    view->next = (view->next + 1) % VIEW_SLOTS;
+    if (view->pixels[s] != NULL)
+    {
+      release_tile(view->tp, view->tx[s], view->ty[s]);
+    }
+    view->tx[s] = tx;
+    view->ty[s] = ty;
+    view->pixels[s] = acquire_tile(view->tp, tx, ty, false);
+    if (view->pixels[s] == NULL)
+    {
+      view->failed = true;
+      return view->blank;
+    }
+  }
+  return view->pixels[s] + ((size_t)(y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE) * RGB_BYTES;
+}
+
+// ---------- tile-parallel transformations ---------- \\
+
+/* A transformation run over every tile of dst, one pool task per tile. */
+struct tiled_op
+{
+  struct tiled_picture *src;
+  struct tiled_picture *dst;
+  void (*run)(struct tiled_op *op, unsigned char *out, int tx, int ty, struct tile_view *view);
+  int angle;
+  char plane;
+  pthread_mutex_t lock;
+  bool ok;
+};
+
+struct tile_task
+{
+  struct tiled_op *op;
+  int tx;
+  int ty;
+};
+
+static void run_tile_task(void *task_arg)
+{
+  struct tile_task *task = (struct tile_task *)task_arg;
+  struct tiled_op *op = task->op;
+  struct tile_view view;
+  init_view(&view, op->src);
+
+  unsigned char *out = acquire_tile(op->dst, task->tx, task->ty, true);
+  if (out != NULL)
+  {
+    op->run(op, out, task->tx, task->ty, &view);
+    release_tile(op->dst, task->tx, task->ty);
+  }
+  release_view(&view);
+
+  if (out == NULL || view.failed)
+  {
+    pthread_mutex_lock(&op->lock);
+    op->ok = false;
+    pthread_mutex_unlock(&op->lock);
+  }
+  free(task);
+}
+
+/*
+   Runs op over all tiles of op->dst on a worker pool, returning once every
+   tile is done (destroying the pool drains its queue).
+   Parameters:
+     - op: The transformation, with src, dst and run set.
+*/
+static bool run_tiled_op(struct tiled_op *op)
+{
+  struct thread_pool pool;
+  bool pooled = init_thread_pool(&pool, default_pool_size());
+  op->ok = true;
+  pthread_mutex_init(&op->lock, NULL);
+
+  for (int ty = 0; ty < op->dst->tiles_y; ty++)
+  {
+    for (int tx = 0; tx < op->dst->tiles_x; tx++)
+    {
+      struct tile_task *task = malloc(sizeof(struct tile_task));
+      if (task == NULL)
+      {
+        op->ok = false;
+        continue;
+      }
+      task->op = op;
+      task->tx = tx;
+      task->ty = ty;
+      if (!pooled || !submit_task(&pool, run_tile_task, task))
+      {
+        run_tile_task(task);
+      }
+    }
+  }
+  if (pooled)
+  {
+    destroy_thread_pool(&pool);
+  }
+  pthread_mutex_destroy(&op->lock);
+  return op->ok;
+}
+
+/* Width and height of the part of tile (tx,ty) that lies inside the picture. */
+static int tile_width(struct tiled_picture *tp, int tx)
+{
+  int rest = tp->width - tx * TILE_SIZE;
+  return rest < TILE_SIZE ? rest : TILE_SIZE;
+}
+
+static int tile_height(struct tiled_picture *tp, int ty)
+{
+  int rest = tp->height - ty * TILE_SIZE;
+  return rest < TILE_SIZE ? rest : TILE_SIZE;
+}
+
+static void invert_tile(struct tiled_op *op, unsigned char *out, int tx, int ty, struct tile_view *unused)
+{
+  (void)unused;
+  for (int j = 0; j < tile_height(op->dst, ty); j++)
+  {
+    unsigned char *p = out + (size_t)j * TILE_SIZE * RGB_BYTES;
+    for (int k = 0; k < tile_width(op->dst, tx) * RGB_BYTES; k++)
+    {
+      p[k] = MAX_PIXEL_INTENSITY - p[k];
+    }
+  }
+}
+
+static void grayscale_tile(struct tiled_op *op, unsigned char *out, int tx, int ty, struct tile_view *unused)
+{
+  (void)unused;
+  for (int j = 0; j < tile_height(op->dst, ty); j++)
+  {
+    unsigned char *p = out + (size_t)j * TILE_SIZE * RGB_BYTES;
+    for (int i = 0; i < tile_width(op->dst, tx); i++, p += RGB_BYTES)
+    {
+      int avg = (p[0] + p[1] + p[2]) / NO_RGB_COMPONENTS;
+      p[0] = p[1] = p[2] = avg;
+    }
+  }
+}
+
+/*
+   Fills a tile of dst with the source pixel each destination pixel maps to
+   under rotate_picture / flip_picture.
+*/
+static void remap_tile(struct tiled_op *op, unsigned char *out, int tx, int ty, struct tile_view *view)
+{
+  int new_width = op->dst->width;
+  int new_height = op->dst->height;
+  for (int j = 0; j < tile_height(op->dst, ty); j++)
+  {
+    for (int i = 0; i < tile_width(op->dst, tx); i++)
+    {
+      int x = tx * TILE_SIZE + i;
+      int y = ty * TILE_SIZE + j;
+      int src_x = x, src_y = y;
+      if (op->angle == 90)
+      {
+        src_x = y;
+        src_y = new_width - 1 - x;
+      }
+      else if (op->angle == 180)
+      {
+        src_x = new_width - 1 - x;
+        src_y = new_height - 1 - y;
+      }
+      else if (op->angle == 270)
+      {
+        src_x = new_height - 1 - y;
+        src_y = x;
+      }
+      else if (op->plane == 'V')
+      {
+        src_y = new_height - 1 - y;
+      }
+      else if (op->plane == 'H')
+      {
+        src_x = new_width - 1 - x;
+      }
+      memcpy(out + ((size_t)j * TILE_SIZE + i) * RGB_BYTES, view_pixel(view, src_x, src_y), RGB_BYTES);
+    }
+  }
+}
+
+static void blur_tile(struct tiled_op *op, unsigned char *out, int tx, int ty, struct tile_view *view)
+{
+  int width = op->src->width;
+  int height = op->src->height;
+  for (int j = 0; j < tile_height(op->dst, ty); j++)
+  {
+    for (int i = 0; i < tile_width(op->dst, tx); i++)
+    {
+      int x = tx * TILE_SIZE + i;
+      int y = ty * TILE_SIZE + j;
+      unsigned char *p = out + ((size_t)j * TILE_SIZE + i) * RGB_BYTES;
+
+      /* Boundary pixels are left unchanged, as in blur_picture. */
+      if (x == 0 || y == 0 || x == width - 1 || y == height - 1)
+      {
+        memcpy(p, view_pixel(view, x, y), RGB_BYTES);
+        continue;
+      }
+      int sum[RGB_BYTES] = {0, 0, 0};
+      for (int n = -1; n <= 1; n++)
+      {
+        for (int m = -1; m <= 1; m++)
+        {
+          unsigned char *near = view_pixel(view, x + n, y + m);
+          for (int c = 0; c < RGB_BYTES; c++)
+          {
+            sum[c] += near[c];
+          }
+        }
+      }
+      for (int c = 0; c < RGB_BYTES; c++)
+      {
+        p[c] = sum[c] / BLUR_REGION_SIZE;
+      }
+    }
+  }
+}
+
+/*
+   Runs a transformation from tp into a fresh tiled picture of the given
+   size, then swaps the result into tp (keeping tp's lock) and discards the
+   original, much as PicProcess does with its temporary pictures.
+*/
+static bool transform_into_new(struct tiled_picture *tp, struct tiled_op *op, int width, int height)
+{
+  struct tiled_picture tmp;
+  if (!init_tiled_picture(&tmp, width, height, tp->max_resident * TILE_BYTES))
+  {
+    return false;
+  }
+  op->src = tp;
+  op->dst = &tmp;
+  if (!run_tiled_op(op))
+  {
+    clear_tiled_picture(&tmp);
+    return false;
+  }
+
+  struct tiled_picture old = *tp;
+  tp->width = tmp.width;
+  tp->height = tmp.height;
+  tp->tiles_x = tmp.tiles_x;
+  tp->tiles_y = tmp.tiles_y;
+  tp->tiles = tmp.tiles;
+  tp->fd = tmp.fd;
+  tp->resident = tmp.resident;
+  tp->clock_hand = tmp.clock_hand;
+  tmp.tiles = old.tiles;
+  tmp.tiles_x = old.tiles_x;
+  tmp.tiles_y = old.tiles_y;
+  tmp.fd = old.fd;
+  clear_tiled_picture(&tmp);
+  return true;
+}
+
+bool invert_tiled_picture(struct tiled_picture *tp)
+{
+  struct tiled_op op = { .src = tp, .dst = tp, .run = invert_tile };
+  return run_tiled_op(&op);
+}
+
+bool grayscale_tiled_picture(struct tiled_picture *tp)
+{
+  struct tiled_op op = { .src = tp, .dst = tp, .run = grayscale_tile };
+  return run_tiled_op(&op);
+}
+
+bool rotate_tiled_picture(struct tiled_picture *tp, int angle)
+{
+  if (angle != 90 && angle != 180 && angle != 270)
+  {
+    printf("[!] rotate is undefined for angle %i (must be 90, 180 or 270)\n", angle);
+    return false;
+  }
+  struct tiled_op op = { .run = remap_tile, .angle = angle };
+  bool quarter = angle == 90 || angle == 270;
+  return transform_into_new(tp, &op, quarter ? tp->height : tp->width, quarter ? tp->width : tp->height);
+}
+
+bool flip_tiled_picture(struct tiled_picture *tp, char plane)
+{
+  if (plane != 'H' && plane != 'V')
+  {
+    printf("[!] flip is undefined for plane %c\n", plane);
+    return false;
+  }
+  struct tiled_op op = { .run = remap_tile, .plane = plane };
+  return transform_into_new(tp, &op, tp->width, tp->height);
+}
+
+bool blur_tiled_picture(struct tiled_picture *tp)
+{
+  struct tiled_op op = { .run = blur_tile };
+  return transform_into_new(tp, &op, tp->width, tp->height);
+}
+
+// ---------- scanline I/O ---------- \\
+
+bool load_tiled_picture(struct tiled_picture *tp, const char *path, size_t cache_bytes)
+{
+  struct jpeg_decoder *dec = open_jpeg_decoder(path);
+  if (dec == NULL)
+  {
+    return false;
+  }
+  int width = jpeg_decoder_width(dec);
+  unsigned char *row = malloc((size_t)width * RGB_BYTES);
+  bool ok = row != NULL && init_tiled_picture(tp, width, jpeg_decoder_height(dec), cache_bytes);
+  if (!ok)
+  {
+    free(row);
+    close_jpeg_decoder(dec);
+    return false;
+  }
+
+  for (int y = 0; ok && y < tp->height; y++)
+  {
+    ok = read_jpeg_row(dec, row);
+    for (int tx = 0; ok && tx < tp->tiles_x; tx++)
+    {
+      unsigned char *pixels = acquire_tile(tp, tx, y / TILE_SIZE, true);
+      ok = pixels != NULL;
+      if (ok)
+      {
+        memcpy(pixels + (size_t)(y % TILE_SIZE) * TILE_SIZE * RGB_BYTES,
+               row + (size_t)tx * TILE_SIZE * RGB_BYTES, (size_t)tile_width(tp, tx) * RGB_BYTES);
+        release_tile(tp, tx, y / TILE_SIZE);
+      }
+    }
+  }
+  free(row);
+  close_jpeg_decoder(dec);
+  if (!ok)
+  {
+    clear_tiled_picture(tp);
+  }
+  return ok;
+}
+
+bool save_tiled_picture(struct tiled_picture *tp, const char *path, const struct jpeg_profile *profile)
+{
+  struct jpeg_encoder *enc = open_jpeg_encoder(path, tp->width, tp->height, profile);
+  unsigned char *row = malloc((size_t)tp->width * RGB_BYTES);
+  bool ok = enc != NULL && row != NULL;
+
+  for (int y = 0; ok && y < tp->height; y++)
+  {
+    for (int tx = 0; ok && tx < tp->tiles_x; tx++)
+    {
+      unsigned char *pixels = acquire_tile(tp, tx, y / TILE_SIZE, false);
+      ok = pixels != NULL;
+      if (ok)
+      {
+        memcpy(row + (size_t)tx * TILE_SIZE * RGB_BYTES,
+               pixels + (size_t)(y % TILE_SIZE) * TILE_SIZE * RGB_BYTES, (size_t)tile_width(tp, tx) * RGB_BYTES);
+        release_tile(tp, tx, y / TILE_SIZE);
+      }
+    }
+    ok = ok && write_jpeg_row(enc, row);
+  }
+  if (enc != NULL)
+  {
+    ok = close_jpeg_encoder(enc) && ok;
+  }
+  free(row);
+  if (!ok)
+  {
+    printf("[!] error saving file to %s\n", path);
+  }
+  return ok;
+}
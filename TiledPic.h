@@ -0,0 +1,69 @@
+#ifndef TILEDPIC_H
+#define TILEDPIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "JpegEncode.h"
+
+#define TILE_SIZE 256
+#define TILE_BYTES ((size_t)TILE_SIZE * TILE_SIZE * 3)
+/* Default bound on resident tile memory for one tiled picture. */
+#define DEFAULT_TILE_CACHE_BYTES ((size_t)256 * 1024 * 1024)
+
+/* One TILE_SIZE x TILE_SIZE block of a tiled picture, held as interleaved RGB
+   bytes (the same 0-255 values get_pixel reports) while resident. */
+struct tile
+{
+  unsigned char *pixels;
+  int pins;
+  bool dirty;
+  bool referenced;
+  bool busy;
+  bool on_disk;
+};
+
+/* A picture too large to hold in sod's float format. Tiles live in an
+   unlinked backing file and are materialised on demand; when the resident
+   set outgrows its budget, unpinned tiles are evicted (clean ones first,
+   dirty ones after being written back). All offsets are 64-bit. */
+struct tiled_picture
+{
+  int width;
+  int height;
+  int tiles_x;
+  int tiles_y;
+  struct tile *tiles;
+
+  int fd;
+  size_t max_resident;
+  size_t resident;
+  size_t clock_hand;
+
+  pthread_mutex_t lock;
+  pthread_cond_t io_done;
+};
+
+// tiled picture lifecycle (pixels start out black)
+bool init_tiled_picture(struct tiled_picture *tp, int width, int height, size_t cache_bytes);
+void clear_tiled_picture(struct tiled_picture *tp);
+
+// pin a tile in memory (materialising it if needed) and return its pixels;
+// pass for_write when the tile will be modified
+unsigned char *acquire_tile(struct tiled_picture *tp, int tx, int ty, bool for_write);
+void release_tile(struct tiled_picture *tp, int tx, int ty);
+
+// decode a colour JPEG straight into tiles, a scanline at a time
+bool load_tiled_picture(struct tiled_picture *tp, const char *path, size_t cache_bytes);
+
+// encode a tiled picture as a JPEG, a scanline at a time
+bool save_tiled_picture(struct tiled_picture *tp, const char *path, const struct jpeg_profile *profile);
+
+// tile-parallel picture transformations (same results as PicProcess)
+bool invert_tiled_picture(struct tiled_picture *tp);
+bool grayscale_tiled_picture(struct tiled_picture *tp);
+bool rotate_tiled_picture(struct tiled_picture *tp, int angle);
+bool flip_tiled_picture(struct tiled_picture *tp, char plane);
+bool blur_tiled_picture(struct tiled_picture *tp);
+
+#endif
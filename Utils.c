@@ -1,42 +1,646 @@
 #include "Utils.h"
+#include "BufferPool.h"
+#include "JpegDecode.h"
+#include "JpegEncode.h"
+#include "PnmFile.h"
+#include "RawPic.h"
+// declarations of sod's public copy of stb's PNG, BMP and TGA writers, and
+// of its image readers
+#include "sod_img_writer.h"
+#include "sod_img_reader.h"
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-  #define DEFAULT_COMPRESSION_QUALITY -1
-  #define FULL_COLOUR_CHANNELS 3
+  // pixels converted per step of the vectorised row conversion
+  #define CONVERT_BLOCK 16
+  // pictures at least this large are decoded and encoded on several threads
+  #define PARALLEL_CODEC_MIN_PIXELS (1024 * 1024)
+  #define MAX_CODEC_WORKERS 64
 
+  // number of threads to decode or encode a picture with (one for small
+  // pictures, and on single core machines where it would only add overhead)
+  static int codec_workers(long pixels){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(pixels < PARALLEL_CODEC_MIN_PIXELS || cpus <= 1){
+      return 1;
+    }
+    return cpus > MAX_CODEC_WORKERS ? MAX_CODEC_WORKERS : (int)cpus;
+  }
+
+  static __thread FILE *report_out = NULL;
+
+  void set_report_stream(FILE *out){
+    report_out = out;
+  }
+
+  FILE *report_stream(void){
+    return report_out != NULL ? report_out : stdout;
+  }
+
+  int image_stride(int width){
+    int stride = (width + IMAGE_ROW_ALIGN - 1) / IMAGE_ROW_ALIGN * IMAGE_ROW_ALIGN;
+    // a stride of a multiple of 4KB maps every row of a column to the same
+    // cache sets, so column walks (e.g. rotate) would thrash; skew it a line
+    if(stride % 1024 == 0){
+      stride += IMAGE_ROW_ALIGN;
+    }
+    return stride;
+  }
+
+  // image planes are recycled through the buffer pool, as nearly every
+  // transformation allocates a same-sized temporary and frees the original;
+  // pooled buffers come back uncleared and transformations only write the
+  // first width floats of each row, so the padding is zeroed here (it would
+  // otherwise carry stale pixels, possibly of another client, into raw files)
   sod_img create_image(int width, int height){
-    return sod_make_image(width, height, FULL_COLOUR_CHANNELS);   
+    sod_img img;
+    img.w = image_stride(width);
+    img.h = height;
+    img.c = FULL_COLOUR_CHANNELS;
+    img.data = acquire_buffer((size_t)img.w * height * FULL_COLOUR_CHANNELS);
+    if(img.data != 0 && img.w > width){
+      for(size_t row = 0; row < (size_t)height * FULL_COLOUR_CHANNELS; row++){
+        memset(img.data + row * img.w + width, 0, (size_t)(img.w - width) * sizeof(float));
+      }
+    }
+    return img;
   }
 
+  // (every image plane comes from acquire_buffer, so can go back to the pool:
+  // pictures sod allocates itself are moved into pooled buffers as they are
+  // loaded, see adopt_sod_image)
   void free_image(sod_img img){
-    sod_free_image(img);   
+    release_buffer(img.data, (size_t)img.w * img.h * img.c);
+  }
+
+  // move a picture sod has allocated itself (with calloc, so without the
+  // pool's alignment, which the SSE2 paths rely on) into a pooled buffer
+  static sod_img adopt_sod_image(sod_img img){
+    if(img.data == 0){
+      return img;
+    }
+    size_t no_floats = (size_t)img.w * img.h * img.c;
+    float *data = acquire_buffer(no_floats);
+    if(data != 0){
+      memcpy(data, img.data, no_floats * sizeof(float));
+    }
+    sod_free_image(img);
+    img.data = data;
+    return img;
+  }
+
+#ifdef __SSE2__
+  // widen 16 bytes to intensities (b / 255, exactly as sod computes them)
+  static void bytes_to_intensities(__m128i bytes, __m128 out[4]){
+    __m128i zero = _mm_setzero_si128();
+    __m128 max = _mm_set1_ps(MAX_PIXEL_INTENSITY);
+    __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+    __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+    out[0] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), max);
+    out[1] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), max);
+    out[2] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), max);
+    out[3] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), max);
+  }
+#endif
+
+  // scatter one interleaved RGB scanline into row y of the image's planes,
+  // converting CONVERT_BLOCK pixels per step with SSE2 where available
+  static void store_rgb_row(void *img_arg, int y, const unsigned char *rgb){
+    sod_img img = *(sod_img *)img_arg;
+    float *red = img.data + (size_t)y * img.w;
+    float *green = red + (size_t)img.w * img.h;
+    float *blue = green + (size_t)img.w * img.h;
+    int x = 0;
+  #ifdef __SSE2__
+    for(; x + CONVERT_BLOCK <= img.w; x += CONVERT_BLOCK){
+      // 16 pixels as 12 vectors of interleaved r g b r | g b r g | b r g b ...
+      __m128 v[12];
+      for(int i = 0; i < 3; i++){
+        bytes_to_intensities(_mm_loadu_si128((const __m128i *)(rgb + x * FULL_COLOUR_CHANNELS) + i), v + i * 4);
+      }
+      // deinterleave each run of three vectors into four pixels per channel
+      for(int i = 0; i < 4; i++){
+        __m128 a = v[i * 3], b = v[i * 3 + 1], c = v[i * 3 + 2];
+        __m128 r = _mm_shuffle_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 3, 0, 0)),
+                                  _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 g = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)),
+                                  _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 bl = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)),
+                                   _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+        _mm_storeu_ps(red + x + i * 4, r);
+        _mm_storeu_ps(green + x + i * 4, g);
+        _mm_storeu_ps(blue + x + i * 4, bl);
+      }
+    }
+  #endif
+    for(; x < img.w; x++){
+      red[x] = (float)rgb[x * FULL_COLOUR_CHANNELS] / MAX_PIXEL_INTENSITY;
+      green[x] = (float)rgb[x * FULL_COLOUR_CHANNELS + 1] / MAX_PIXEL_INTENSITY;
+      blue[x] = (float)rgb[x * FULL_COLOUR_CHANNELS + 2] / MAX_PIXEL_INTENSITY;
+    }
+  }
+
+  // decode a colour JPEG a scanline at a time straight into sod's planar
+  // float layout, skipping sod's whole-picture byte buffer and its transpose
+  // (restart segments of large pictures are decoded on several threads, and
+  // reduced pictures are decoded at their reduced size)
+  static bool decode_jpeg(struct jpeg_decoder *dec, sod_img *img){
+    img->w = jpeg_decoder_width(dec);
+    img->h = jpeg_decoder_height(dec);
+    img->c = FULL_COLOUR_CHANNELS;
+    size_t no_floats = (size_t)img->w * img->h * img->c;
+    img->data = acquire_buffer(no_floats);
+    bool decoded = img->data != NULL
+                   && read_jpeg_rows(dec, codec_workers((long)img->w * img->h), store_rgb_row, img);
+    close_jpeg_decoder(dec);
+    if(!decoded){
+      release_buffer(img->data, no_floats);
+      img->data = 0;
+    }
+    return decoded;
+  }
+
+  static bool decode_jpeg_image(const char *path, int scale, sod_img *img){
+    struct jpeg_decoder *dec = open_scaled_jpeg_decoder(path, scale);
+    return dec != NULL && decode_jpeg(dec, img);
+  }
+
+  // read a binary PPM or PAM picture straight into sod's planar float layout
+  // (these are what save_image writes for .ppm and .pam paths)
+  static bool decode_pnm(struct pnm_reader *reader, sod_img *img){
+    img->w = pnm_reader_width(reader);
+    img->h = pnm_reader_height(reader);
+    img->c = FULL_COLOUR_CHANNELS;
+    size_t no_floats = (size_t)img->w * img->h * img->c;
+    img->data = acquire_buffer(no_floats);
+    bool decoded = img->data != NULL && read_pnm_rows(reader, store_rgb_row, img);
+    close_pnm_reader(reader);
+    if(!decoded){
+      release_buffer(img->data, no_floats);
+      img->data = 0;
+    }
+    return decoded;
+  }
+
+  static bool decode_pnm_image(const char *path, sod_img *img){
+    struct pnm_reader *reader = open_pnm_reader(path);
+    return reader != NULL && decode_pnm(reader, img);
+  }
+
+  // copy the planes of a raw picture file into a dense pooled buffer (pictures
+  // loaded as such map the file instead, see init_picture_from_file)
+  static bool read_raw_image(const char *path, sod_img *img){
+    struct raw_mapping map;
+    if(!map_raw_picture(path, &map)){
+      return false;
+    }
+    img->w = map.header.width;
+    img->h = map.header.height;
+    img->c = map.header.channels;
+    img->data = acquire_buffer((size_t)img->w * img->h * img->c);
+    if(img->data != 0){
+      for(size_t row = 0; row < (size_t)img->h * img->c; row++){
+        memcpy(img->data + row * img->w, map.data + row * map.header.stride, (size_t)img->w * sizeof(float));
+      }
+    }
+    unmap_raw_picture(map.base, map.size);
+    return img->data != 0;
+  }
+
+  // average each scale x scale box of a loaded image into one pixel of a
+  // dense pooled image (boxes at the right and bottom edges may be partial),
+  // for formats that cannot be decoded at a reduced size
+  static sod_img shrink_image(sod_img img, int scale){
+    sod_img small;
+    small.w = (img.w + scale - 1) / scale;
+    small.h = (img.h + scale - 1) / scale;
+    small.c = img.c;
+    small.data = acquire_buffer((size_t)small.w * small.h * small.c);
+    if(small.data != 0){
+      for(int c = 0; c < img.c; c++){
+        const float *plane = img.data + (size_t)c * img.w * img.h;
+        for(int y = 0; y < small.h; y++){
+          int y1 = (y + 1) * scale < img.h ? (y + 1) * scale : img.h;
+          for(int x = 0; x < small.w; x++){
+            int x1 = (x + 1) * scale < img.w ? (x + 1) * scale : img.w;
+            float sum = 0.0f;
+            for(int yy = y * scale; yy < y1; yy++){
+              for(int xx = x * scale; xx < x1; xx++){
+                sum += plane[(size_t)yy * img.w + xx];
+              }
+            }
+            small.data[((size_t)c * small.h + y) * small.w + x] = sum / ((y1 - y * scale) * (x1 - x * scale));
+          }
+        }
+      }
+    }
+    free_image(img);
+    return small;
+  }
+
+  bool parse_image_scale(const char *text, int *scale){
+    if(!strcmp(text, "1") || !strcmp(text, "1/1")){
+      *scale = 1;
+    } else if(!strcmp(text, "1/2")){
+      *scale = 2;
+    } else if(!strcmp(text, "1/4")){
+      *scale = 4;
+    } else if(!strcmp(text, "1/8")){
+      *scale = 8;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  bool parse_image_region(const char *text, struct image_region *region){
+    int consumed = 0;
+    if(sscanf(text, "%dx%d+%d+%d%n", &region->width, &region->height, &region->x, &region->y, &consumed) != 4
+       || text[consumed] != '\0'){
+      return false;
+    }
+    return region->width > 0 && region->height > 0 && region->x >= 0 && region->y >= 0;
+  }
+
+  bool region_fits(struct image_region region, int width, int height){
+    return region.x <= width - region.width && region.y <= height - region.height;
+  }
+
+  bool region_outside(struct image_region region, int width, int height){
+    if(!region_fits(region, width, height)){
+      fprintf(report_stream(), "[!] region %dx%d+%d+%d is outside the %dx%d picture\n",
+              region.width, region.height, region.x, region.y, width, height);
+      return true;
+    }
+    return false;
+  }
+
+  // decode just a region of a colour JPEG straight into a dense image of its
+  // size (0 if the file is not one; data 0 and a report if it is, but the
+  // region does not fit or cannot be decoded)
+  static int decode_jpeg_region(const char *path, struct image_region region, sod_img *img){
+    struct jpeg_decoder *dec = open_jpeg_decoder(path);
+    if(dec == NULL){
+      return 0;
+    }
+    img->w = region.width;
+    img->h = region.height;
+    img->c = FULL_COLOUR_CHANNELS;
+    img->data = 0;
+    size_t no_floats = (size_t)img->w * img->h * img->c;
+    if(!region_outside(region, jpeg_decoder_width(dec), jpeg_decoder_height(dec))){
+      img->data = acquire_buffer(no_floats);
+      if(img->data != 0 && !read_jpeg_region(dec, region.x, region.y, region.width, region.height,
+                                             store_rgb_row, img)){
+        fprintf(report_stream(), "[!] error decoding %s\n", path);
+        release_buffer(img->data, no_floats);
+        img->data = 0;
+      }
+    }
+    close_jpeg_decoder(dec);
+    return 1;
+  }
+
+  // copy a region of a loaded image into a dense pooled image of its size,
+  // for formats that cannot decode just part of a picture
+  static sod_img crop_image(sod_img img, struct image_region region){
+    sod_img part;
+    part.w = region.width;
+    part.h = region.height;
+    part.c = img.c;
+    part.data = acquire_buffer((size_t)part.w * part.h * part.c);
+    if(part.data != 0){
+      for(int c = 0; c < img.c; c++){
+        for(int y = 0; y < part.h; y++){
+          memcpy(part.data + ((size_t)c * part.h + y) * part.w,
+                 img.data + ((size_t)c * img.h + region.y + y) * img.w + region.x,
+                 (size_t)part.w * sizeof(float));
+        }
+      }
+    }
+    free_image(img);
+    return part;
+  }
+
+  sod_img load_image_region(const char *path, struct image_region region){
+    sod_img input;
+    if(image_format_from_path(path) != IMAGE_FORMAT_RAW && access(path, F_OK) != IO_ERROR
+       && decode_jpeg_region(path, region, &input)){
+      return input;
+    }
+    input = load_image(path);
+    if(input.data != 0 && region_outside(region, input.w, input.h)){
+      free_image(input);
+      input.data = 0;
+    }
+    if(input.data != 0){
+      input = crop_image(input, region);
+    }
+    return input;
   }
 
   sod_img load_image(const char *path){
+    return load_scaled_image(path, 1);
+  }
+
+  sod_img load_image_from_memory(const unsigned char *data, size_t size){
+    sod_img input;
+    struct jpeg_decoder *dec = open_jpeg_decoder_from_memory(data, size, 1);
+    if(dec != NULL && decode_jpeg(dec, &input)){
+      return input;
+    }
+    struct pnm_reader *reader = open_pnm_reader_from_memory(data, size);
+    if(reader != NULL && decode_pnm(reader, &input)){
+      return input;
+    }
+    input = size <= INT_MAX ? adopt_sod_image(sod_img_load_from_mem(data, (int)size, SOD_IMG_COLOR))
+                            : sod_make_empty_image(0, 0, 0);
+    if(input.data == 0){
+      fprintf(report_stream(), "[!] unsupported image format (expecting jpeg, png, bmp, ppm or pam)\n");
+    }
+    return input;
+  }
+
+  bool probe_image(const char *path, int *width, int *height, int *channels){
+    if(image_format_from_path(path) == IMAGE_FORMAT_RAW){
+      // mapping reads no more than the header until the planes are touched
+      struct raw_mapping map;
+      if(!map_raw_picture(path, &map)){
+        return false;
+      }
+      *width = map.header.width;
+      *height = map.header.height;
+      *channels = map.header.channels;
+      unmap_raw_picture(map.base, map.size);
+      return true;
+    }
+    // every other format is loaded as RGB, whatever channels the file holds
+    *channels = FULL_COLOUR_CHANNELS;
+    int comp;
+    if(stbi_info(path, width, height, &comp)){
+      return true;
+    }
+    // stb knows nothing of PAM
+    struct pnm_reader *reader = open_pnm_reader(path);
+    if(reader == NULL){
+      return false;
+    }
+    *width = pnm_reader_width(reader);
+    *height = pnm_reader_height(reader);
+    close_pnm_reader(reader);
+    return true;
+  }
+
+  sod_img load_scaled_image(const char *path, int scale){
     sod_img input;
     if( access(path, F_OK) == IO_ERROR ){
-      printf("[!] error reading from file %s (check it exists)\n", path);
+      fprintf(report_stream(), "[!] error reading from file %s (check it exists)\n", path);
       input.data = 0;
       return input;
     }
-    input = sod_img_load_from_file(path, SOD_IMG_COLOR);  
-    if(input.data == 0){
-      printf("[!] unsupported image format (expecting jpeg, png or bmp)\n");
+    bool raw = image_format_from_path(path) == IMAGE_FORMAT_RAW;
+    if(!raw && decode_jpeg_image(path, scale, &input)){
+      return input;
+    }
+    if(raw){
+      if(!read_raw_image(path, &input)){
+        fprintf(report_stream(), "[!] %s is not a valid raw picture\n", path);
+        input.data = 0;
+      }
+    } else if(!decode_pnm_image(path, &input)){
+      // other formats (and grayscale JPEGs) go through sod's own loader
+      input = adopt_sod_image(sod_img_load_from_file(path, SOD_IMG_COLOR));
+      if(input.data == 0){
+        fprintf(report_stream(), "[!] unsupported image format (expecting jpeg, png, bmp, ppm or pam)\n");
+      }
+    }
+    if(input.data != 0 && scale > 1){
+      input = shrink_image(input, scale);
     }
     return input;
   }
     
-  bool save_image(sod_img img, const char *path){
-    int ret = sod_img_save_as_jpeg(img, path, DEFAULT_COMPRESSION_QUALITY);
-    if(ret != SOD_OK){
-      printf("[!] error saving file to %s\n", path);
+  // gather row y of the image's planes into interleaved RGB bytes, converting
+  // each intensity to (unsigned char)(255 * f) exactly as sod does, with
+  // CONVERT_BLOCK pixels per step under SSE2
+  static void load_rgb_row(sod_img img, int width, int y, unsigned char *rgb){
+    const float *red = img.data + (size_t)y * img.w;
+    const float *green = red + (size_t)img.w * img.h;
+    const float *blue = green + (size_t)img.w * img.h;
+    int x = 0;
+  #ifdef __SSE2__
+    __m128 max = _mm_set1_ps(MAX_PIXEL_INTENSITY);
+    for(; x + CONVERT_BLOCK <= width; x += CONVERT_BLOCK){
+      // interleave four pixels at a time into r g b r | g b r g | b r g b
+      __m128i v[12];
+      for(int i = 0; i < 4; i++){
+        __m128 r = _mm_loadu_ps(red + x + i * 4);
+        __m128 g = _mm_loadu_ps(green + x + i * 4);
+        __m128 b = _mm_loadu_ps(blue + x + i * 4);
+        __m128 a = _mm_shuffle_ps(_mm_shuffle_ps(r, g, _MM_SHUFFLE(0, 0, 0, 0)),
+                                  _mm_shuffle_ps(b, r, _MM_SHUFFLE(1, 1, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 m = _mm_shuffle_ps(_mm_shuffle_ps(g, b, _MM_SHUFFLE(1, 1, 1, 1)),
+                                  _mm_shuffle_ps(r, g, _MM_SHUFFLE(2, 2, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 c = _mm_shuffle_ps(_mm_shuffle_ps(b, r, _MM_SHUFFLE(3, 3, 2, 2)),
+                                  _mm_shuffle_ps(g, b, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+        v[i * 3] = _mm_cvttps_epi32(_mm_mul_ps(a, max));
+        v[i * 3 + 1] = _mm_cvttps_epi32(_mm_mul_ps(m, max));
+        v[i * 3 + 2] = _mm_cvttps_epi32(_mm_mul_ps(c, max));
+      }
+      // narrow the 48 intensities to bytes, sixteen per store
+      for(int i = 0; i < 3; i++){
+        __m128i lo = _mm_packs_epi32(v[i * 4], v[i * 4 + 1]);
+        __m128i hi = _mm_packs_epi32(v[i * 4 + 2], v[i * 4 + 3]);
+        _mm_storeu_si128((__m128i *)(rgb + x * FULL_COLOUR_CHANNELS) + i, _mm_packus_epi16(lo, hi));
+      }
+    }
+  #endif
+    for(; x < width; x++){
+      rgb[x * FULL_COLOUR_CHANNELS] = (unsigned char)(MAX_PIXEL_INTENSITY * red[x]);
+      rgb[x * FULL_COLOUR_CHANNELS + 1] = (unsigned char)(MAX_PIXEL_INTENSITY * green[x]);
+      rgb[x * FULL_COLOUR_CHANNELS + 2] = (unsigned char)(MAX_PIXEL_INTENSITY * blue[x]);
+    }
+  }
+
+  // the picture being saved, as seen by the encoders' row callbacks
+  struct encode_source {
+    sod_img img;
+    int width;
+  };
+
+  // produce row y of the picture being saved as interleaved bytes (RGB, or
+  // one byte per pixel for grayscale pictures)
+  static void fill_encode_row(void *source_arg, int y, unsigned char *row){
+    struct encode_source *source = (struct encode_source *)source_arg;
+    if(source->img.c == FULL_COLOUR_CHANNELS){
+      load_rgb_row(source->img, source->width, y, row);
+      return;
+    }
+    const float *gray = source->img.data + (size_t)y * source->img.w;
+    for(int x = 0; x < source->width; x++){
+      row[x] = (unsigned char)(MAX_PIXEL_INTENSITY * gray[x]);
+    }
+  }
+
+  // encode a colour image a scanline at a time through one reusable row
+  // buffer, instead of sod's whole-picture byte copy; large pictures on
+  // multi-core machines are split into strips encoded in parallel instead
+  static bool encode_jpeg_image(sod_img img, int width, FILE *stream, const struct jpeg_profile *profile){
+    int workers = codec_workers((long)width * img.h);
+    if(workers > 1){
+      struct encode_source source = { img, width };
+      return write_jpeg_parallel_to_stream(stream, width, img.h, profile, workers,
+                                           fill_encode_row, &source);
+    }
+    struct jpeg_encoder *enc = open_jpeg_encoder_to_stream(stream, width, img.h, profile);
+    if(enc == NULL){
       return false;
     }
-    return true;
+    unsigned char *rgb = malloc((size_t)width * FULL_COLOUR_CHANNELS);
+    bool encoded = rgb != NULL;
+    for(int y = 0; encoded && y < img.h; y++){
+      load_rgb_row(img, width, y, rgb);
+      encoded = write_jpeg_row(enc, rgb);
+    }
+    free(rgb);
+    return close_jpeg_encoder(enc) && encoded;
+  }
+
+  // stb writer callback appending to a stdio stream
+  static void write_to_stream(void *stream, void *data, int size){
+    fwrite(data, 1, size, (FILE *)stream);
+  }
+
+  // encode the whole picture with one of stb's (PNG, BMP, TGA or, for
+  // grayscale pictures, JPEG) writers, which take the picture as a single
+  // block of interleaved bytes
+  static bool write_stb_image(sod_img img, int width, FILE *stream, enum image_format format, int quality){
+    size_t row_bytes = (size_t)width * img.c;
+    unsigned char *bytes = malloc(row_bytes * img.h);
+    if(bytes == NULL){
+      return false;
+    }
+    struct encode_source source = { img, width };
+    for(int y = 0; y < img.h; y++){
+      fill_encode_row(&source, y, bytes + y * row_bytes);
+    }
+    int ret;
+    if(format == IMAGE_FORMAT_PNG){
+      ret = stbi_write_png_to_func(write_to_stream, stream, width, img.h, img.c, bytes, (int)row_bytes);
+    } else if(format == IMAGE_FORMAT_BMP){
+      ret = stbi_write_bmp_to_func(write_to_stream, stream, width, img.h, img.c, bytes);
+    } else if(format == IMAGE_FORMAT_TGA){
+      ret = stbi_write_tga_to_func(write_to_stream, stream, width, img.h, img.c, bytes);
+    } else {
+      ret = stbi_write_jpg_to_func(write_to_stream, stream, width, img.h, img.c, bytes, quality);
+    }
+    free(bytes);
+    return ret != 0 && fflush(stream) == 0 && !ferror(stream);
+  }
+
+  // encode an image to an open stream in any format but the raw one
+  static bool write_image(sod_img img, int width, FILE *stream, enum image_format format,
+                          const struct jpeg_profile *profile){
+    if(format == IMAGE_FORMAT_PNM || format == IMAGE_FORMAT_PAM){
+      struct encode_source source = { img, width };
+      return write_pnm_to_stream(stream, width, img.h, img.c, format == IMAGE_FORMAT_PAM, fill_encode_row, &source);
+    }
+    if(format == IMAGE_FORMAT_JPEG && img.c == FULL_COLOUR_CHANNELS){
+      return encode_jpeg_image(img, width, stream, profile);
+    }
+    return write_stb_image(img, width, stream, format, profile->quality < 0 ? 100 : profile->quality);
+  }
+
+  // file extensions recognised by save_image (compared case-insensitively)
+  static const struct {
+    const char *extension;
+    enum image_format format;
+  } image_extensions[] = {
+    { ".png", IMAGE_FORMAT_PNG },
+    { ".bmp", IMAGE_FORMAT_BMP },
+    { ".tga", IMAGE_FORMAT_TGA },
+    { ".ppm", IMAGE_FORMAT_PNM },
+    { ".pgm", IMAGE_FORMAT_PNM },
+    { ".pnm", IMAGE_FORMAT_PNM },
+    { ".pam", IMAGE_FORMAT_PAM },
+    { ".rawpic", IMAGE_FORMAT_RAW }
+  };
+
+  enum image_format image_format_from_path(const char *path){
+    const char *ext = strrchr(path, '.');
+    if(ext != NULL && strchr(ext, '/') == NULL){
+      for(size_t i = 0; i < sizeof(image_extensions) / sizeof(image_extensions[0]); i++){
+        if(!strcasecmp(ext, image_extensions[i].extension)){
+          return image_extensions[i].format;
+        }
+      }
+    }
+    return IMAGE_FORMAT_JPEG;
+  }
+
+  bool parse_image_format(const char *name, enum image_format *format){
+    if(!strcasecmp(name, "jpg") || !strcasecmp(name, "jpeg")){
+      *format = IMAGE_FORMAT_JPEG;
+      return true;
+    }
+    for(size_t i = 0; i < sizeof(image_extensions) / sizeof(image_extensions[0]); i++){
+      if(!strcasecmp(name, image_extensions[i].extension + 1)){
+        *format = image_extensions[i].format;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool save_image(sod_img img, int width, const char *path, const struct jpeg_profile *profile){
+    enum image_format format = image_format_from_path(path);
+    struct encode_source source = { img, width };
+    bool saved;
+    if(format == IMAGE_FORMAT_RAW){
+      saved = write_raw_picture(path, img.data, width, img.h, img.c, img.w);
+    } else if(format == IMAGE_FORMAT_PNM || format == IMAGE_FORMAT_PAM){
+      saved = write_pnm(path, width, img.h, img.c, format == IMAGE_FORMAT_PAM, fill_encode_row, &source);
+    } else if(format == IMAGE_FORMAT_JPEG && img.c != FULL_COLOUR_CHANNELS){
+      // grayscale pictures (only ever loaded, so never padded) go through sod,
+      // which has no chroma to subsample
+      saved = sod_img_save_as_jpeg(img, path, profile->quality) == SOD_OK;
+    } else {
+      FILE *file = fopen(path, "wb");
+      saved = file != NULL && write_image(img, width, file, format, profile);
+      saved = file != NULL && fclose(file) == 0 && saved;
+    }
+    if(!saved){
+      fprintf(report_stream(), "[!] error saving file to %s\n", path);
+    }
+    return saved;
+  }
+
+  bool save_image_to_stream(sod_img img, int width, FILE *stream, enum image_format format,
+                            const struct jpeg_profile *profile){
+    if(format == IMAGE_FORMAT_RAW){
+      fprintf(report_stream(), "[!] raw pictures can only be saved to files\n");
+      return false;
+    }
+    bool saved = write_image(img, width, stream, format, profile);
+    if(!saved){
+      fprintf(report_stream(), "[!] error writing the picture out\n");
+    }
+    return saved;
   }
 
   sod_img copy_image(sod_img img){
-    return sod_copy_image(img);   
+    sod_img copy = img;
+    size_t no_floats = (size_t)img.w * img.h * img.c;
+    copy.data = acquire_buffer(no_floats);
+    if(copy.data != 0){
+      memcpy(copy.data, img.data, no_floats * sizeof(float));
+    }
+    return copy;
   }
 
   int get_image_width(sod_img img){
@@ -5,22 +5,114 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include "sod.h"
+#include "JpegEncode.h"
 
   #define IO_ERROR -1
   #define MAX_PIXEL_INTENSITY 255.0
+  #define FULL_COLOUR_CHANNELS 3
+  #define DEFAULT_COMPRESSION_QUALITY -1
+  // rows of created images are padded to a multiple of this many floats
+  // (one 64 byte cache line)
+  #define IMAGE_ROW_ALIGN 16
 
   // Create a new instance of a sod image of the specified width 
-  // and height, using the full RGB colour model.
+  // and height, using the full RGB colour model. The pixel values are
+  // unspecified (the buffer may be recycled), so callers must set them all.
+  // Rows are padded to image_stride(width) floats, which sod sees as the
+  // image's w, so the true width must be kept alongside it.
   sod_img create_image(int width, int height);
+
+  // Row stride (in floats) used by create_image for the given width
+  int image_stride(int width);
+
+  // Stream the calling thread's "[!]" error reports go to: stdout unless set
+  // (threads running a session's commands or jobs set it to the session's
+  // output, so that its client sees them); NULL goes back to stdout
+  void set_report_stream(FILE *out);
+  FILE *report_stream(void);
   
   // Free the memory used by sod image provided as argument
   void free_image(sod_img img);
   
   // Create a sod image from the the image file at the specified location.
   sod_img load_image(const char *path);  
+
+  // Create a sod image from an image file held in memory (size bytes at
+  // data), in any format load_image reads except the raw one
+  sod_img load_image_from_memory(const unsigned char *data, size_t size);
+
+  // Reads just the header of the image file at path: its dimensions and the
+  // number of channels it loads with (only raw pictures may have other than
+  // RGB's three). False if the file is missing or not a known image format.
+  bool probe_image(const char *path, int *width, int *height, int *channels);
+
+  // Create a sod image from the image file at the specified location, reduced
+  // by scale (1, 2, 4 or 8) with its dimensions rounded up. JPEGs are decoded
+  // straight to the reduced size, through an IDCT of only their lowest
+  // frequencies; other formats are loaded whole and then shrunk.
+  sod_img load_scaled_image(const char *path, int scale);
+
+  // Parse a load scale written as a fraction ("1/2", "1/4" or "1/8", or "1"
+  // for full size) into the divisor load_scaled_image takes
+  bool parse_image_scale(const char *text, int *scale);
+
+  // A rectangle of a picture: its top left corner and its size, in pixels
+  struct image_region {
+    int x;
+    int y;
+    int width;
+    int height;
+  };
+
+  // Parse a region written as WxH+X+Y (a width by height rectangle whose top
+  // left corner is at (X, Y)), as in ImageMagick's geometries
+  bool parse_image_region(const char *text, struct image_region *region);
+
+  // True if a region lies wholly inside a picture of the given size
+  bool region_fits(struct image_region region, int width, int height);
+
+  // True (after reporting it) if a region does not lie wholly inside a
+  // picture of the given size
+  bool region_outside(struct image_region region, int width, int height);
+
+  // Create a sod image of just the given region of the image file at the
+  // specified location, which must lie wholly inside the picture. JPEGs
+  // decode only the MCUs the region needs (rows above it are read past
+  // without being transformed, from the nearest restart marker where the
+  // file has them); other formats are loaded whole and then cropped.
+  sod_img load_image_region(const char *path, struct image_region region);
   
-  // Saves the given image in the given destination.
-  bool save_image(sod_img img, const char *path);
+  // File formats images can be saved in, chosen by the destination's
+  // extension: .png, .bmp, .tga, .ppm/.pgm/.pnm (binary Netpbm), .pam and
+  // .rawpic (the native, memory-mappable format of RawPic.h); any other
+  // extension is saved as a JPEG
+  enum image_format {
+    IMAGE_FORMAT_JPEG,
+    IMAGE_FORMAT_PNG,
+    IMAGE_FORMAT_BMP,
+    IMAGE_FORMAT_TGA,
+    IMAGE_FORMAT_PNM,
+    IMAGE_FORMAT_PAM,
+    IMAGE_FORMAT_RAW
+  };
+
+  // Format save_image would write the file at path in
+  enum image_format image_format_from_path(const char *path);
+
+  // Format named by a bare extension ("png", "jpg", ...), for output with no
+  // file name to take it from (false if there is no such format)
+  bool parse_image_format(const char *name, enum image_format *format);
+
+  // Saves the given image (of the given width, img.w being its row stride)
+  // in the given destination, in the format its extension selects (JPEGs
+  // being encoded as the profile describes).
+  bool save_image(sod_img img, int width, const char *path, const struct jpeg_profile *profile);
+
+  // Writes the given image to an open stream (a pipe, or memory from
+  // open_memstream) in the given format, which may be any but the raw one;
+  // the stream is flushed but left open.
+  bool save_image_to_stream(sod_img img, int width, FILE *stream, enum image_format format,
+                            const struct jpeg_profile *profile);
     
   // Clones the image provided as argument
   sod_img copy_image(sod_img img);
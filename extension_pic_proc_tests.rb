@@ -13,7 +13,7 @@ require 'benchmark'
 
 # SUPPORT FUNCTIONS:
 
-def run_test(test_name, pre_load, actual_images, expected_images, expected_outputs=[], not_expected_outputs=[])
+def run_test(test_name, pre_load, actual_images, expected_images, expected_outputs=[], not_expected_outputs=[], server_socket=nil)
   # report misconfugure test case
   if actual_images.length != expected_images.length then
     puts "Error: invalid supplied test data"
@@ -25,7 +25,11 @@ def run_test(test_name, pre_load, actual_images, expected_images, expected_outpu
   puts "run concurrent picture library:"
   actual = ""
   time = Benchmark.realtime do
-    actual = %x(./concurrent_picture_lib #{pre_load} < test_files/#{test_name}.txt 2>&1)
+    if server_socket then
+      actual = %x(./picture_client #{server_socket} test_files/#{test_name}.txt 2>&1)
+    else
+      actual = %x(./concurrent_picture_lib #{pre_load} < test_files/#{test_name}.txt 2>&1)
+    end
   end
   test_success = $?.exitstatus == 0 
   puts actual
@@ -89,6 +93,48 @@ def run_test(test_name, pre_load, actual_images, expected_images, expected_outpu
   puts ""
 end
 
+# check that the row padding of a raw picture file (past its width, up to its
+# stride) holds only zeros, rather than stale pixels of recycled buffers
+def check_raw_padding(test_name, image)
+  path = "test_images/#{image}"
+  clear = false
+  if File.exist?(path) then
+    data = File.binread(path)
+    width, height, channels, stride = data.unpack("x8L<4")
+    planes = data.byteslice(data.unpack1("x32Q<"), stride * height * channels * 4).unpack("e*")
+    clear = (0...height * channels).all? { |row| planes[row * stride + width, stride - width].all?(&:zero?) }
+  end
+  puts clear ? "  + raw padding of #{image} is clear" : "  - raw padding of #{image} holds stale pixels"
+  @testscores << {"score": clear ? 1 : 0, "name": "#{test_name}_padding", "possible": 1}
+  puts ""
+end
+
+# the entries of the first IFD of a JPEG's EXIF segment, as tag => value
+# (only SHORT values are read, others map to nil)
+def exif_entries(path)
+  data = File.binread(path)
+  exif = data.index("Exif\0\0".b)
+  return {} if exif.nil?
+  tiff = exif + 6
+  short, long = data[tiff, 2] == "MM" ? ["n", "N"] : ["v", "V"]
+  ifd = tiff + data[tiff + 4, 4].unpack1(long)
+  (0...data[ifd, 2].unpack1(short)).to_h do |i|
+    entry = ifd + 2 + i * 12
+    tag, type = data[entry, 4].unpack("#{short}2")
+    [tag, type == 3 ? data[entry + 8, 2].unpack1(short) : nil]
+  end
+end
+
+# check the EXIF entries a saved JPEG was left with
+def check_exif_entries(test_name, image, expected)
+  path = "test_images/#{image}"
+  entries = File.exist?(path) ? exif_entries(path) : {}
+  correct = entries == expected
+  puts correct ? "  + EXIF entries of #{image} correct" : "  - EXIF entries of #{image} are #{entries}, not #{expected}"
+  @testscores << {"score": correct ? 1 : 0, "name": "#{test_name}_#{image}", "possible": 1}
+  puts ""
+end
+
 
 #####################################################################
 
@@ -109,6 +155,8 @@ else
   run_test("exit_test","test_images/ducks1.jpg test_images/ducks2.jpg",[],[],[],["ducks1\n"]) #exit
   run_test("empty_input","",[],[]) #empty line robustness
   run_test("liststore","test_images/ducks1.jpg test_images/ducks2.jpg test_images/ducks3.jpg",[],[],["ducks1\n", "ducks2\n", "ducks3\n"]) #liststore
+  run_test("liststore_dimensions","test_images/ducks1.jpg",[],[],["ducks1 640x384, 3 channels\n", "half 320x192, 3 channels\n", "turned 384x640, 3 channels\n",
+                                                                 "[!] usage: liststore [-l]"]) #liststore -l
   run_test("load_test","",[],[],["funny_name"]) #load
   run_test("unload_test","test_images/ducks2.jpg test_images/ducks1.jpg test_images/test.jpg",[],[],["ducks1\n"],["ducks2\n"]) #unload
   run_test("save_test","test_images/some_ducks.jpg",["a_random_test_name.jpg"],["a_random_test_name.jpeg"]) #save  
@@ -120,20 +168,20 @@ else
   run_test("test_grayscale", "test_images/test.jpg", ["test_grayscale.jpg"], ["test_grayscale.jpeg"])
   run_test("test_load_and_grayscale", "", ["test_grayscale.jpg"], ["test_grayscale.jpeg"])
 
-  run_test("test_rotate_90", "test_images/test.jpg", ["test_rotate_90.jpg"], ["test_rotate_90.jpeg"])
-  run_test("test_load_and_rotate_90", "", ["test_rotate_90.jpg"], ["test_rotate_90.jpeg"])
+  run_test("test_rotate_90", "test_images/test.jpg", ["test_rotate_90.jpg"], ["test_rotate_90_lossless.jpeg"])
+  run_test("test_load_and_rotate_90", "", ["test_rotate_90.jpg"], ["test_rotate_90_lossless.jpeg"])
 
-  run_test("test_rotate_180", "test_images/test.jpg", ["test_rotate_180.jpg"], ["test_rotate_180.jpeg"])
-  run_test("test_load_and_rotate_180", "", ["test_rotate_180.jpg"], ["test_rotate_180.jpeg"])
+  run_test("test_rotate_180", "test_images/test.jpg", ["test_rotate_180.jpg"], ["test_rotate_180_lossless.jpeg"])
+  run_test("test_load_and_rotate_180", "", ["test_rotate_180.jpg"], ["test_rotate_180_lossless.jpeg"])
 
-  run_test("test_rotate_270", "test_images/test.jpg", ["test_rotate_270.jpg"], ["test_rotate_270.jpeg"])
-  run_test("test_load_and_rotate_270", "", ["test_rotate_270.jpg"], ["test_rotate_270.jpeg"])
+  run_test("test_rotate_270", "test_images/test.jpg", ["test_rotate_270.jpg"], ["test_rotate_270_lossless.jpeg"])
+  run_test("test_load_and_rotate_270", "", ["test_rotate_270.jpg"], ["test_rotate_270_lossless.jpeg"])
 
-  run_test("test_flipH", "test_images/test.jpg", ["test_flip_H.jpg"], ["test_flip_H.jpeg"])
-  run_test("test_load_and_flipH", "", ["test_flip_H.jpg"], ["test_flip_H.jpeg"])
+  run_test("test_flipH", "test_images/test.jpg", ["test_flip_H.jpg"], ["test_flip_H_lossless.jpeg"])
+  run_test("test_load_and_flipH", "", ["test_flip_H.jpg"], ["test_flip_H_lossless.jpeg"])
 
-  run_test("test_flipV", "test_images/test.jpg", ["test_flip_V.jpg"], ["test_flip_V.jpeg"])  
-  run_test("test_load_and_flipV", "", ["test_flip_V.jpg"], ["test_flip_V.jpeg"])
+  run_test("test_flipV", "test_images/test.jpg", ["test_flip_V.jpg"], ["test_flip_V_lossless.jpeg"])  
+  run_test("test_load_and_flipV", "", ["test_flip_V.jpg"], ["test_flip_V_lossless.jpeg"])
 
   run_test("test_blur", "test_images/test.jpg", ["test_blur.jpg"], ["test_blur.jpeg"])
   run_test("test_load_and_blur", "", ["test_blur.jpg"], ["test_blur.jpeg"])  
@@ -175,7 +223,84 @@ else
   puts ""    
   run_test("test_10_blurs", "", ["test_10_blurs.jpg"], ["test_10_blurs.jpeg"])
   run_test("example_input", "", ["boring.jpg", "psychedelic_art.jpg", "spot_the_difference.jpg", "need_glasses.jpg", "ducks3.jpg"], 
-                                ["boring.jpeg", "psychedelic_art.jpeg", "spot_the_difference.jpeg", "need_glasses.jpeg", "ducks3.jpeg"])    
+                                ["boring.jpeg", "psychedelic_art.jpeg", "spot_the_difference_lossless.jpeg", "need_glasses.jpeg", "ducks3.jpeg"])    
+  run_test("pool_stats", "", ["test_pool_stats.jpg"], ["test_10_blurs.jpeg"], ["9 hits, 2 misses"])
+  # pictures the rest of the script never uses are not decoded (one decode and
+  # one blur buffer in all)
+  run_test("lookahead_loads", "", ["lookahead_loads.jpg"], ["test_blur.jpeg"], ["0 hits, 2 misses"])
+  # transformations of pictures that are never saved are skipped (so only the
+  # kept picture's blur takes buffers), though unknown pictures still report
+  run_test("dead_work", "", ["dead_work.jpg"], ["test_blur.jpeg"], ["0 hits, 2 misses", "[!] no picture named nosuchpicture in the store"])
+  # reloads that fail leave the picture, and its pending transformations, in place
+  run_test("failed_reload", "", ["failed_reload.jpg"], ["test_inverted.jpeg"],
+           ["[!] error reading from file test_images/no_such_picture.jpg", "[!] region 64x64+600+0 is outside",
+            "[!] usage: load", "[!] no shared segment was passed to attach as kept"])
+  # copies of one picture put through the same transformations are decoded and
+  # blurred once, the rest of the copies being copied from it
+  run_test("shared_chains", "", ["shared_blur1.jpg", "shared_blur2.jpg", "shared_blur3.jpg", "shared_invert.jpg"],
+                                ["test_blur.jpeg", "test_blur.jpeg", "test_blur.jpeg", "test_inverted.jpeg"], ["1 hits, 4 misses"])
+  run_test("save_profiles", "", [], [], ["[!] usage: save <picture> <path> [quality (1-100)] [444|420]"],
+                                ["error saving", "could not be loaded"])
+  run_test("scaled_load", "", ["test_quarter.jpg"], ["test_quarter.jpeg"], ["[!] usage: load [--scale 1/2|1/4|1/8 | --region WxH+X+Y] <path> <picture>"])
+  run_test("region_load", "", ["test_region.jpg"], ["test_region.jpeg"], ["[!] region 64x64+600+0 is outside the 640x384 picture", "[!] usage: load"])
+  run_test("exif_orientation", "", ["ducks1_exif.jpg", "ducks1_exif.bmp"], ["ducks1.jpg", "ducks1_turned.bmp"], ["[!] usage: orientation exif|pixels"])
+  # turns are composed with a camera's Orientation tag (6, a quarter turn
+  # clockwise), and its other entries (Make and Artist) kept
+  run_test("exif_compose", "", ["ducks1_camera_turned.jpg", "ducks1_camera_untagged_turned.jpg"],
+                               ["ducks1_camera.jpg", "ducks1_camera_untagged.jpg"], [], ["[!]"])
+  check_exif_entries("exif_compose", "ducks1_camera_turned.jpg", {0x010F => nil, 0x0112 => 3, 0x013B => nil})
+  check_exif_entries("exif_compose", "ducks1_camera_untagged_turned.jpg", {0x010F => nil, 0x0112 => 6, 0x013B => nil})
+  run_test("lossless_transforms", "", ["ducks1_composed.jpg"], ["ducks1_flip_H.jpg"], [], ["error saving"])
+  # saves with an explicit quality turn and re-encode the pixels instead
+  # padded temporaries recycle the buffers of earlier pictures
+  run_test("raw_padding", "", [], [], [], ["[!]"])
+  check_raw_padding("raw_padding", "raw_padding.rawpic")
+  run_test("pixel_transforms", "", ["test_rotate_90_pixels.jpg", "test_rotate_180_pixels.jpg", "test_rotate_270_pixels.jpg",
+                                    "test_flip_H_pixels.jpg", "test_flip_V_pixels.jpg", "spot_the_difference_pixels.jpg"],
+                                   ["test_rotate_90.jpeg", "test_rotate_180.jpeg", "test_rotate_270.jpeg",
+                                    "test_flip_H.jpeg", "test_flip_V.jpeg", "spot_the_difference.jpeg"], [], ["[!]"])
+  # a load of a file the script is still saving to reads it once the saves
+  # issued before the load have been written
+  run_test("save_then_load", "", ["save_then_load_restored.png"], ["test.jpg"], [], ["[!]"])
+  # with a result cache, running a script again copies its saves instead of
+  # redoing them (so the held back load is never decoded nor the blur run)
+  system %Q(rm -rf test_result_cache)
+  ENV["PICTURE_CACHE_DIR"] = "test_result_cache"
+  run_test("result_cache", "", ["result_cache.jpg"], ["test_blur.jpeg"], ["result cache: 0 hits, 1 misses"])
+  run_test("result_cache", "", ["result_cache.jpg"], ["test_blur.jpeg"], ["result cache: 1 hits, 0 misses", "buffer pool: 0 hits, 0 misses"])
+  # a save served from the cache (the same blur as above) still takes its turn
+  # after saves to the same file issued before it
+  run_test("cached_save_order", "", ["cached_save_order.jpg"], ["test_blur.jpeg"], ["result cache: 1 hits, 0 misses"])
+  ENV.delete("PICTURE_CACHE_DIR")
+  system %Q(rm -rf test_result_cache)
+  # with a decode cache, running a script again maps the picture it loads
+  # instead of decoding it (so only the blur takes a buffer)
+  system %Q(rm -rf test_decode_cache)
+  ENV["PICTURE_DECODE_CACHE_DIR"] = "test_decode_cache"
+  run_test("decode_cache", "", ["decode_cache.jpg"], ["test_blur.jpeg"], ["decode cache: 0 hits, 1 misses"])
+  run_test("decode_cache", "", ["decode_cache.jpg"], ["test_blur.jpeg"], ["decode cache: 1 hits, 0 misses", "buffer pool: 0 hits, 1 misses"])
+  ENV.delete("PICTURE_DECODE_CACHE_DIR")
+  system %Q(rm -rf test_decode_cache)
+
+  # server mode tests (scripts submitted through the client to a running daemon):
+  puts "------------------------------"
+  puts "      Server Mode Tests       "
+  puts "------------------------------"
+  puts ""
+  socket = "/tmp/pic_proc_test_#{Process.pid}.sock"
+  server = spawn("./concurrent_picture_lib --serve #{socket}", :out => File::NULL)
+  sleep 0.1 until File.exist?(socket)
+  run_test("test_load_and_blur", "", ["test_blur.jpg"], ["test_blur.jpeg"], [], [], socket)
+  run_test("load_test", "", [], [], ["funny_name"], [], socket)
+  run_test("save_error", "", [], [], ["[!] error saving file to test_images/no_such_directory/inverted.png",
+                                      "[!] error saving file to test_images/no_such_directory/inverted.rawpic",
+                                      "[!] unsupported image format", "[!] region 64x64+600+0 is outside"], [], socket)
+  run_test("concurrent_blurs", "", ["test_blur1.jpg", "test_blur5.jpg", "test_blur10.jpg"],
+                                   ["test_blur.jpeg", "test_blur.jpeg", "test_blur.jpeg"], [], [], socket)
+  run_test("shm_blur", "", ["test_shm_blur.jpg"], ["test_blur.jpeg"], ["shared\n"], [],
+           "#{socket} --shm test_images/test.jpg test_images/test_shm_blur.jpg")
+  Process.kill("TERM", server)
+  Process.wait(server)
   
 end
 
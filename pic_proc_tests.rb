@@ -41,7 +41,10 @@ def run_test(test_name, cmd_line, expected_image, error_as_fail=true)
   if(expected_image) then
       
     puts "check final state of output image:"
-    actual_image = cmd_line.split(" ")[1]
+    # the output path follows the input path, after any options
+    args = cmd_line.split(" ")
+    args = args.drop(2) while args[0].to_s.start_with?("--")
+    actual_image = args[1]
     system %Q(./picture_compare #{actual_image} test_images/#{expected_image} 2>&1)
     test_success = $?.exitstatus == 0
     
@@ -88,14 +91,22 @@ else
   run_test("grayscale test 1", "test_images/test.jpg test_grayscale.jpg grayscale", "test_grayscale.jpeg")
   run_test("grayscale test 2", "test_images/me.jpg classic.jpg grayscale", "classic.jpeg")
   
-  run_test("rotate 90 test", "test_images/test.jpg test_rotate_90.jpg rotate 90", "test_rotate_90.jpeg")
-  run_test("rotate 180 test", "test_images/test.jpg test_rotate_180.jpg rotate 180", "test_rotate_180.jpeg")
-  run_test("rotate 270 test", "test_images/test.jpg test_rotate_270.jpg rotate 270", "test_rotate_270.jpeg")
+  run_test("rotate 90 test", "test_images/test.jpg test_rotate_90.jpg rotate 90", "test_rotate_90_lossless.jpeg")
+  run_test("rotate 180 test", "test_images/test.jpg test_rotate_180.jpg rotate 180", "test_rotate_180_lossless.jpeg")
+  run_test("rotate 270 test", "test_images/test.jpg test_rotate_270.jpg rotate 270", "test_rotate_270_lossless.jpeg")
 
-  run_test("flip H test 1", "test_images/test.jpg test_flip_H.jpg flip H", "test_flip_H.jpeg")
+  run_test("flip H test 1", "test_images/test.jpg test_flip_H.jpg flip H", "test_flip_H_lossless.jpeg")
   run_test("flip H test 2", "test_images/keep_calm.jpg keep_calm_H.jpg flip H", "keep_calm_H.jpeg")
-  run_test("flip V test 1", "test_images/test.jpg test_flip_V.jpg flip V", "test_flip_V.jpeg")
+  run_test("flip V test 1", "test_images/test.jpg test_flip_V.jpg flip V", "test_flip_V_lossless.jpeg")
   run_test("flip V test 2", "test_images/keep_calm.jpg keep_calm_V.jpg flip V", "keep_calm_V.jpeg")
+
+  # an explicit quality keeps rotations and flips off the lossless path, so
+  # the pixels are turned and re-encoded
+  run_test("rotate 90 pixel test", "--quality 100 test_images/test.jpg test_rotate_90_pixels.jpg rotate 90", "test_rotate_90.jpeg")
+  run_test("rotate 180 pixel test", "--quality 100 test_images/test.jpg test_rotate_180_pixels.jpg rotate 180", "test_rotate_180.jpeg")
+  run_test("rotate 270 pixel test", "--quality 100 test_images/test.jpg test_rotate_270_pixels.jpg rotate 270", "test_rotate_270.jpeg")
+  run_test("flip H pixel test", "--quality 100 test_images/test.jpg test_flip_H_pixels.jpg flip H", "test_flip_H.jpeg")
+  run_test("flip V pixel test", "--quality 100 test_images/test.jpg test_flip_V_pixels.jpg flip V", "test_flip_V.jpeg")
   
   run_test("blur test 1", "test_images/test.jpg test_blur.jpg blur", "test_blur.jpeg")
   run_test("blur test 2", "test_images/dip.jpg blip.jpg blur", "blip.jpeg")
@@ -116,6 +127,42 @@ else
     run_test("repeated parallel blur test #{blur_cnt}", "par-need_glasses#{blur_cnt-1}.jpg par-need_glasses#{blur_cnt}.jpg parallel-blur", "need_glasses#{blur_cnt}.jpeg")  
   end
   
+  puts "----------------------------------------"
+  puts "         Output Format Test Cases       " 
+  puts "----------------------------------------"
+  puts ""
+
+  # uncompressed intermediates are lossless, so undoing the first step in a
+  # second run must restore the original picture
+  system %Q(./picture_lib test_images/test.jpg test_inverted.pam invert > /dev/null)
+  run_test("pam intermediate test", "test_inverted.pam test_restored.png invert", "test.jpg")
+  system %Q(./picture_lib test_images/test.jpg test_flip_H.ppm flip H > /dev/null)
+  run_test("ppm intermediate test", "test_flip_H.ppm test_restored.bmp flip H", "test.jpg")
+  system %Q(./picture_lib test_images/test.jpg test_rotate_90.tga rotate 90 > /dev/null)
+  run_test("tga intermediate test", "test_rotate_90.tga test_restored.ppm rotate 270", "test.jpg")
+  system %Q(./picture_lib test_images/test.jpg test_flip_V.rawpic flip V > /dev/null)
+  run_test("raw intermediate test", "test_flip_V.rawpic test_restored.pam flip V", "test.jpg")
+
+  # "-" reads the input picture from stdin and writes the output to stdout
+  system %Q(./picture_lib --format pam test_images/test.jpg - invert 2> /dev/null > test_piped.pam)
+  run_test("stdin and stdout test", "- test_restored_piped.png invert < test_piped.pam", "test.jpg")
+
+  # with a result cache, a second run of the same command copies the first's output
+  system %Q(rm -rf test_result_cache)
+  ENV["PICTURE_CACHE_DIR"] = "test_result_cache"
+  system %Q(./picture_lib test_images/test.jpg test_blur_uncached.jpg blur > /dev/null)
+  run_test("result cache test", "test_images/test.jpg test_blur_cached.jpg blur", "test_blur.jpeg")
+  ENV.delete("PICTURE_CACHE_DIR")
+  system %Q(rm -rf test_result_cache)
+
+  # with a decode cache, a second run maps the picture the first one decoded
+  system %Q(rm -rf test_decode_cache)
+  ENV["PICTURE_DECODE_CACHE_DIR"] = "test_decode_cache"
+  system %Q(./picture_lib test_images/test.jpg test_blur_decoded.jpg blur > /dev/null)
+  run_test("decode cache test", "test_images/test.jpg test_blur_mapped.jpg blur", "test_blur.jpeg")
+  ENV.delete("PICTURE_DECODE_CACHE_DIR")
+  system %Q(rm -rf test_decode_cache)
+
   puts "----------------------------------------"
   puts "           IO ERROR Test Cases          " 
   puts "----------------------------------------"